@@ -0,0 +1,105 @@
+/*
+   MemoryAccount.h
+   Shared header for SHM DOS64
+   Copyright (c) 2023, Ilya Shamukov <ilya.shamukov@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+#include <atomic>
+#include <common_types.h>
+#include <kernel_export.h>
+#include <cpu.h>
+
+struct MemoryUsage
+{
+	size_t m_physicalPages;
+	size_t m_virtualSize;
+	size_t m_heapSize;
+
+	MemoryUsage& operator += (const MemoryUsage& other)
+	{
+		m_physicalPages += other.m_physicalPages;
+		m_virtualSize += other.m_virtualSize;
+		m_heapSize += other.m_heapSize;
+		return *this;
+	}
+};
+
+// memory charged to a process or a kernel module, counted per CPU
+class KERNEL_SHARED MemoryAccount
+{
+public:
+	MemoryAccount(const char* name);
+	~MemoryAccount();
+	const char* name() const
+	{
+		return m_name;
+	}
+	void chargePhysicalPages(ptrdiff_t pages)
+	{
+		add(PhysicalPages, pages);
+	}
+	void chargeVirtual(ptrdiff_t size)
+	{
+		add(VirtualSize, size);
+	}
+	void chargeHeap(ptrdiff_t size)
+	{
+		add(HeapSize, size);
+	}
+	MemoryUsage usage() const;
+	// allocations made by code in the range are charged to this account
+	void setCodeRange(uintptr_t base, size_t size);
+	void clearCodeRange();
+	static MemoryAccount& ofCode(const void* address);
+	static MemoryAccount& kernel();
+	// short id kept with each slab object, 0 stands for the kernel account when ids run out
+	uint8_t heapId() const
+	{
+		return m_heapId;
+	}
+	// nullptr when the account is gone
+	static MemoryAccount* ofHeapId(uint8_t id);
+
+private:
+	MemoryAccount(const MemoryAccount&) = delete;
+	MemoryAccount(MemoryAccount&&) = delete;
+	MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+private:
+	enum Counter
+	{
+		PhysicalPages,
+		VirtualSize,
+		HeapSize,
+		CounterCount
+	};
+
+	struct alignas(CPU_CACHE_LINE_SIZE) CpuCounters
+	{
+		std::atomic<ptrdiff_t> m_values[CounterCount];
+	};
+
+	void add(Counter counter, ptrdiff_t value);
+
+private:
+	const char* m_name;
+	uint8_t m_heapId = 0;
+	std::atomic<uintptr_t> m_codeBase{0};
+	std::atomic<uintptr_t> m_codeEnd{0};
+	CpuCounters m_cpuCounters[MAX_CPU] = {};
+};
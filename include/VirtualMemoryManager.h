@@ -31,17 +31,37 @@ enum : uintptr_t
 	VMM_READWRITE = 0x04,
 	VMM_EXECUTE = 0x10,
 	VMM_NOCACHE = 0x200,
-	VMM_COMMIT = 0x10000
+	VMM_COMMIT = 0x10000,
+	VMM_NUMA_NODE_SHIFT = 24,
+	VMM_NUMA_NODE_MASK = 0xFF000000
+};
+
+// commits pages on the given NUMA node instead of the allocating CPU's one
+static inline uintptr_t vmmNumaNode(unsigned int node)
+{
+	return ((static_cast<uintptr_t>(node) + 1) << VMM_NUMA_NODE_SHIFT) & VMM_NUMA_NODE_MASK;
+}
+
+struct VirtualMemoryRange
+{
+	void* m_base;
+	size_t m_size;
 };
 
 class PagingManager64;
+class MemoryAccount;
 class VirtualMemoryManagerPrivate;
 class KERNEL_SHARED VirtualMemoryManager
 {
 public:
+	// ranges are charged to the module of the caller unless an account is given
 	void* alloc(size_t size, uintptr_t flags);
+	void* alloc(size_t size, uintptr_t flags, MemoryAccount& account);
 	bool free(void* pointer);
+	bool free(void* pointer, MemoryAccount& account);
 	void freeRamPages(void* base, size_t size, bool realloc = true);
+	// returns the number of RAM pages given back
+	size_t freeRamPages(const VirtualMemoryRange* ranges, size_t count, bool realloc = true);
 	void* mapMmio(uintptr_t mmioBase, size_t size, MemoryType memoryType = MemoryType::CacheDisabled);
 	bool unmapMmio(void *pointer);
 	bool setPagesFlags(void* pointer, size_t size, uintptr_t flags);
@@ -53,6 +53,7 @@ enum : uint64_t
 	PAGE_FLAG_GLOBAL = (1 << 8),
 	PAGE_FLAG_ALLOCATED = (1 << 9),
 	PAGE_FLAG_MEMZERO = (1 << 10),
+	PAGE_FLAG_COPY_ON_WRITE = (1 << 11),
 	PAGE_FLAG_WC = PAGE_FLAG_WT | PAGE_FLAG_CACHE_DISABLE,
 };
 
@@ -103,7 +104,8 @@ enum : uint32_t
 enum : unsigned int
 {
 	BOOT_CPU_ID = 0,
-	MAX_CPU = 255
+	MAX_CPU = 255,
+	MAX_NUMA_NODES = 16
 };
 
 enum : unsigned int
@@ -114,7 +116,9 @@ enum : unsigned int
 	CPU_EXTERN_TASK_SW_VECTOR = 0xF2,
 	CPU_STOP_VECTOR	= 0xF3,
 	CPU_TLB_SHOOTDOWN_VECTOR = 0xF4,
-	CPU_SYSTEM_SHUTDOWN_VECTOR = 0xF5
+	CPU_SYSTEM_SHUTDOWN_VECTOR = 0xF5,
+	CPU_LOCAL_TIMER_VECTOR = 0xF6,
+	CPU_PAGE_CACHE_DRAIN_VECTOR = 0xF7
 };
 
 static inline uint64_t cpuGetCR0()
@@ -222,6 +226,21 @@ static inline void cpuFlushTLB(uintptr_t addr)
 	asm volatile("invlpg [%0]" ::"r" (addr) : "memory");
 }
 
+// size must be multiple of 32 bytes
+static inline void cpuZeroMemoryNonTemporal(void* ptr, size_t size)
+{
+	uint64_t* dst = static_cast<uint64_t*>(ptr);
+	uint64_t* const end = dst + (size / sizeof (uint64_t));
+	for (; dst != end; dst += 4)
+	{
+		asm volatile("movnti [%0], %1\n"
+			"movnti [%0 + 8], %1\n"
+			"movnti [%0 + 16], %1\n"
+			"movnti [%0 + 24], %1" :: "r"(dst), "r"(0ULL) : "memory");
+	}
+	asm volatile("sfence" ::: "memory");
+}
+
 struct GdtDescripor;
 struct IdtDescripor;
 
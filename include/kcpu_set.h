@@ -0,0 +1,95 @@
+/*
+   kcpu_set.h
+   Shared header for SHM DOS64
+   Copyright (c) 2023, Ilya Shamukov <ilya.shamukov@gmail.com>
+   
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option) 
+   any later version.
+   
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for 
+   more details.
+   
+   You should have received a copy of the GNU General Public License along with 
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple 
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+#include <common_types.h>
+#include <cpu.h>
+
+// set of CPUs a thread may run on
+class kcpu_set
+{
+public:
+	kcpu_set() = default;
+
+	static kcpu_set all()
+	{
+		kcpu_set result;
+		for (uint64_t& word : result.m_words)
+			word = ~0ULL;
+		return result;
+	}
+
+	static kcpu_set single(unsigned int cpuId)
+	{
+		kcpu_set result;
+		result.set(cpuId);
+		return result;
+	}
+
+	void set(unsigned int cpuId)
+	{
+		m_words[cpuId / WordBits] |= (1ULL << (cpuId % WordBits));
+	}
+
+	void reset(unsigned int cpuId)
+	{
+		m_words[cpuId / WordBits] &= ~(1ULL << (cpuId % WordBits));
+	}
+
+	bool test(unsigned int cpuId) const
+	{
+		return ((m_words[cpuId / WordBits] & (1ULL << (cpuId % WordBits))) != 0);
+	}
+
+	// the first CPU of the set below cpuCount or cpuCount if there is none
+	unsigned int first(unsigned int cpuCount) const
+	{
+		for (unsigned int cpuId = 0; cpuId < cpuCount; ++cpuId)
+		{
+			if (test(cpuId))
+				return cpuId;
+		}
+		return cpuCount;
+	}
+
+	bool operator==(const kcpu_set& other) const
+	{
+		for (size_t idx = 0; idx < WordCount; ++idx)
+		{
+			if (m_words[idx] != other.m_words[idx])
+				return false;
+		}
+		return true;
+	}
+
+	bool operator!=(const kcpu_set& other) const
+	{
+		return !(*this == other);
+	}
+
+private:
+	enum : unsigned int
+	{
+		WordBits = 64,
+		WordCount = (MAX_CPU + WordBits - 1) / WordBits
+	};
+
+	uint64_t m_words[WordCount] = {};
+};
@@ -31,6 +31,14 @@ enum : uint64_t
     KERNEL_MAX_VIRTUAL_MEMORY = (511ULL << 30)
 };
 
+enum class BootMemoryType : uint32_t
+{
+    Kernel,     // kernel image, stack, page tables and boot video data
+    Loader,     // loader data read by the kernel only during startup
+    Module,     // boot module images and the module table
+    LowMemory   // free memory below 1 MiB
+};
+
 struct KernelParams
 {
     struct Video
@@ -58,6 +66,15 @@ struct KernelParams
         };
         PhysicalMemoryRegion* m_physicalMemoryRegions;
         size_t m_regions;
+
+        struct BootMemoryRegion
+        {
+            uintptr_t m_start;
+            uintptr_t m_end;
+            BootMemoryType m_type;
+        };
+        BootMemoryRegion* m_bootRegions;
+        size_t m_bootRegionCount;
     } m_physicalMemory;
     
     struct VirtualMemory
@@ -19,3 +19,48 @@
 */
 
 #pragma once
+#include <utility>
+#include <common_types.h>
+#include <kernel_export.h>
+
+enum : size_t
+{
+	CPU_CACHE_LINE_SIZE = 64
+};
+
+// grows the heap block in place, never moves it
+bool KERNEL_SHARED kexpand(void* ptr, size_t size);
+void* KERNEL_SHARED krealloc(void* ptr, size_t size);
+
+// keeps a per-CPU or hot shared value on its own cache line
+template<typename T>
+struct alignas(CPU_CACHE_LINE_SIZE) kcache_aligned
+{
+	template<typename... Args>
+	kcache_aligned(Args&&... args)
+		: m_value(std::forward<Args>(args)...)
+	{
+	}
+
+	T& get()
+	{
+		return m_value;
+	}
+
+	const T& get() const
+	{
+		return m_value;
+	}
+
+	T* operator->()
+	{
+		return &m_value;
+	}
+
+	const T* operator->() const
+	{
+		return &m_value;
+	}
+
+	T m_value;
+};
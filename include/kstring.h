@@ -107,6 +107,7 @@ public:
 		{
 			const size_t otherSize = other.size() + 1;
 			const size_t curSize = size();
+			_grow(curSize + otherSize);
 			m_data.resize(curSize + otherSize);
 			kmemcpy(&m_data[curSize], other.m_data.data(), otherSize * sizeof(T));
 		}
@@ -117,6 +118,7 @@ public:
 	{
 		const size_t otherSize = kstrlen(other) + 1;
 		const size_t curSize = size();
+		_grow(curSize + otherSize);
 		m_data.resize(curSize + otherSize);
 		kmemcpy(&m_data[curSize], other, otherSize * sizeof(T));
 		return *this;
@@ -142,6 +144,13 @@ public:
 		return ((size() == other.size()) && (kstrcmp(c_str(), other.c_str()) == 0));
 	}
 
+private:
+	void _grow(size_t size)
+	{
+		if (size > m_data.capacity())
+			m_data.reserve(kmax(size, m_data.capacity() * 2));
+	}
+
 private:
 	kvector<T> m_data;
 };
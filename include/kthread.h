@@ -21,6 +21,7 @@
 #pragma once
 #include <functional>
 #include <common_types.h>
+#include <kcpu_set.h>
 
 enum
 {
@@ -37,6 +38,20 @@ class kthread
 public:
    typedef uintptr_t id;
 
+	enum class SchedulingClass
+	{
+		Realtime,	// runs before other classes, FIFO within a priority, no time slice
+		Normal,		// earliest deadline first, the priority scales the deadline
+		Background	// runs only when nothing else is ready on the CPU
+	};
+
+	enum : int
+	{
+		MinPriority = 0,
+		DefaultPriority = 16,
+		MaxPriority = 31
+	};
+
 public:
 	kthread();
 	kthread(kthread&& oth);
@@ -46,6 +61,14 @@ public:
 	kthread(Process& process, const std::function<void()>& entry, bool enqueue = true, size_t kernelStackSize = DEFAULT_KERNEL_THREAD_STASK_SIZE, size_t userStackSize = 0);
 	~kthread();
 	void join();
+	// a running thread is rescheduled at once with the new rank and time slice, a queued one keeps its place until it runs
+	void setSchedulingClass(SchedulingClass schedulingClass);
+	void setPriority(int priority);
+	SchedulingClass schedulingClass() const;
+	int priority() const;
+	// fails if none of the CPUs is present
+	bool setAffinity(const kcpu_set& cpus);
+	kcpu_set affinity() const;
 
 private:
 	kthread(const kthread&) = delete;
@@ -60,4 +83,5 @@ private:
 namespace kthis_thread
 {
    kthread::id get_id();
+   void pin_to_current_cpu();
 }
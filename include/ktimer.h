@@ -0,0 +1,47 @@
+/*
+   ktimer.h
+   Timer implementation header for SHM DOS64
+   Copyright (c) 2023, Ilya Shamukov <ilya.shamukov@gmail.com>
+   
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option) 
+   any later version.
+   
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for 
+   more details.
+   
+   You should have received a copy of the GNU General Public License along with 
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple 
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+#include <functional>
+#include <common_types.h>
+#include <kernel_export.h>
+
+class TimerObject;
+// one-shot timer, the callback runs in interrupt context on the CPU which started the timer and must not wait;
+// start and cancel of one timer are not to be called concurrently
+class KERNEL_SHARED ktimer
+{
+public:
+	ktimer(const std::function<void()>& callback);
+	// waits for a running callback, not to be destroyed from its own callback
+	~ktimer();
+	// timeout in system timer units as for kevent, restarts a pending timer
+	void start(TimePoint timeout);
+	bool cancel();
+	bool pending() const;
+
+private:
+	ktimer(const ktimer&) = delete;
+	ktimer(ktimer&&) = delete;
+	ktimer& operator=(const ktimer&) = delete;
+
+private:
+	TimerObject* m_private;
+};
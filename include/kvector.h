@@ -23,7 +23,9 @@
 #include <common_types.h>
 #include <kalgorithm.h>
 #include <utility>
+#include <new>
 #include <kclib.h>
+#include <kmemory.h>
 
 template<typename T>
 class kvector
@@ -116,6 +118,11 @@ public:
 		return m_size;
 	}
 
+	size_t capacity() const
+	{
+		return m_allocSize;
+	}
+
 	void push_back(const T& item)
 	{
 		if (m_size == m_allocSize)
@@ -197,6 +204,12 @@ public:
 	{
 		if (size > m_allocSize)
 		{
+			if ((m_buf != nullptr) && _expand(m_buf, size))
+			{
+				m_allocSize = size;
+				return;
+			}
+
 			auto tmp = _alloc(size);
 			if (m_buf != nullptr)
 			{
@@ -224,12 +237,18 @@ private:
 private:
 	T* _alloc(size_t size)
 	{
-		return static_cast<T*> ((operator new[])(size * sizeof (T)));
+		if constexpr (alignof (T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			return static_cast<T*> ((operator new[])(size * sizeof (T), std::align_val_t(alignof (T))));
+		else
+			return static_cast<T*> ((operator new[])(size * sizeof (T)));
 	}
 
 	void _free(T* p)
 	{
-		(operator delete[])(p);
+		if constexpr (alignof (T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			(operator delete[])(p, std::align_val_t(alignof (T)));
+		else
+			(operator delete[])(p);
 	}
 
 	template<typename DestructType>
@@ -304,6 +323,20 @@ private:
 		}
 	}
 
+	template<typename ExpandType>
+	bool _expand(ExpandType* p, size_t size,
+				 typename std::enable_if<std::is_trivial<ExpandType>::value>::type* = nullptr)
+	{
+		return kexpand(p, size * sizeof (ExpandType));
+	}
+
+	template<typename ExpandType>
+	bool _expand(ExpandType*, size_t,
+				 typename std::enable_if<!std::is_trivial<ExpandType>::value>::type* = nullptr)
+	{
+		return false;
+	}
+
 	template<typename CopyType>
 	void _copy_buf(CopyType* to, const CopyType* from, size_t size,
 				   typename std::enable_if<std::is_trivial<CopyType>::value>::type* = nullptr)
@@ -21,6 +21,7 @@
 
 #pragma once
 #include <kstring.h>
+#include <MemoryAccount.h>
 
 class AbstractModule
 {
@@ -33,6 +34,7 @@ public:
 	virtual void load() = 0;
 	virtual void unload() = 0;
 	virtual void onSystemMessage(int, int, void*) = 0;
+	virtual MemoryAccount& memoryAccount() = 0;
 	
 private:
 	AbstractModule(const AbstractModule&) = delete;
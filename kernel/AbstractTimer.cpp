@@ -25,6 +25,11 @@
 #include <conout.h>
 static AbstractTimer* g_systemTimer = nullptr;
 
+enum
+{
+   TscResyncTimeMs = 10
+};
+
 static bool isSupportRdtscp()
 {
    uint32_t eax = CPUID_PROCESSOR_INFOEX_EAX;
@@ -70,18 +75,12 @@ void AbstractTimer::updateTimePoint()
       const unsigned int cpuCount = cpuLogicalCount();
       for (unsigned int cpu = 0; cpu < cpuCount; ++cpu)
          m_cpuTscState[cpu].m_lastCpuTimestamp.store(0, std::memory_order_relaxed);
-         
    }
-   else
-   {
-	   m_lastTimepoint.store(timepoint(), std::memory_order_relaxed);
-   } 
 }
 
 void AbstractTimer::onInterrupt()
 {
 	AbstractTimer::system()->updateTimePoint();
-	TaskManager::onSystemTimerInterrupt();
 }
 
 TimePoint AbstractTimer::fastTimepoint()
@@ -94,7 +93,8 @@ TimePoint AbstractTimer::fastTimepoint()
       {
          CpuTscState& tscState = m_cpuTscState[cpuId];
          const TimePoint oldTsc = tscState.m_lastCpuTimestamp.load(std::memory_order_acquire);
-         if (oldTsc == 0)
+         // nothing ticks periodically, each CPU resyncs with the timer on its own
+         if ((oldTsc == 0) || ((tsc - oldTsc) >= tscState.m_resyncTsc))
          {
             const TimePoint tp = timepoint();
             unsigned int testCpuId;
@@ -115,7 +115,7 @@ TimePoint AbstractTimer::fastTimepoint()
       }
    }
 
-   return m_lastTimepoint.load(std::memory_order_acquire);
+   return timepoint();
 }
 
 void AbstractTimer::onInitCpu(unsigned int cpuId)
@@ -178,4 +178,5 @@ void AbstractTimer::onInitCpu(unsigned int cpuId)
 
    CpuTscState& tscState = m_cpuTscState[cpuId];
    tscState.m_tscDivider = tscDivider;
+   tscState.m_resyncTsc = tscDivider * fromMilliseconds(TscResyncTimeMs);
 }
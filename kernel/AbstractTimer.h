@@ -82,11 +82,11 @@ private:
 	TimePoint m_msDivider = 0;
 	TimePoint m_usDivider = 0;
 	TimePoint m_ns100Divider = 0;
-	std::atomic<TimePoint> m_lastTimepoint{0};
 
-	struct CpuTscState
+	struct alignas(CPU_CACHE_LINE_SIZE) CpuTscState
 	{
 		TimePoint m_tscDivider;
+		TimePoint m_resyncTsc;
 		std::atomic<TimePoint> m_lastCpuTimestamp{0};
 		std::atomic<TimePoint> m_lastTimerTimestamp{0};
 	} m_cpuTscState[MAX_CPU];
@@ -136,6 +136,55 @@ struct HpetTable
 	uint8_t m_attribute;
 };
 
+struct Srat
+{
+	AcpiTableHeader m_header;
+	uint32_t m_reserved1;
+	uint64_t m_reserved2;
+	uint8_t m_affinityData[1];
+};
+
+struct SratLapicAffinity
+{
+	ApicTableHeader m_header;
+	uint8_t m_domainLo;
+	uint8_t m_apicID;
+	uint32_t m_flags;
+	uint8_t m_sapicEid;
+	uint8_t m_domainHi[3];
+	uint32_t m_clockDomain;
+};
+
+struct SratMemoryAffinity
+{
+	ApicTableHeader m_header;
+	uint32_t m_domain;
+	uint16_t m_reserved1;
+	uint64_t m_base;
+	uint64_t m_length;
+	uint32_t m_reserved2;
+	uint32_t m_flags;
+	uint64_t m_reserved3;
+};
+
+struct SratX2ApicAffinity
+{
+	ApicTableHeader m_header;
+	uint16_t m_reserved1;
+	uint32_t m_domain;
+	uint32_t m_x2apicID;
+	uint32_t m_flags;
+	uint32_t m_clockDomain;
+	uint32_t m_reserved2;
+};
+
+struct Slit
+{
+	AcpiTableHeader m_header;
+	uint64_t m_localities;
+	uint8_t m_distances[1];
+};
+
 #pragma pack(pop) 
 
 AcpiTables::AcpiTables()
@@ -160,6 +209,8 @@ AcpiTables::AcpiTables()
 	parseApic();
 	parseMcfg();
 	parseHpet();
+	parseSrat();
+	parseSlit();
 }
 
 const void* AcpiTables::getTable(const TableSignature signature) const
@@ -278,6 +329,146 @@ void AcpiTables::parseHpet()
 	println("HPET found, MMIO = ", hex(m_hpetMmioBase, false));
 }
 
+unsigned int AcpiTables::numaNode(uint32_t domain)
+{
+	for (size_t node = 0; node < m_numaDomains.size(); ++node)
+	{
+		if (m_numaDomains[node] == domain)
+			return static_cast<unsigned int>(node);
+	}
+
+	if (m_numaDomains.size() == MAX_NUMA_NODES)
+	{
+		println(L"Too many NUMA proximity domains, domain ", domain, L" is folded into node 0");
+		return 0;
+	}
+	m_numaDomains.push_back(domain);
+	return static_cast<unsigned int>(m_numaDomains.size() - 1);
+}
+
+void AcpiTables::parseSrat()
+{
+	enum
+	{
+		LapicAffinityType = 0,
+		MemoryAffinityType = 1,
+		X2ApicAffinityType = 2
+	};
+	const uint32_t affinityEnableFlag = 0x01;
+	static const TableSignature sratSignature = {'S', 'R', 'A', 'T'};
+	m_cpuNumaNodes.resize(m_cpuApicIds.size());
+	for (unsigned int& node : m_cpuNumaNodes)
+		node = 0;
+	const Srat* srat = static_cast<const Srat*>(getTable(sratSignature));
+	if (srat == nullptr)
+		return;
+
+	const uint8_t* dataPtr = srat->m_affinityData;
+	const uint8_t* dataEndPtr = reinterpret_cast<const uint8_t*>(srat) + srat->m_header.m_length;
+	while (dataPtr < dataEndPtr)
+	{
+		const ApicTableHeader* header = reinterpret_cast<const ApicTableHeader*>(dataPtr);
+		if (header->m_length < sizeof (*header))
+			PANIC(L"Empty SRAT header");
+
+		LocalApic::ApicCpuId apicId = 0;
+		uint32_t cpuDomain = 0;
+		bool cpuAffinity = false;
+		if ((header->m_type == LapicAffinityType) && (header->m_length == sizeof(SratLapicAffinity)))
+		{
+			const SratLapicAffinity* affinity = reinterpret_cast<const SratLapicAffinity*>(header);
+			cpuAffinity = ((affinity->m_flags & affinityEnableFlag) != 0);
+			apicId = affinity->m_apicID;
+			cpuDomain = affinity->m_domainLo | (uint32_t(affinity->m_domainHi[0]) << 8) | (uint32_t(affinity->m_domainHi[1]) << 16) | (uint32_t(affinity->m_domainHi[2]) << 24);
+		}
+		else if ((header->m_type == X2ApicAffinityType) && (header->m_length == sizeof(SratX2ApicAffinity)))
+		{
+			const SratX2ApicAffinity* affinity = reinterpret_cast<const SratX2ApicAffinity*>(header);
+			cpuAffinity = ((affinity->m_flags & affinityEnableFlag) != 0);
+			apicId = affinity->m_x2apicID;
+			cpuDomain = affinity->m_domain;
+		}
+		else if ((header->m_type == MemoryAffinityType) && (header->m_length == sizeof(SratMemoryAffinity)))
+		{
+			const SratMemoryAffinity* affinity = reinterpret_cast<const SratMemoryAffinity*>(header);
+			if (((affinity->m_flags & affinityEnableFlag) != 0) && (affinity->m_length != 0))
+			{
+				const NumaMemoryRange range{affinity->m_base, affinity->m_base + affinity->m_length, numaNode(affinity->m_domain)};
+				println(L"NUMA memory ", hex(range.m_start, false), L"-", hex(range.m_end, false), L" -> node ", range.m_node);
+				m_numaMemoryRanges.push_back(range);
+			}
+		}
+
+		if (cpuAffinity)
+		{
+			for (size_t idx = 0; idx < m_cpuApicIds.size(); ++idx)
+			{
+				if (m_cpuApicIds[idx] == apicId)
+				{
+					m_cpuNumaNodes[idx] = numaNode(cpuDomain);
+					println(L"NUMA CPU LAPIC_ID = ", apicId, L" -> node ", m_cpuNumaNodes[idx]);
+					break;
+				}
+			}
+		}
+		dataPtr += header->m_length;
+	}
+}
+
+void AcpiTables::parseSlit()
+{
+	const unsigned int nodeCount = numaNodeCount();
+	m_numaDistances.resize(nodeCount * nodeCount);
+	for (unsigned int from = 0; from < nodeCount; ++from)
+	{
+		for (unsigned int to = 0; to < nodeCount; ++to)
+			m_numaDistances[from * nodeCount + to] = (from == to) ? NumaLocalDistance : NumaRemoteDistance;
+	}
+
+	static const TableSignature slitSignature = {'S', 'L', 'I', 'T'};
+	const Slit* slit = static_cast<const Slit*>(getTable(slitSignature));
+	if ((slit == nullptr) || m_numaDomains.empty())
+		return;
+
+	const uint64_t localities = slit->m_localities;
+	if ((sizeof(*slit) - sizeof(slit->m_distances) + localities * localities) > slit->m_header.m_length)
+	{
+		println(L"Invalid SLIT table");
+		return;
+	}
+
+	for (unsigned int from = 0; from < nodeCount; ++from)
+	{
+		for (unsigned int to = 0; to < nodeCount; ++to)
+		{
+			const uint64_t fromDomain = m_numaDomains[from];
+			const uint64_t toDomain = m_numaDomains[to];
+			if ((fromDomain < localities) && (toDomain < localities))
+				m_numaDistances[from * nodeCount + to] = slit->m_distances[fromDomain * localities + toDomain];
+		}
+	}
+}
+
+unsigned int AcpiTables::apicNumaNode(LocalApic::ApicCpuId apicId) const
+{
+	for (size_t idx = 0; idx < m_cpuApicIds.size(); ++idx)
+	{
+		if (m_cpuApicIds[idx] == apicId)
+			return m_cpuNumaNodes[idx];
+	}
+
+	return 0;
+}
+
+unsigned int AcpiTables::numaDistance(unsigned int fromNode, unsigned int toNode) const
+{
+	const unsigned int nodeCount = numaNodeCount();
+	if ((fromNode >= nodeCount) || (toNode >= nodeCount))
+		return NumaRemoteDistance;
+
+	return m_numaDistances[fromNode * nodeCount + toNode];
+}
+
 AcpiTables& AcpiTables::instance()
 {
 	static AcpiTables acpi;
@@ -54,6 +54,19 @@ public:
 		unsigned int m_irqBase;
 	};
 
+	struct NumaMemoryRange
+	{
+		uintptr_t m_start;
+		uintptr_t m_end;
+		unsigned int m_node;
+	};
+
+	enum : unsigned int
+	{
+		NumaLocalDistance = 10,
+		NumaRemoteDistance = 20
+	};
+
 public:
 	AcpiTables();
 	static AcpiTables& instance();
@@ -83,6 +96,19 @@ public:
 		return m_hpetMmioBase;
 	}
 
+	unsigned int numaNodeCount() const
+	{
+		return kmax<unsigned int>(static_cast<unsigned int>(m_numaDomains.size()), 1);
+	}
+
+	const kvector<NumaMemoryRange>& numaMemoryRanges() const
+	{
+		return m_numaMemoryRanges;
+	}
+
+	unsigned int apicNumaNode(LocalApic::ApicCpuId apicId) const;
+	unsigned int numaDistance(unsigned int fromNode, unsigned int toNode) const;
+
 private:
 	typedef uint8_t TableSignature[4];
 	AcpiTables(const AcpiTables& orig) = delete;
@@ -91,6 +117,9 @@ private:
 	void parseApic();
 	void parseMcfg();
 	void parseHpet();
+	void parseSrat();
+	void parseSlit();
+	unsigned int numaNode(uint32_t domain);
 
 private:
 	kvector<const AcpiTableHeader*> m_tables;
@@ -99,4 +128,8 @@ private:
 	kvector<ApicIsaRemappingEntry> m_isaRemapping;
 	kvector<SystemEnhancedPciSegment> m_pciEnhancedSegments;
 	uintptr_t m_hpetMmioBase = 0;
+	kvector<uint32_t> m_numaDomains;
+	kvector<unsigned int> m_cpuNumaNodes;
+	kvector<NumaMemoryRange> m_numaMemoryRanges;
+	kvector<uint8_t> m_numaDistances;
 };
@@ -23,6 +23,7 @@
 #include <kalgorithm.h>
 #include <conout.h>
 #include "ExceptionHandlers.h"
+#include "gdt.h"
 #include "paging.h"
 #include "TaskManager.h"
 
@@ -191,5 +192,7 @@ namespace ExceptionHandlers
 		SystemIDT::setHandler(18, &SystemHardwareExeption, true);
 		SystemIDT::setHandler(19, &SystemSSEExeption, true);
 		SystemIDT::setHandler(20, &SystemVirtualizationExeption, true);
+		SystemIDT::setInterruptStack(8, SYSTEM_EXCEPTION_IST);
+		SystemIDT::setInterruptStack(14, SYSTEM_EXCEPTION_IST);
 	}
 }
\ No newline at end of file
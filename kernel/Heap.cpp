@@ -21,15 +21,20 @@
 
 #include <cpu.h>
 #include <kalgorithm.h>
+#include <kclib.h>
 #include <limits>
+#include <functional>
+#include "AbstractTimer.h"
 #include "panic.h"
+#include "SlabAllocator.h"
 #include "Heap.h"
 
 enum : uint64_t
 {
 	HEAP_MARKER_BUSY = 0xFFFFFFFFFFFFFFFFULL,
 	HEAP_ALLOC_UNIT_SIZE = 0x101000,
-	HEAP_MEM_REGION_LIMIT = 0x100000
+	HEAP_MEM_REGION_LIMIT = 0x100000,
+	HEAP_LARGE_PAGE_SIZE = 0x200000
 };
 
 static const int g_heapMaxIterations = 32;
@@ -115,7 +120,9 @@ void* Heap::allocHuge(size_t size)
 {
 	klock_guard lock(m_mutex);
 	const size_t virtualSize = cpuAlignAddrHi<size_t>(size + MemRegionAlign);
-	MemoryRegionHeader* region = static_cast<MemoryRegionHeader*>(m_vmm.alloc(virtualSize, VMM_READWRITE));
+	// committed regions are mapped by large pages
+	const uintptr_t vmmFlags = (virtualSize >= HEAP_LARGE_PAGE_SIZE) ? (VMM_READWRITE | VMM_COMMIT) : VMM_READWRITE;
+	MemoryRegionHeader* region = static_cast<MemoryRegionHeader*>(m_vmm.alloc(virtualSize, vmmFlags));
 	m_virtualMemorySize += virtualSize;
 	MemoryRegionHeader* nullRegion = reinterpret_cast<MemoryRegionHeader*>(reinterpret_cast<uintptr_t>(region) + size);
 	region->m_addrPrev = nullptr;
@@ -165,50 +172,125 @@ void Heap::addMemRegion(MemoryRegionHeader* region)
 	m_freeListTable[tblIndex] = region;
 }
 
-void Heap::cleanMemRegion(void* ptr, MemoryRegionHeader* region)
+size_t Heap::purgeFreeRegions()
 {
-	const uintptr_t fpBase = cpuAlignPtrHiInt(ptr);
-	const uintptr_t fpEnd = cpuAlignPtrLoInt(region->m_addrNext);
-	if (fpEnd > fpBase)
-		m_vmm.freeRamPages(reinterpret_cast<void*>(fpBase), fpEnd - fpBase);
+	// decommit whole pages inside every free region, largest regions first;
+	// smaller lists can't hold a whole page, the list of PAGE_SHIFT may
+	VirtualMemoryRange ranges[PurgeBatchSize];
+	size_t count = 0;
+	size_t released = 0;
+	for (size_t idx = HeapLogTableSize - 1; idx >= PAGE_SHIFT; --idx)
+	{
+		for (MemoryRegionHeader* region = m_freeListTable[idx]; region != nullptr; region = region->m_szNext)
+		{
+			const uintptr_t fpBase = cpuAlignAddrHi<uintptr_t>(reinterpret_cast<uintptr_t>(region) + MemRegionAlign);
+			const uintptr_t fpEnd = cpuAlignPtrLoInt(region->m_addrNext);
+			if (fpEnd <= fpBase)
+				continue;
+
+			ranges[count++] = VirtualMemoryRange{reinterpret_cast<void*>(fpBase), fpEnd - fpBase};
+			if (count == PurgeBatchSize)
+			{
+				released += m_vmm.freeRamPages(ranges, count);
+				count = 0;
+			}
+		}
+	}
+	if (count != 0)
+		released += m_vmm.freeRamPages(ranges, count);
+	m_pendingDecommitSize = 0;
+	return released;
 }
 
-void Heap::cleanMemRegionUN(void* ptr, MemoryRegionHeader* region)
+void Heap::purge()
 {
-	const uintptr_t fpBase = cpuAlignPtrHiInt(ptr);
-	const size_t unionAdd = kmin<size_t>(region->m_addrNext->size(), PAGE_MASK);
-	const uintptr_t fpEnd = cpuAlignAddrLo<uintptr_t>(reinterpret_cast<uintptr_t>(region->m_addrNext) + unionAdd);
-	if (fpEnd > fpBase)
-		m_vmm.freeRamPages(reinterpret_cast<void*>(fpBase), fpEnd - fpBase);
+	klock_guard lock(m_mutex);
+	purgeFreeRegions();
 }
 
-void Heap::cleanMemRegionUNP(void* ptr, MemoryRegionHeader* region)
+void Heap::setDecommitWatermark(size_t size)
 {
-	uintptr_t fpBase = cpuAlignPtrLoInt(ptr);
-	if (fpBase < (reinterpret_cast<uintptr_t> (region->m_addrPrev) + MemRegionAlign))
-		fpBase += PAGE_SIZE;
-	const size_t unionAdd = kmin<size_t>(region->m_addrNext->size(), PAGE_MASK);
-	const uintptr_t fpEnd = cpuAlignAddrLo<uintptr_t>(reinterpret_cast<uintptr_t>(region->m_addrNext) + unionAdd);
-	if (fpEnd > fpBase)
-		m_vmm.freeRamPages(reinterpret_cast<void*>(fpBase), fpEnd - fpBase);
+	klock_guard lock(m_mutex);
+	m_decommitWatermark = size;
+	if (m_pendingDecommitSize > m_decommitWatermark)
+		purgeFreeRegions();
 }
 
-void Heap::cleanMemRegionUP(void* ptr, MemoryRegionHeader* region)
+void Heap::startPurgeThread()
 {
-	uintptr_t fpBase = cpuAlignPtrLoInt(ptr);
-	if (fpBase < (reinterpret_cast<uintptr_t>(region->m_addrPrev) + MemRegionAlign))
-		fpBase += PAGE_SIZE;
-	const uintptr_t fpEnd = cpuAlignPtrLoInt(region->m_addrNext);
-	if (fpEnd > fpBase)
-		m_vmm.freeRamPages(reinterpret_cast<void*>(fpBase), fpEnd - fpBase);
+	if (m_purgeThread != nullptr)
+		return;
+
+	m_purgeEvent = new kevent(false, false);
+	m_purgeThread = new kthread(std::bind(&Heap::purgeThreadProc, this));
+	RamAllocator::getInstance().registerShrinker(this, 0);
+}
+
+size_t Heap::shrink(size_t)
+{
+	// the allocation that needs memory may come from inside the heap
+	if (!m_mutex.try_lock())
+		return 0;
+
+	// pending ranges may be partly uncommitted, only the pages given back count
+	const size_t released = purgeFreeRegions();
+	m_mutex.unlock();
+	return released;
 }
 
-void* Heap::alloc(size_t size)
+void Heap::purgeThreadProc()
+{
+	const TimePoint interval = AbstractTimer::system()->fromMilliseconds(PurgeIntervalMs);
+	size_t lastPendingSize = 0;
+	for ( ; ; )
+	{
+		const bool signaled = m_purgeEvent->wait(interval);
+		klock_guard lock(m_mutex);
+		// ranges freed before the last interval and not reused since are cold
+		if (signaled || ((m_pendingDecommitSize != 0) && (m_pendingDecommitSize == lastPendingSize)))
+			purgeFreeRegions();
+		lastPendingSize = m_pendingDecommitSize;
+	}
+}
+
+void* Heap::alloc(size_t size, MemoryAccount& account)
 {
 	if (size == 0)
 		return nullptr;
 
-	size = (size + (MemRegionAlign * 2) - 1) & ~(MemRegionAlign - 1);
+	if (size <= SlabAllocator::MaxObjectSize)
+	{
+		SlabAllocator& slabAllocator = SlabAllocator::system();
+		if (slabAllocator.isReady())
+		{
+			void* ret = slabAllocator.alloc(size, account.heapId());
+			if (ret != nullptr)
+			{
+				MemoryAccount::ofHeapId(account.heapId())->chargeHeap(SlabAllocator::objectSize(ret));
+				return ret;
+			}
+		}
+	}
+
+	return allocOwnedRegion(size, account);
+}
+
+void* Heap::allocOwnedRegion(size_t size, MemoryAccount& account)
+{
+	void* ptr = allocRegion(size);
+	if (ptr == nullptr)
+		return nullptr;
+
+	// the size list link of a busy region is unused
+	MemoryRegionHeader* region = reinterpret_cast<MemoryRegionHeader*>(reinterpret_cast<uintptr_t>(ptr) - MemRegionAlign);
+	region->m_owner = &account;
+	account.chargeHeap(region->size());
+	return ptr;
+}
+
+void* Heap::allocRegion(size_t size)
+{
+	size = alignRequestSize(size);
 	if (size >= HEAP_MEM_REGION_LIMIT)
 		return allocHuge(size);
 
@@ -248,13 +330,73 @@ void* Heap::alloc(size_t size)
 	return allocNew(size);
 }
 
+void* Heap::allocAligned(size_t size, size_t align, MemoryAccount& account)
+{
+	if (size == 0)
+		return nullptr;
+
+	// small sizes come from 16 byte aligned slab classes
+	if (align <= SlabAllocator::MinObjectAlign)
+		return alloc(size, account);
+
+	// slab objects of 64 byte multiple classes are cache line aligned
+	if ((align <= SlabAllocator::SlabObjectAlign) && (size <= SlabAllocator::MaxObjectSize))
+	{
+		SlabAllocator& slabAllocator = SlabAllocator::system();
+		if (slabAllocator.isReady())
+		{
+			void* ret = slabAllocator.alloc((size + SlabAllocator::SlabObjectAlign - 1) & ~(SlabAllocator::SlabObjectAlign - 1), account.heapId());
+			if (ret != nullptr)
+			{
+				MemoryAccount::ofHeapId(account.heapId())->chargeHeap(SlabAllocator::objectSize(ret));
+				return ret;
+			}
+		}
+	}
+
+	if (align <= MemRegionAlign)
+		return allocOwnedRegion(size, account);
+
+	void* ptr = allocOwnedRegion(size + align + MemRegionAlign, account);
+	if ((ptr == nullptr) || ((reinterpret_cast<uintptr_t>(ptr) & (align - 1)) == 0))
+		return ptr;
+
+	// split off the unaligned head as a separate region and release it
+	const uintptr_t alignedPtr = (reinterpret_cast<uintptr_t>(ptr) + MemRegionAlign + align - 1) & ~(align - 1);
+	MemoryRegionHeader* region = reinterpret_cast<MemoryRegionHeader*>(reinterpret_cast<uintptr_t>(ptr) - MemRegionAlign);
+	MemoryRegionHeader* alignedRegion = reinterpret_cast<MemoryRegionHeader*>(alignedPtr - MemRegionAlign);
+	{
+		klock_guard lock(m_mutex);
+		MemoryRegionHeader* regNext = region->m_addrNext;
+		alignedRegion->m_addrPrev = region;
+		alignedRegion->m_addrNext = regNext;
+		alignedRegion->m_busyMarker = HEAP_MARKER_BUSY;
+		alignedRegion->m_owner = &account;
+		regNext->m_addrPrev = alignedRegion;
+		region->m_addrNext = alignedRegion;
+	}
+	free(ptr);
+	return reinterpret_cast<void*>(alignedPtr);
+}
+
 void Heap::free(void* ptr)
 {
+	// slab objects have no header, the slab keeps the id of their account
+	if (SlabAllocator::isSlabPtr(ptr))
+	{
+		MemoryAccount* owner = MemoryAccount::ofHeapId(SlabAllocator::ownerId(ptr));
+		if (owner != nullptr)
+			owner->chargeHeap(-static_cast<ptrdiff_t>(SlabAllocator::objectSize(ptr)));
+		return SlabAllocator::system().free(ptr);
+	}
+
 	klock_guard lock(m_mutex);
 	MemoryRegionHeader* region = reinterpret_cast<MemoryRegionHeader*>(reinterpret_cast<uintptr_t>(ptr) - MemRegionAlign);
 	MemoryRegionHeader* regNext = region->m_addrNext;
 	MemoryRegionHeader* regPrev = region->m_addrPrev;
 	MemoryRegionHeader* regNextNext = regNext->m_addrNext;
+	const size_t freedSize = region->size();
+	region->m_owner->chargeHeap(-static_cast<ptrdiff_t>(freedSize));
 
 	if ((regPrev != nullptr) && (regPrev->m_busyMarker != HEAP_MARKER_BUSY))
 	{
@@ -272,13 +414,11 @@ void Heap::free(void* ptr)
 					return;
 				}
 
-				cleanMemRegionUNP(ptr, region);
 				regPrev->m_addrNext = regNextNext;
 				regNextNext->m_addrPrev = regPrev;
 			}
 			else
 			{
-				cleanMemRegionUP(ptr, region);
 				regPrev->m_addrNext = regNext;
 				regNext->m_addrPrev = regPrev;
 			}
@@ -293,7 +433,6 @@ void Heap::free(void* ptr)
 				return;
 			}
 
-			cleanMemRegionUP(ptr, region);
 			regPrev->m_addrNext = regNext;
 		}
 		updateMemRegion(regPrev, oldTblIndex);
@@ -310,14 +449,12 @@ void Heap::free(void* ptr)
 				return;
 			}
 
-			cleanMemRegionUN(ptr, region);
 			region->m_addrNext = regNextNext;
 			regNextNext->m_addrPrev = region;
 			addMemRegion(region);
 		}
 		else
 		{
-			cleanMemRegion(ptr, region);
 			addMemRegion(region);
 		}
 	}
@@ -330,9 +467,119 @@ void Heap::free(void* ptr)
 			return;
 		}
 
-		cleanMemRegion(ptr, region);
 		addMemRegion(region);
 	}
+
+	// freed pages stay committed until the watermark is exceeded
+	m_pendingDecommitSize += freedSize;
+	if (m_pendingDecommitSize > m_decommitWatermark)
+	{
+		if (m_purgeEvent != nullptr)
+			m_purgeEvent->set();
+		else
+			purgeFreeRegions();
+	}
+}
+
+bool Heap::expandHuge(MemoryRegionHeader* region, size_t size)
+{
+	// the tail of the last page is reserved for the null region
+	const size_t virtualSize = cpuAlignAddrHi<size_t>(region->size() + MemRegionAlign);
+	if ((size + MemRegionAlign) > virtualSize)
+		return false;
+
+	MemoryRegionHeader* nullRegion = reinterpret_cast<MemoryRegionHeader*>(reinterpret_cast<uintptr_t>(region) + size);
+	nullRegion->m_addrNext = nullptr;
+	region->m_addrNext = nullRegion;
+	return true;
+}
+
+bool Heap::tryExpand(void* ptr, size_t newSize)
+{
+	if (ptr == nullptr)
+		return false;
+
+	if (SlabAllocator::isSlabPtr(ptr))
+		return (newSize <= SlabAllocator::objectSize(ptr));
+
+	const size_t size = alignRequestSize(newSize);
+	klock_guard lock(m_mutex);
+	MemoryRegionHeader* region = reinterpret_cast<MemoryRegionHeader*>(reinterpret_cast<uintptr_t>(ptr) - MemRegionAlign);
+	const size_t regSize = region->size();
+	if (!expandRegion(region, size))
+		return false;
+
+	region->m_owner->chargeHeap(static_cast<ptrdiff_t>(region->size() - regSize));
+	return true;
+}
+
+// called with the heap lock held
+bool Heap::expandRegion(MemoryRegionHeader* region, size_t size)
+{
+	const size_t regSize = region->size();
+	if (size <= regSize)
+		return true;
+
+	MemoryRegionHeader* regNext = region->m_addrNext;
+	MemoryRegionHeader* regNextNext = regNext->m_addrNext;
+	if (regNextNext == nullptr)
+		return (region->m_addrPrev == nullptr) ? expandHuge(region, size) : false;
+
+	if (regNext->m_busyMarker == HEAP_MARKER_BUSY)
+		return false;
+
+	const size_t unionSize = regSize + regNext->size();
+	if (unionSize < size)
+		return false;
+
+	deleteMemRegion(regNext, cpuLastOneBitIndex(regNext->size()));
+	if (unionSize == size)
+	{
+		region->m_addrNext = regNextNext;
+		regNextNext->m_addrPrev = region;
+		return true;
+	}
+
+	MemoryRegionHeader* freeRegion = reinterpret_cast<MemoryRegionHeader*>(reinterpret_cast<uintptr_t>(region) + size);
+	freeRegion->m_addrPrev = region;
+	freeRegion->m_addrNext = regNextNext;
+	region->m_addrNext = freeRegion;
+	regNextNext->m_addrPrev = freeRegion;
+	addMemRegion(freeRegion);
+	return true;
+}
+
+size_t Heap::usableSize(void* ptr)
+{
+	if (SlabAllocator::isSlabPtr(ptr))
+		return SlabAllocator::objectSize(ptr);
+
+	klock_guard lock(m_mutex);
+	MemoryRegionHeader* region = reinterpret_cast<MemoryRegionHeader*>(reinterpret_cast<uintptr_t>(ptr) - MemRegionAlign);
+	return (region->size() - MemRegionAlign);
+}
+
+void* Heap::realloc(void* ptr, size_t newSize, MemoryAccount& account)
+{
+	if (ptr == nullptr)
+		return alloc(newSize, account);
+
+	if (newSize == 0)
+	{
+		free(ptr);
+		return nullptr;
+	}
+
+	if (tryExpand(ptr, newSize))
+		return ptr;
+
+	void* newPtr = alloc(newSize, account);
+	if (newPtr != nullptr)
+	{
+		kmemcpy(newPtr, ptr, kmin(usableSize(ptr), newSize));
+		free(ptr);
+	}
+	return newPtr;
 }
 
 size_t Heap::calcVirtualMemoryBeetween(MemoryRegionHeader* lower, MemoryRegionHeader* upper)
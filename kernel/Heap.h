@@ -21,19 +21,36 @@
 
 #pragma once
 #include <kmutex.h>
+#include <kevent.h>
+#include <kthread.h>
 #include <VirtualMemoryManager.h>
+#include <MemoryAccount.h>
+#include "phmem.h"
 
-class Heap
+class Heap : public RamShrinker
 {
 public:
 	Heap(VirtualMemoryManager& vmm);
 	~Heap();
-	void* alloc(size_t size);
+	// heap bytes are charged to the account, regions and slab objects remember it for the free
+	void* alloc(size_t size, MemoryAccount& account = MemoryAccount::kernel());
+	void* allocAligned(size_t size, size_t align, MemoryAccount& account = MemoryAccount::kernel());
 	void free(void* ptr);
+	bool tryExpand(void* ptr, size_t newSize);
+	void* realloc(void* ptr, size_t newSize, MemoryAccount& account = MemoryAccount::kernel());
+	size_t usableSize(void* ptr);
 	size_t virtualMemorySize() const
 	{
 		return m_virtualMemorySize;
 	}
+	size_t pendingDecommitSize() const
+	{
+		return m_pendingDecommitSize;
+	}
+	void setDecommitWatermark(size_t size);
+	void purge();
+	void startPurgeThread();
+	size_t shrink(size_t pages) override;
 	static Heap& system();
 
 private:
@@ -44,7 +61,11 @@ private:
 			MemoryRegionHeader* m_szNext;
 			uintptr_t m_busyMarker;
 		};
-		MemoryRegionHeader* m_szPrev;
+		union
+		{
+			MemoryRegionHeader* m_szPrev;
+			MemoryAccount* m_owner;
+		};
 		MemoryRegionHeader* m_addrNext;
 		MemoryRegionHeader* m_addrPrev;
 
@@ -56,19 +77,28 @@ private:
 	static_assert(sizeof (MemoryRegionHeader) == 4 * sizeof (uintptr_t));
 	static const size_t HeapLogTableSize = 21;
 	static const size_t MemRegionAlign = sizeof (MemoryRegionHeader);
+	static const size_t DefaultDecommitWatermark = 0x400000;
+	static const size_t PurgeBatchSize = 64;
+	static const TimePoint PurgeIntervalMs = 1000;
 
 private:
 	void* allocEqual(MemoryRegionHeader** header, MemoryRegionHeader* region);
 	void* allocMore(MemoryRegionHeader* region, size_t size);
 	void* allocNew(size_t size);
 	void* allocHuge(size_t size);
+	void* allocRegion(size_t size);
+	void* allocOwnedRegion(size_t size, MemoryAccount& account);
+	bool expandRegion(MemoryRegionHeader* region, size_t size);
+	bool expandHuge(MemoryRegionHeader* region, size_t size);
+	static size_t alignRequestSize(size_t size)
+	{
+		return ((size + (MemRegionAlign * 2) - 1) & ~(MemRegionAlign - 1));
+	}
 	void deleteMemRegion(MemoryRegionHeader* region, size_t tableIdx);
 	void updateMemRegion(MemoryRegionHeader* region, size_t oldTableIdx);
 	void addMemRegion(MemoryRegionHeader* region);
-	void cleanMemRegion(void* ptr, MemoryRegionHeader* region);
-	void cleanMemRegionUN(void* ptr, MemoryRegionHeader* region);
-	void cleanMemRegionUNP(void* ptr, MemoryRegionHeader* region);
-	void cleanMemRegionUP(void* ptr, MemoryRegionHeader* region);
+	size_t purgeFreeRegions();
+	void purgeThreadProc();
 	static size_t calcVirtualMemoryBeetween(MemoryRegionHeader* lower, MemoryRegionHeader* upper);
 
 private:
@@ -77,5 +107,9 @@ private:
 	VirtualMemoryManager& m_vmm;
 	MemoryRegionHeader* m_freeListTable[HeapLogTableSize] = {};
 	size_t m_virtualMemorySize = 0;
+	size_t m_pendingDecommitSize = 0;
+	size_t m_decommitWatermark = DefaultDecommitWatermark;
+	kevent* m_purgeEvent = nullptr;
+	kthread* m_purgeThread = nullptr;
 	kmutex m_mutex;
 };
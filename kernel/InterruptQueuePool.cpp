@@ -26,9 +26,14 @@
 InterruptQueuePool::InterruptQueuePool(size_t size)
 	: m_queue(size)
 {
-	const size_t numThreads = cpuLogicalCount();
-	for (size_t idx = 0; idx < numThreads; ++idx)
+	const unsigned int numThreads = cpuLogicalCount();
+	for (unsigned int idx = 0; idx < numThreads; ++idx)
+	{
 		m_threads.emplace_back(std::bind(&InterruptQueuePool::threadProc, this));
+		// interrupt completions go ahead of ordinary work, one worker per CPU
+		m_threads.back().setSchedulingClass(kthread::SchedulingClass::Realtime);
+		m_threads.back().setAffinity(kcpu_set::single(idx));
+	}
 }
 
 InterruptQueuePool::~InterruptQueuePool()
@@ -28,6 +28,7 @@
 #include "common_lib.h"
 #include "IoResourceImpl.h"
 #include "LocalApic.h"
+#include "AbstractTimer.h"
 
 enum
 {
@@ -36,6 +37,10 @@ enum
 	SpuriousInterruptVectorReg = 0x0F0,
 	InterruptCommandLo = 0x300,
 	InterruptCommandHi = 0x310,
+	LvtTimerReg = 0x320,
+	TimerInitialCountReg = 0x380,
+	TimerCurrentCountReg = 0x390,
+	TimerDivideConfigReg = 0x3E0
 };
 
 enum
@@ -48,6 +53,14 @@ enum
 	apicIcrLevelAssert = (1 << 14)
 };
 
+enum
+{
+	apicLvtMasked = (1 << 16),
+	apicTimerDivideBy16 = 0x3,
+	apicTimerCalibrationMs = 10,
+	apicTimerScaleShift = 32
+};
+
 void gccAsmFuncAddrBugWorkaroundApicCpp() { }
 #define APIC_NULL_HANDLER(procName)\
 	asm volatile(	".globl " #procName "\n"\
@@ -104,6 +117,9 @@ void LocalApic::initCurrentCpu()
 	g_systemCpuIdToApicMap[cpuCurrentId()] = apicId;
 	cpuSetLocalData(LOCAL_CPU_APIC_ID, apicId);
 	cpuSetLocalPtr(LOCAL_CPU_APIC_EOI_ADDR, const_cast<uint8_t*>(static_cast<MmioSpace*>(m_mmio)->ptr()) + ApicEoiReg);
+	m_mmio->out32(TimerInitialCountReg, 0);
+	m_mmio->out32(TimerDivideConfigReg, apicTimerDivideBy16);
+	m_mmio->out32(LvtTimerReg, CPU_LOCAL_TIMER_VECTOR | apicLvtMasked);
 }
 
 LocalApic::ApicCpuId LocalApic::getCpuId()
@@ -164,3 +180,42 @@ void LocalApic::eoi()
 {
 	m_mmio->out32(ApicEoiReg, 0);
 }
+
+// all local timers run from the same bus clock, the boot CPU measures it once
+void LocalApic::calibrateTimer()
+{
+	AbstractTimer* timer = AbstractTimer::system();
+	const uint32_t startCount = UINT32_MAX;
+	const TimePoint endTime = timer->timepoint() + timer->fromMilliseconds(apicTimerCalibrationMs);
+	m_mmio->out32(TimerInitialCountReg, startCount);
+	const TimePoint startTime = timer->timepoint();
+	while (timer->timepoint() < endTime)
+		cpuPause();
+
+	const uint32_t counts = startCount - m_mmio->in32(TimerCurrentCountReg);
+	const TimePoint elapsed = timer->timepoint() - startTime;
+	m_mmio->out32(TimerInitialCountReg, 0);
+	if ((counts == 0) || (elapsed == 0))
+		PANIC(L"Local APIC timer isn't running");
+
+	m_timerScale = (static_cast<uint64_t>(counts) << apicTimerScaleShift) / elapsed;
+	if (m_timerScale == 0)
+		PANIC(L"Local APIC timer is too slow");
+
+	m_timerMaxDelay = (static_cast<uint64_t>(startCount) << apicTimerScaleShift) / m_timerScale;
+}
+
+// returns the delay actually programmed, long delays are cut to the counter range
+TimePoint LocalApic::startTimer(TimePoint delay)
+{
+	delay = kmin(delay, m_timerMaxDelay);
+	const uint64_t counts = static_cast<uint64_t>((static_cast<unsigned __int128>(delay) * m_timerScale) >> apicTimerScaleShift);
+	m_mmio->out32(LvtTimerReg, CPU_LOCAL_TIMER_VECTOR);
+	m_mmio->out32(TimerInitialCountReg, static_cast<uint32_t>(kmax<uint64_t>(counts, 1)));
+	return delay;
+}
+
+void LocalApic::stopTimer()
+{
+	m_mmio->out32(TimerInitialCountReg, 0);
+}
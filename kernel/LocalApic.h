@@ -36,6 +36,10 @@ public:
 	void sendIpi(ApicCpuId cpuId, uint8_t vector);
 	void sendBroadcastIpi(uint8_t vector);
 	void eoi();
+	// one-shot timer of the current CPU, the delay is in system timer units
+	void calibrateTimer();
+	TimePoint startTimer(TimePoint delay);
+	void stopTimer();
 	static LocalApic& system();
 
 private:
@@ -51,4 +55,6 @@ private:
 private:
 	const uintptr_t m_mmioBase;
 	IoResource* m_mmio = nullptr;
+	uint64_t m_timerScale = 0;
+	TimePoint m_timerMaxDelay = 0;
 };
@@ -0,0 +1,139 @@
+/*
+   MemoryAccount.cpp
+   Per process and per module memory accounting
+   SHM DOS64
+   Copyright (c) 2023, Ilya Shamukov <ilya.shamukov@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <MemoryAccount.h>
+#include "panic.h"
+#include "smp.h"
+
+enum
+{
+	MaxCodeAccounts = 64,
+	MaxHeapAccounts = 256
+};
+
+// accounts of loaded modules, looked up without locks on every allocation
+static std::atomic<MemoryAccount*> g_codeAccounts[MaxCodeAccounts];
+static std::atomic<size_t> g_codeAccountCount{0};
+static std::atomic<MemoryAccount*> g_heapAccounts[MaxHeapAccounts];
+static std::atomic<unsigned int> g_nextHeapId{0};
+
+MemoryAccount::MemoryAccount(const char* name)
+	: m_name(name)
+{
+	// ids go round so that the id of a destroyed account is taken again as late as possible
+	for (unsigned int attempt = 1; attempt < MaxHeapAccounts; ++attempt)
+	{
+		const unsigned int id = g_nextHeapId.fetch_add(1, std::memory_order_relaxed) % (MaxHeapAccounts - 1) + 1;
+		MemoryAccount* expected = nullptr;
+		if (g_heapAccounts[id].compare_exchange_strong(expected, this, std::memory_order_acq_rel))
+		{
+			m_heapId = static_cast<uint8_t>(id);
+			break;
+		}
+	}
+}
+
+MemoryAccount::~MemoryAccount()
+{
+	clearCodeRange();
+	if (m_heapId != 0)
+		g_heapAccounts[m_heapId].store(nullptr, std::memory_order_release);
+}
+
+void MemoryAccount::add(Counter counter, ptrdiff_t value)
+{
+	// only the boot CPU runs until SMP is up and local CPU data may not be set yet
+	const unsigned int cpu = SystemSMP::isInit() ? cpuCurrentId() : BOOT_CPU_ID;
+	m_cpuCounters[cpu].m_values[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+MemoryUsage MemoryAccount::usage() const
+{
+	ptrdiff_t values[CounterCount] = {};
+	for (const CpuCounters& cpuCounters : m_cpuCounters)
+	{
+		for (size_t idx = 0; idx < CounterCount; ++idx)
+			values[idx] += cpuCounters.m_values[idx].load(std::memory_order_relaxed);
+	}
+
+	// a block freed on another CPU can make a single CPU value negative, but not the sum
+	MemoryUsage result;
+	result.m_physicalPages = static_cast<size_t>(kmax<ptrdiff_t>(values[PhysicalPages], 0));
+	result.m_virtualSize = static_cast<size_t>(kmax<ptrdiff_t>(values[VirtualSize], 0));
+	result.m_heapSize = static_cast<size_t>(kmax<ptrdiff_t>(values[HeapSize], 0));
+	return result;
+}
+
+void MemoryAccount::setCodeRange(uintptr_t base, size_t size)
+{
+	m_codeBase.store(base, std::memory_order_relaxed);
+	m_codeEnd.store(base + size, std::memory_order_release);
+	for (size_t idx = 0; idx < MaxCodeAccounts; ++idx)
+	{
+		MemoryAccount* expected = nullptr;
+		if (g_codeAccounts[idx].compare_exchange_strong(expected, this, std::memory_order_acq_rel))
+		{
+			size_t count = g_codeAccountCount.load(std::memory_order_relaxed);
+			while ((count <= idx) && !g_codeAccountCount.compare_exchange_weak(count, idx + 1, std::memory_order_release));
+			return;
+		}
+		if (expected == this)
+			return;
+	}
+	PANIC(L"Too many memory accounts");
+}
+
+void MemoryAccount::clearCodeRange()
+{
+	m_codeEnd.store(0, std::memory_order_release);
+	const size_t count = g_codeAccountCount.load(std::memory_order_acquire);
+	for (size_t idx = 0; idx < count; ++idx)
+	{
+		MemoryAccount* expected = this;
+		if (g_codeAccounts[idx].compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel))
+			return;
+	}
+}
+
+MemoryAccount& MemoryAccount::ofCode(const void* address)
+{
+	const uintptr_t addr = reinterpret_cast<uintptr_t>(address);
+	const size_t count = g_codeAccountCount.load(std::memory_order_acquire);
+	for (size_t idx = 0; idx < count; ++idx)
+	{
+		MemoryAccount* account = g_codeAccounts[idx].load(std::memory_order_acquire);
+		if ((account != nullptr) && (addr >= account->m_codeBase.load(std::memory_order_relaxed))
+			&& (addr < account->m_codeEnd.load(std::memory_order_acquire)))
+			return *account;
+	}
+	return kernel();
+}
+
+MemoryAccount* MemoryAccount::ofHeapId(uint8_t id)
+{
+	return (id != 0) ? g_heapAccounts[id].load(std::memory_order_acquire) : &kernel();
+}
+
+MemoryAccount& MemoryAccount::kernel()
+{
+	static MemoryAccount account("kernel");
+	return account;
+}
@@ -46,6 +46,7 @@ static const wchar_t* g_errorStrings[] =
 PeLoader::PeLoader(Process* process, const kstring& name)
 	: m_process(process)
 	, m_name(name)
+	, m_memoryAccount(m_name.c_str())
 {
 
 }
@@ -53,7 +54,7 @@ PeLoader::PeLoader(Process* process, const kstring& name)
 PeLoader::~PeLoader()
 {
 	if (m_imageBasePtr != nullptr)
-		m_process->vmm().free(m_imageBasePtr);
+		m_process->vmm().free(m_imageBasePtr, m_memoryAccount);
 }
 
 const kstring& PeLoader::name() const
@@ -77,6 +78,9 @@ const void* PeLoader::procByName(const char* name) const
 
 void PeLoader::load()
 {
+	// the image counts as resident, allocations from its code are charged to the module
+	m_memoryAccount.chargePhysicalPages(static_cast<ptrdiff_t>((m_imageSize + PAGE_MASK) / PAGE_SIZE));
+	m_memoryAccount.setCodeRange(m_imageBase, m_imageSize);
 	if (m_entryPoint != nullptr)
 		reinterpret_cast<KernelModuleEntry>(m_entryPoint)(m_imageBasePtr, KernelModuleLoad, nullptr);
 }
@@ -85,6 +89,13 @@ void PeLoader::unload()
 {
 	if (m_entryPoint != nullptr)
 		reinterpret_cast<KernelModuleEntry>(m_entryPoint)(m_imageBasePtr, KernelModuleUnload, nullptr);
+	m_memoryAccount.clearCodeRange();
+	m_memoryAccount.chargePhysicalPages(-static_cast<ptrdiff_t>((m_imageSize + PAGE_MASK) / PAGE_SIZE));
+}
+
+MemoryAccount& PeLoader::memoryAccount()
+{
+	return m_memoryAccount;
 }
 
 void PeLoader::onSystemMessage(int msgCode, int arg, void* ptr)
@@ -219,7 +230,7 @@ bool PeLoader::loadFromMemory(const void* moduleBytes, size_t size)
 		return false;
 	}
 	
-	m_imageBasePtr = m_process->vmm().alloc(m_imageSize, VMM_READWRITE);
+	m_imageBasePtr = m_process->vmm().alloc(m_imageSize, VMM_READWRITE, m_memoryAccount);
 	if (m_imageBasePtr == nullptr)
 	{
 		setLastError(ErrAlloc);
@@ -469,7 +480,7 @@ void PeLoader::initKernel()
 		PANIC((L"kernel export failed " + kernelModule.lastErrorText()).c_str());
 	}
 	kernelProcess->addModule(&kernelModule);
-	VirtualMemoryManager& vmm = kernelProcess->vmm();
+	// module images are released with the rest of the boot memory
 	for (size_t idx = 0; idx < params->m_modules.m_count; ++idx)
 	{
 		const KernelParams::Modules::BootModule& module = params->m_modules.m_modules[idx];
@@ -489,7 +500,6 @@ void PeLoader::initKernel()
 			println(kernelModule->lastErrorText());
 			delete kernelModule;
 		}
-		vmm.freeRamPages(module.m_data, module.m_size, false);
 	}
 }
 
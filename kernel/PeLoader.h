@@ -57,6 +57,7 @@ public:
 	void load() override;
 	void unload() override;
 	void onSystemMessage(int, int, void*) override;
+	MemoryAccount& memoryAccount() override;
 
 	static void loadKernelModules();
 	
@@ -90,6 +91,7 @@ private:
 private:
 	Process* m_process;
 	const kstring m_name;
+	MemoryAccount m_memoryAccount;
 	kwstring m_lastErrorText;
 	ErrorCode m_lastErrorCode = ErrNone;
 	void* m_imageBasePtr = nullptr;
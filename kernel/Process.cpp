@@ -21,12 +21,14 @@
 
 #include <algorithm>
 #include <VirtualMemoryManager.h>
+#include <conout.h>
 #include "panic.h"
 #include "Process.h"
 
 Process::Process()
 	: m_supervisor(true)
 	, m_vmm(VirtualMemoryManager::system())
+	, m_memoryAccount(MemoryAccount::kernel())
 {
 }
 
@@ -93,4 +95,28 @@ void Process::notityModules(const KernelModuleMessage& msg)
 	klock_guard lock(m_modulesMutex);
 	for (AbstractModule* module : m_modules)
 		module->onSystemMessage(msg.m_msg, msg.m_arg, msg.m_ptr);
-}
\ No newline at end of file
+}
+MemoryUsage Process::memoryUsage() const
+{
+	MemoryUsage usage = m_memoryAccount.usage();
+	klock_guard lock(m_modulesMutex);
+	for (AbstractModule* module : m_modules)
+		usage += module->memoryAccount().usage();
+	return usage;
+}
+
+static void printMemoryUsage(const char* name, const MemoryUsage& usage)
+{
+	println(name, L": RAM ", (usage.m_physicalPages * PAGE_SIZE) >> 10, L" KB, virtual ",
+		usage.m_virtualSize >> 10, L" KB, heap ", usage.m_heapSize >> 10, L" KB");
+}
+
+void Process::dumpMemoryUsage() const
+{
+	// RAM counts module images and committed ranges, lazily mapped pages are not attributed
+	printMemoryUsage("process total", memoryUsage());
+	printMemoryUsage(m_memoryAccount.name(), m_memoryAccount.usage());
+	klock_guard lock(m_modulesMutex);
+	for (AbstractModule* module : m_modules)
+		printMemoryUsage(module->name().c_str(), module->memoryAccount().usage());
+}
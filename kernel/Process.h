@@ -24,6 +24,7 @@
 #include <klist.h>
 #include <kmutex.h>
 #include <KernelModule.h>
+#include <MemoryAccount.h>
 #include "AbstractModule.h"
 
 class VirtualMemoryManager;
@@ -39,6 +40,13 @@ public:
 	{
 		return m_vmm;
 	}
+	// memory charged outside of the process modules
+	MemoryAccount& memoryAccount()
+	{
+		return m_memoryAccount;
+	}
+	MemoryUsage memoryUsage() const;
+	void dumpMemoryUsage() const;
 	bool addModule(AbstractModule* module);
 	bool removeModule(AbstractModule* module);
 	AbstractModule* moduleByName(const kstring& name) const;
@@ -60,5 +68,6 @@ private:
 	mutable kmutex m_modulesMutex;
 	bool m_supervisor;
 	VirtualMemoryManager& m_vmm;
+	MemoryAccount& m_memoryAccount;
 	friend class ThreadPrivate;
 };
@@ -0,0 +1,232 @@
+/*
+   SlabAllocator.cpp
+   Per-CPU slab allocator for small kernel objects
+   SHM DOS64
+   Copyright (c) 2023, Ilya Shamukov, ilya.shamukov@gmail.com
+   
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option) 
+   any later version.
+   
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for 
+   more details.
+   
+   You should have received a copy of the GNU General Public License along with 
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple 
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <cpu.h>
+#include "phmem.h"
+#include "smp.h"
+#include "SlabAllocator.h"
+
+struct alignas(64) SlabAllocator::Slab
+{
+	Slab* m_next;
+	Slab* m_prev;
+	CpuCache* m_owner;
+	void* m_freeList;
+	uint32_t m_used;
+	uint32_t m_capacity;
+	uint32_t m_objectSize;
+	uint32_t m_bumpOffset;
+	uint32_t m_dataOffset;
+	uint32_t m_sizeClass;
+	bool m_onList;
+};
+
+struct SlabAllocator::CpuCache
+{
+	// written by other CPUs, kept apart from the local lists
+	alignas(64) std::atomic<void*> m_remoteFree;
+	alignas(64) Slab* m_partial[SizeClassCount];
+	uint32_t m_emptySlabs[SizeClassCount];
+};
+
+const uint32_t SlabAllocator::m_classSizes[SizeClassCount] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+
+SlabAllocator::SlabAllocator()
+{
+	unsigned int sizeClass = 0;
+	for (size_t idx = 0; idx < SizeClassIndexCount; ++idx)
+	{
+		while (m_classSizes[sizeClass] < (idx * SizeClassStep))
+			++sizeClass;
+		m_sizeClassIndex[idx] = static_cast<uint8_t>(sizeClass);
+	}
+}
+
+SlabAllocator& SlabAllocator::system()
+{
+	static SlabAllocator allocator;
+	return allocator;
+}
+
+void SlabAllocator::initCurrentCpu()
+{
+	static_assert(sizeof (CpuCache) <= PAGE_SIZE);
+	// zeroed page is an empty cache
+	cpuSetLocalPtr(LOCAL_CPU_SLAB_CACHE, RamAllocator::getInstance().allocPagePtr(true));
+	m_ready = true;
+}
+
+SlabAllocator::CpuCache* SlabAllocator::localCpuCache() const
+{
+	return static_cast<CpuCache*>(cpuGetLocalPtr(LOCAL_CPU_SLAB_CACHE));
+}
+
+void SlabAllocator::linkSlab(Slab*& head, Slab* slab)
+{
+	slab->m_prev = nullptr;
+	slab->m_next = head;
+	if (head != nullptr)
+		head->m_prev = slab;
+	head = slab;
+	slab->m_onList = true;
+}
+
+void SlabAllocator::unlinkSlab(Slab*& head, Slab* slab)
+{
+	if (slab->m_prev != nullptr)
+		slab->m_prev->m_next = slab->m_next;
+	else
+		head = slab->m_next;
+	if (slab->m_next != nullptr)
+		slab->m_next->m_prev = slab->m_prev;
+	slab->m_onList = false;
+}
+
+SlabAllocator::Slab* SlabAllocator::newSlab(CpuCache* cache, unsigned int sizeClass)
+{
+	// objects of 64 byte multiple classes keep the slab header alignment
+	static_assert(sizeof (Slab) == SlabObjectAlign);
+	Slab* slab = static_cast<Slab*>(RamAllocator::getInstance().allocPagesPtr(SlabOrder, false));
+	if (slab == nullptr)
+		return nullptr;
+
+	slab->m_owner = cache;
+	slab->m_freeList = nullptr;
+	slab->m_used = 0;
+	// the header is followed by an owner id byte per object
+	const uint32_t objectSize = m_classSizes[sizeClass];
+	const uint32_t maxCapacity = static_cast<uint32_t>((SlabSize - sizeof (Slab)) / (objectSize + 1));
+	const uint32_t dataOffset = static_cast<uint32_t>(sizeof (Slab) + ((maxCapacity + SlabObjectAlign - 1) & ~(SlabObjectAlign - 1)));
+	slab->m_objectSize = objectSize;
+	slab->m_capacity = kmin<uint32_t>((SlabSize - dataOffset) / objectSize, maxCapacity);
+	slab->m_bumpOffset = dataOffset;
+	slab->m_dataOffset = dataOffset;
+	slab->m_sizeClass = sizeClass;
+	linkSlab(cache->m_partial[sizeClass], slab);
+	cache->m_emptySlabs[sizeClass]++;
+	m_slabMemorySize.fetch_add(SlabSize, std::memory_order_relaxed);
+	return slab;
+}
+
+void SlabAllocator::freeLocal(CpuCache* cache, Slab* slab, void* ptr)
+{
+	const unsigned int sizeClass = slab->m_sizeClass;
+	*static_cast<void**>(ptr) = slab->m_freeList;
+	slab->m_freeList = ptr;
+	if (!slab->m_onList)
+		linkSlab(cache->m_partial[sizeClass], slab);
+	if (--slab->m_used > 0)
+		return;
+
+	// keep one empty slab per size class, release the others
+	if (cache->m_emptySlabs[sizeClass] == 0)
+	{
+		cache->m_emptySlabs[sizeClass]++;
+		return;
+	}
+
+	unlinkSlab(cache->m_partial[sizeClass], slab);
+	m_slabMemorySize.fetch_sub(SlabSize, std::memory_order_relaxed);
+	RamAllocator::getInstance().freePagesPtr(slab, SlabOrder);
+}
+
+void SlabAllocator::drainRemoteFree(CpuCache* cache)
+{
+	void* ptr = cache->m_remoteFree.exchange(nullptr, std::memory_order_acquire);
+	while (ptr != nullptr)
+	{
+		void* next = *static_cast<void**>(ptr);
+		freeLocal(cache, slabOf(ptr), ptr);
+		ptr = next;
+	}
+}
+
+void* SlabAllocator::alloc(size_t size, uint8_t ownerId)
+{
+	const unsigned int sizeClass = m_sizeClassIndex[(size + SizeClassStep - 1) / SizeClassStep];
+	CpuInterruptLockSave intLock;
+	CpuCache* cache = localCpuCache();
+	if (cache->m_remoteFree.load(std::memory_order_relaxed) != nullptr)
+		drainRemoteFree(cache);
+
+	Slab* slab = cache->m_partial[sizeClass];
+	if (slab == nullptr)
+	{
+		slab = newSlab(cache, sizeClass);
+		if (slab == nullptr)
+			return nullptr;
+	}
+
+	void* ret = slab->m_freeList;
+	if (ret != nullptr)
+	{
+		slab->m_freeList = *static_cast<void**>(ret);
+	}
+	else
+	{
+		ret = reinterpret_cast<uint8_t*>(slab) + slab->m_bumpOffset;
+		slab->m_bumpOffset += slab->m_objectSize;
+	}
+	if (slab->m_used++ == 0)
+		cache->m_emptySlabs[sizeClass]--;
+	if (slab->m_used == slab->m_capacity)
+		unlinkSlab(cache->m_partial[sizeClass], slab);
+	ownerIdOf(slab, ret) = ownerId;
+	return ret;
+}
+
+size_t SlabAllocator::objectSize(void* ptr)
+{
+	return slabOf(ptr)->m_objectSize;
+}
+
+uint8_t SlabAllocator::ownerId(void* ptr)
+{
+	return ownerIdOf(slabOf(ptr), ptr);
+}
+
+uint8_t& SlabAllocator::ownerIdOf(Slab* slab, void* ptr)
+{
+	const uintptr_t offset = reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(slab) - slab->m_dataOffset;
+	return reinterpret_cast<uint8_t*>(slab + 1)[offset / slab->m_objectSize];
+}
+
+void SlabAllocator::free(void* ptr)
+{
+	Slab* slab = slabOf(ptr);
+	CpuInterruptLockSave intLock;
+	CpuCache* cache = localCpuCache();
+	if (slab->m_owner == cache)
+	{
+		freeLocal(cache, slab, ptr);
+		if (cache->m_remoteFree.load(std::memory_order_relaxed) != nullptr)
+			drainRemoteFree(cache);
+		return;
+	}
+
+	std::atomic<void*>& remoteFree = slab->m_owner->m_remoteFree;
+	void* head = remoteFree.load(std::memory_order_relaxed);
+	do
+	{
+		*static_cast<void**>(ptr) = head;
+	}
+	while (!remoteFree.compare_exchange_weak(head, ptr, std::memory_order_release, std::memory_order_relaxed));
+}
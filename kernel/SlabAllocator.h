@@ -0,0 +1,97 @@
+/*
+   SlabAllocator.h
+   Kernel header
+   SHM DOS64
+   Copyright (c) 2023, Ilya Shamukov <ilya.shamukov@gmail.com>
+   
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option) 
+   any later version.
+   
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for 
+   more details.
+   
+   You should have received a copy of the GNU General Public License along with 
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple 
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+#include <atomic>
+#include <common_types.h>
+#include <vmem_utils.h>
+
+class SlabAllocator
+{
+public:
+	enum : size_t
+	{
+		MaxObjectSize = 2048,
+		MinObjectAlign = 16,
+		SlabObjectAlign = 64
+	};
+
+public:
+	static SlabAllocator& system();
+	void initCurrentCpu();
+	// the owner id is an opaque byte kept with the object
+	void* alloc(size_t size, uint8_t ownerId);
+	void free(void* ptr);
+	static size_t objectSize(void* ptr);
+	static uint8_t ownerId(void* ptr);
+
+	bool isReady() const
+	{
+		return m_ready;
+	}
+
+	static bool isSlabPtr(const void* ptr)
+	{
+		return isRamMappingPtr(ptr);
+	}
+
+	size_t slabMemorySize() const
+	{
+		return m_slabMemorySize.load(std::memory_order_relaxed);
+	}
+
+private:
+	SlabAllocator();
+	SlabAllocator(const SlabAllocator&) = delete;
+	SlabAllocator(SlabAllocator&&) = delete;
+
+private:
+	struct Slab;
+	struct CpuCache;
+
+	enum : size_t
+	{
+		SlabOrder = 2,
+		SlabSize = PAGE_SIZE << SlabOrder,
+		SizeClassCount = 14,
+		SizeClassStep = 16,
+		SizeClassIndexCount = MaxObjectSize / SizeClassStep + 1
+	};
+
+	Slab* newSlab(CpuCache* cache, unsigned int sizeClass);
+	void freeLocal(CpuCache* cache, Slab* slab, void* ptr);
+	void drainRemoteFree(CpuCache* cache);
+	CpuCache* localCpuCache() const;
+	static void linkSlab(Slab*& head, Slab* slab);
+	static void unlinkSlab(Slab*& head, Slab* slab);
+
+	static Slab* slabOf(void* ptr)
+	{
+		return reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(ptr) & ~(SlabSize - 1));
+	}
+	static uint8_t& ownerIdOf(Slab* slab, void* ptr);
+
+private:
+	uint8_t m_sizeClassIndex[SizeClassIndexCount];
+	std::atomic<size_t> m_slabMemorySize{0};
+	bool m_ready = false;
+	static const uint32_t m_classSizes[SizeClassCount];
+};
@@ -22,10 +22,11 @@
 #pragma once
 #include <atomic>
 #include <klock_guard.h>
+#include <kmemory.h>
 
 //#define DEADLOCK_DEBUG
 
-struct alignas(16) QueuedSpinLockEntry
+struct alignas(CPU_CACHE_LINE_SIZE) QueuedSpinLockEntry
 {
 	std::atomic<QueuedSpinLockEntry*> m_next;
 	std::atomic<bool> m_state;
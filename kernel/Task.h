@@ -23,7 +23,9 @@
 #include <kalgorithm.h>
 #include <common_types.h>
 #include <limits>
+#include <kthread.h>
 #include "SpinLock.h"
+#include "TimerWheel.h"
 
 static const size_t TaskWaitEventsMax = 64;
 
@@ -64,12 +66,17 @@ struct Task
 	uint32_t m_needWaitEvents = 0;
 	State m_state = State::None;
 	TimePoint m_wakeTime;
+	TimerEntry m_sleepTimer;
 	QueuedSpinLockSm m_spin;
 	bool m_kernel;
 	bool m_useFpu = false;
 	bool m_idle = false;
 	TimePoint m_desiredMaxWait = 0;
+	kthread::SchedulingClass m_schedulingClass = kthread::SchedulingClass::Normal;
+	int m_priority = kthread::DefaultPriority;
+	kcpu_set m_affinity = kcpu_set::all();
 	bool m_readyForSleep = false;
+	unsigned int m_cpu = 0;
 	PagingManager64* m_pagingManager;
 };
 
@@ -143,6 +150,16 @@ public:
 		restore(0);
 	}
 
+	// moves the tasks to a larger array and returns the old one
+	Task** grow(Task** pointersArray, size_t maxSize)
+	{
+		kmemcpy(pointersArray, m_pointersArray, m_curSize * sizeof (Task*));
+		Task** oldArray = m_pointersArray;
+		m_pointersArray = pointersArray;
+		m_maxSize = maxSize;
+		return oldArray;
+	}
+
 	void remove(Task* task)
 	{
 		size_t idx = task->m_priorityQueueIndex;
@@ -188,7 +205,7 @@ private:
 
 private:
 	Task** m_pointersArray;
-	const size_t m_maxSize;
+	size_t m_maxSize;
 	size_t m_curSize = 0;
 	QueuedSpinLockSm m_spin;
 };
@@ -25,6 +25,7 @@
 #include "panic.h"
 #include "ThreadPrivate.h"
 #include "paging.h"
+#include "phmem.h"
 #include "gdt.h"
 #include "idt.h"
 #include "TaskManager.h"
@@ -56,8 +57,58 @@ void gccAsmFuncAddrBugWorkaround() { }
 TASK_SWITCH_HANDLER(localTaskSwitchHandler, "");
 TASK_SWITCH_HANDLER(externTaskSwitchHandler, EXTERN_BEGIN_ROUTINE);
 
+asm volatile(   ".globl localTimerHandler\n"
+                "localTimerHandler:\n"
+                INTERRUPT_SAVE_VOLATILE_REGS
+                IRQ_HANDLER_BEGIN_ASM_ROUTINE
+                "call localTimerInterrupt\n"
+                IRQ_HANDLER_END_ASM_ROUTINE
+                INTERRUPT_RESTORE_VOLATILE_REGS
+                "iretq\n");
+extern "C" void localTimerHandler();
+extern "C" void localTimerInterrupt()
+{
+	TaskManager::onLocalTimer();
+}
+
 static TaskManager* g_systemTaskManager = nullptr;
 
+// the running task is preempted only by a ready task of a higher rank
+enum : unsigned int
+{
+	IdleRank = 0,
+	BackgroundRank = 1,
+	NormalRank = 2,
+	RealtimeRank = 3
+};
+
+// share of CPU time of normal tasks by priority, each step is about 1.25 times the previous one
+static const TimePoint g_priorityWeights[kthread::MaxPriority + 1] = {
+	29, 36, 45, 56, 70, 88, 110, 137, 172, 215, 268, 336, 419, 524, 655, 819,
+	1024, 1280, 1600, 2000, 2500, 3125, 3906, 4883, 6104, 7629, 9537, 11921, 14901, 18626, 23283, 29104
+};
+
+static unsigned int realtimeLevel(const Task* task)
+{
+	return (task->m_schedulingClass == kthread::SchedulingClass::Realtime) ? (task->m_priority + 1) : 0;
+}
+
+static unsigned int taskRank(const Task* task)
+{
+	if (task->m_idle)
+		return IdleRank;
+
+	switch (task->m_schedulingClass)
+	{
+	case kthread::SchedulingClass::Realtime:
+		return RealtimeRank + realtimeLevel(task);
+	case kthread::SchedulingClass::Background:
+		return BackgroundRank;
+	default:
+		return NormalRank;
+	}
+}
+
 static void updateNextSheduleTime(TimePoint timepoint)
 {
 	cpuSetLocalData(LOCAL_CPU_SHED_TIME, timepoint);
@@ -86,26 +137,24 @@ static bool checkNeedTaskSwitch()
 	return true;
 }
 
-static void cpuIdleThreadProc()
-{
-	for (;;)
-	{
-		cpuHalt();
-	}
-}
-
 TaskManager::TaskManager()
 	: m_numCpu(cpuLogicalCount())
 	, m_apic(LocalApic::system())
+	, m_timerWheelTick(kmax<TimePoint>(m_timer->fromMicroseconds(SYSTEM_TIMER_WHEEL_TICK_US), 1))
 	, m_forcedTaskSwitchTimeInterval(m_timer->fromMilliseconds(SYSTEM_FORCED_TASK_SWITCH_TIME_MS))
+	, m_balanceTimeInterval(m_timer->fromMilliseconds(SYSTEM_RUN_QUEUE_BALANCE_TIME_MS))
 	, m_idleInfo(m_numCpu)
 {
+	m_runQueues = new RunQueue[m_numCpu];
+	m_timerWheels = new TimerWheel[m_numCpu];
 	m_kernelMainThread.m_private = new ThreadPrivate(&m_kernelMainThread, Process::kernel(), std::function<void()>(), false, 0, 0);
 	SystemIDT::setHandler(CPU_LOCAL_TASK_SW_VECTOR, &localTaskSwitchHandler, false);
 	SystemIDT::setHandler(CPU_EXTERN_TASK_SW_VECTOR, &externTaskSwitchHandler, true);
+	SystemIDT::setHandler(CPU_LOCAL_TIMER_VECTOR, &localTimerHandler, true);
+	m_apic.calibrateTimer();
 	for (IdleInfo& idleInfo : m_idleInfo)
 	{
-		kthread* idleThread = new kthread(&cpuIdleThreadProc, false);
+		kthread* idleThread = new kthread(&idleThreadProc, false);
 		Task* task = idleThread->m_private->m_task.get();
 		task->m_idle = true;
 		idleInfo.m_task = task;
@@ -131,7 +180,6 @@ void TaskManager::init()
 	mgr->initCurrentCpu(&mgr->m_kernelMainThread);
 	mgr->m_timer->updateTimePoint();
 	g_systemTaskManager = mgr;
-	mgr->m_timer->setEnableInterrupt(true);
 }
 
 void TaskManager::initCurrentCpu(kthread* firstThread)
@@ -139,10 +187,15 @@ void TaskManager::initCurrentCpu(kthread* firstThread)
 	Task* task = firstThread->m_private->m_task.get();
 	task->m_state = Task::State::Active;
 	setCurrent(task);
-	updateNextSheduleTime(AbstractTimer::system()->fastTimepoint());
+	updateNextSheduleTime(m_timer->fastTimepoint() + m_forcedTaskSwitchTimeInterval);
 	const unsigned int cpuId = cpuCurrentId();
+	task->m_cpu = cpuId;
 	cpuSetLocalPtr(LOCAL_CPU_IDLE_TASK, m_idleInfo[cpuId].m_task);
 	cpuSetLocalData(LOCAL_CPU_MT_LOCK_COUNT, 0);
+	cpuSetLocalData(LOCAL_CPU_TIMER_DEADLINE, 0);
+	m_timerWheels[cpuId].init(cpuId, m_timerWheelTick, m_timer->fastTimepoint());
+	m_runQueues[cpuId].m_runningRank.store(taskRank(task), std::memory_order_relaxed);
+	armCpuTimer(task);
 }
 
 void TaskManager::disableTaskSwitchingOnCurrentCPU()
@@ -171,30 +224,24 @@ void TaskManager::setCurrent(Task* task)
 // currentTask locked
 Task* TaskManager::shedule(Task* currentTask)
 {
-	if (m_realtimeListHead.load(std::memory_order_acquire) != nullptr)
-	{
-		kunique_lock lock(m_realtimeListSpin);
-		for (;;)
-		{
-			Task* head = m_realtimeListHead.load(std::memory_order_relaxed);
-			if (head == nullptr)
-				break;
-
-			m_realtimeListHead.store(head->m_realtimeNext, std::memory_order_release);
-			lock.unlock();
-			head->m_spin.lock();
-			if (head->m_state == Task::State::PriorityWait)
-				return head;
-
-			head->m_spin.unlock();
-			lock.lock();
-		}
-	}
-
 	const TimePoint timepoint = m_timer->fastTimepoint();
-	if (!currentTask->m_idle && (currentTask->m_state == Task::State::Active))
+	const unsigned int cpuId = cpuCurrentId();
+
+	// a task which can't continue here holds no rank
+	const bool currentActive = !currentTask->m_idle && (currentTask->m_state == Task::State::Active) && currentTask->m_affinity.test(cpuId);
+	Task* newTask = popRealtimeQueue(cpuId, currentActive ? taskRank(currentTask) : IdleRank);
+	if (newTask != nullptr)
+		return newTask;
+
+	RunQueue& queue = m_runQueues[cpuId];
+	if (currentActive)
 	{
-		if (getNextSheduleTime() > timepoint)
+		// realtime tasks aren't time sliced, background ones give way to normal tasks at once
+		if (currentTask->m_schedulingClass == kthread::SchedulingClass::Realtime)
+			return currentTask;
+
+		const bool normalWaits = (queue.m_size.load(std::memory_order_relaxed) > queue.m_backgroundSize.load(std::memory_order_relaxed));
+		if ((getNextSheduleTime() > timepoint) && ((currentTask->m_schedulingClass != kthread::SchedulingClass::Background) || !normalWaits))
 			return currentTask;
 	}
 
@@ -216,62 +263,274 @@ Task* TaskManager::shedule(Task* currentTask)
 	private:
 		const TimePoint m_timepoint;
 	} updateTimePointGuard(timepoint + m_forcedTaskSwitchTimeInterval);
+	balanceRunQueues(cpuId, timepoint);
+	// a normal task doesn't give its time to background ones
+	const bool withBackground = !currentActive || (currentTask->m_schedulingClass == kthread::SchedulingClass::Background);
+	newTask = popRunQueue(queue, cpuId, withBackground);
+	if (newTask != nullptr)
 	{
-		kunique_lock lock(m_timedSleepTaskQueueSpin);
-		while (!m_timedSleepTaskQueue.empty())
-		{
-			Task* newTask = m_timedSleepTaskQueue.minWakeTimeTask();
-			if (newTask->m_wakeTime >= timepoint)
-				break;
-
-			m_timedSleepTaskQueue.pop();
-			lock.unlock();
-			newTask->m_spin.lock();
-			newTask->m_priorityQueueIndex = Task::InvalidIndex;
-			if (newTask->m_state == Task::State::TimedSleep)
-			{
-				EventObject::excludeTaskFromWaiting(newTask, EventObject::WaitTimeout);
-				return newTask;
-			}
-
-			newTask->m_spin.unlock();
-			lock.lock();
-		}
+		// halted CPUs don't balance, the tasks left behind are offered to them
+		if (queue.m_size.load(std::memory_order_relaxed) != 0)
+			wakeIdleCpu(cpuId, kcpu_set::all());
+		return newTask;
 	}
+
+	// a CPU about to idle takes work from the busiest queue
+	if ((currentTask->m_state != Task::State::Active) || currentTask->m_idle)
 	{
-		kunique_lock lock(m_activeTaskQueueSpin);
-		if (!m_waitTaskQueue.empty())
-		{
-			do
-			{
-				Task* newTask = m_waitTaskQueue.minWakeTimeTask();
-				m_waitTaskQueue.pop();
-				
-				lock.unlock();
-				newTask->m_spin.lock();
-				newTask->m_priorityQueueIndex = Task::InvalidIndex;
-				if (newTask->m_state == Task::State::Wait)
-					return newTask;
-
-				newTask->m_spin.unlock();
-				lock.lock();
-			}
-			while (!m_waitTaskQueue.empty());
-		}
+		newTask = stealTask(cpuId);
+		if (newTask != nullptr)
+			return newTask;
 	}
-	if (currentTask->m_state == Task::State::Active)
+	if (currentTask->m_idle || currentActive)
 	{
 		if (currentTask->m_idle)
-			m_idleInfo[cpuCurrentId()].m_run.store(true, std::memory_order_release);
+			m_idleInfo[cpuId].m_run.store(true, std::memory_order_release);
 		return currentTask;
 	}
 
 	Task* idle = idleTask();
 	idle->m_spin.lock();
-	m_idleInfo[cpuCurrentId()].m_run.store(true, std::memory_order_release);
+	m_idleInfo[cpuId].m_run.store(true, std::memory_order_release);
 	return idle;
 }
 
+// task locked
+void TaskManager::enqueueTask(Task* task, unsigned int cpuId)
+{
+	if (task->m_schedulingClass == kthread::SchedulingClass::Realtime)
+	{
+		task->m_state = Task::State::PriorityWait;
+		pushRealtimeQueue(task, realtimeLevel(task));
+		return;
+	}
+
+	task->m_state = Task::State::Wait;
+	task->m_wakeTime = m_timer->fastTimepoint() + task->m_desiredMaxWait;
+	task->m_cpu = cpuId;
+	pushRunQueue(cpuId, task);
+}
+
+void TaskManager::pushRealtimeQueue(Task* task, unsigned int level, bool front)
+{
+	klock_guard lock(m_realtimeQueue.m_spin);
+	Task*& head = m_realtimeQueue.m_heads[level];
+	Task*& tail = m_realtimeQueue.m_tails[level];
+	if (front)
+	{
+		task->m_realtimeNext = head;
+		head = task;
+		if (tail == nullptr)
+			tail = task;
+	}
+	else
+	{
+		task->m_realtimeNext = nullptr;
+		if (tail != nullptr)
+			tail->m_realtimeNext = task;
+		else
+			head = task;
+		tail = task;
+	}
+	m_realtimeQueue.m_levels.store(m_realtimeQueue.m_levels.load(std::memory_order_relaxed) | (1ULL << level), std::memory_order_release);
+}
+
+// returns a locked task of the highest level allowed on the CPU if it outranks the current one
+Task* TaskManager::popRealtimeQueue(unsigned int cpuId, unsigned int currentRank)
+{
+	if (m_realtimeQueue.m_levels.load(std::memory_order_acquire) == 0)
+		return nullptr;
+
+	kunique_lock lock(m_realtimeQueue.m_spin);
+	uint64_t levels = m_realtimeQueue.m_levels.load(std::memory_order_relaxed);
+	while (levels != 0)
+	{
+		const unsigned int level = 63 - __builtin_clzll(levels);
+		if (RealtimeRank + level <= currentRank)
+			break;
+
+		Task* prev = nullptr;
+		Task* task = m_realtimeQueue.m_heads[level];
+		while ((task != nullptr) && !task->m_affinity.test(cpuId))
+		{
+			prev = task;
+			task = task->m_realtimeNext;
+		}
+		if (task == nullptr)
+		{
+			levels &= ~(1ULL << level);
+			continue;
+		}
+
+		if (prev != nullptr)
+			prev->m_realtimeNext = task->m_realtimeNext;
+		else
+			m_realtimeQueue.m_heads[level] = task->m_realtimeNext;
+		if (task->m_realtimeNext == nullptr)
+			m_realtimeQueue.m_tails[level] = prev;
+		if (m_realtimeQueue.m_heads[level] == nullptr)
+			m_realtimeQueue.m_levels.store(m_realtimeQueue.m_levels.load(std::memory_order_relaxed) & ~(1ULL << level), std::memory_order_relaxed);
+		lock.unlock();
+		task->m_spin.lock();
+		if (task->m_state == Task::State::PriorityWait)
+			return task;
+
+		task->m_spin.unlock();
+		lock.lock();
+		levels = m_realtimeQueue.m_levels.load(std::memory_order_relaxed);
+	}
+	return nullptr;
+}
+
+void TaskManager::pushRunQueue(unsigned int cpuId, Task* task)
+{
+	RunQueue& queue = m_runQueues[cpuId];
+	klock_guard lock(queue.m_spin);
+	if (task->m_schedulingClass == kthread::SchedulingClass::Background)
+	{
+		if (!queue.m_backgroundTasks.push(task))
+			PANIC(L"Run queue overflow");
+		queue.m_backgroundSize.store(queue.m_backgroundSize.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	else if (!queue.m_tasks.push(task))
+	{
+		PANIC(L"Run queue overflow");
+	}
+	queue.m_size.store(queue.m_size.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// returns a locked task ready to run on the CPU
+Task* TaskManager::popRunQueue(RunQueue& queue, unsigned int cpuId, bool withBackground)
+{
+	const size_t size = queue.m_size.load(std::memory_order_relaxed);
+	if ((size == 0) || (!withBackground && (size == queue.m_backgroundSize.load(std::memory_order_relaxed))))
+		return nullptr;
+
+	Task* skipped[MaxSkippedTasks];
+	size_t skippedCount = 0;
+	Task* result = nullptr;
+	kunique_lock lock(queue.m_spin);
+	while (skippedCount < MaxSkippedTasks)
+	{
+		const bool background = queue.m_tasks.empty();
+		if (background && (!withBackground || queue.m_backgroundTasks.empty()))
+			break;
+
+		TaskPriorityQueue& tasks = background ? queue.m_backgroundTasks : queue.m_tasks;
+		Task* task = tasks.minWakeTimeTask();
+		tasks.pop();
+		queue.m_size.store(queue.m_size.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		if (background)
+			queue.m_backgroundSize.store(queue.m_backgroundSize.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		if (!task->m_affinity.test(cpuId))
+		{
+			skipped[skippedCount++] = task;
+			continue;
+		}
+
+		lock.unlock();
+		task->m_spin.lock();
+		task->m_priorityQueueIndex = Task::InvalidIndex;
+		if (task->m_state == Task::State::Wait)
+		{
+			result = task;
+			break;
+		}
+
+		task->m_spin.unlock();
+		lock.lock();
+	}
+	lock.unlock();
+
+	// the tasks the CPU may not run go back to their queue or to a CPU they are allowed on
+	const unsigned int queueCpuId = static_cast<unsigned int>(&queue - m_runQueues);
+	for (size_t idx = 0; idx < skippedCount; ++idx)
+	{
+		Task* task = skipped[idx];
+		klock_guard taskLock(task->m_spin);
+		task->m_priorityQueueIndex = Task::InvalidIndex;
+		if (task->m_state != Task::State::Wait)
+			continue;
+
+		if (!task->m_affinity.test(queueCpuId))
+			task->m_cpu = task->m_affinity.first(m_numCpu);
+		pushRunQueue(task->m_cpu, task);
+		if (task->m_cpu != queueCpuId)
+			preemptCpu(task->m_cpu, taskRank(task));
+	}
+	return result;
+}
+
+unsigned int TaskManager::busiestRunQueue(unsigned int cpuId) const
+{
+	unsigned int busiest = cpuId;
+	size_t maxSize = 0;
+	for (unsigned int idx = 0; idx < m_numCpu; ++idx)
+	{
+		const size_t size = m_runQueues[idx].m_size.load(std::memory_order_relaxed);
+		if ((idx != cpuId) && (size > maxSize))
+		{
+			busiest = idx;
+			maxSize = size;
+		}
+	}
+	return busiest;
+}
+
+Task* TaskManager::stealTask(unsigned int cpuId)
+{
+	const unsigned int busiest = busiestRunQueue(cpuId);
+	if (busiest == cpuId)
+		return nullptr;
+
+	return popRunQueue(m_runQueues[busiest], cpuId, true);
+}
+
+void TaskManager::balanceRunQueues(unsigned int cpuId, TimePoint timepoint)
+{
+	RunQueue& queue = m_runQueues[cpuId];
+	if (queue.m_nextBalanceTime > timepoint)
+		return;
+
+	// pulls one task at a time, busy CPUs even out over a few intervals
+	queue.m_nextBalanceTime = timepoint + m_balanceTimeInterval;
+	const unsigned int busiest = busiestRunQueue(cpuId);
+	if ((busiest == cpuId) || (m_runQueues[busiest].m_size.load(std::memory_order_relaxed) <= queue.m_size.load(std::memory_order_relaxed) + 1))
+		return;
+
+	Task* task = popRunQueue(m_runQueues[busiest], cpuId, true);
+	if (task == nullptr)
+		return;
+
+	task->m_cpu = cpuId;
+	pushRunQueue(cpuId, task);
+	task->m_spin.unlock();
+}
+
+// one-shot timer of the current CPU for the end of the time slice or the next event of its timer wheel,
+// an idle CPU without pending timers takes no timer interrupts at all
+void TaskManager::armCpuTimer(const Task* task)
+{
+	TimePoint deadline = m_timerWheels[cpuCurrentId()].nextEventTime();
+	if (!task->m_idle && (task->m_schedulingClass != kthread::SchedulingClass::Realtime))
+		deadline = kmin(deadline, getNextSheduleTime());
+
+	const TimePoint timepoint = m_timer->fastTimepoint();
+	const TimePoint armedDeadline = cpuGetLocalData(LOCAL_CPU_TIMER_DEADLINE);
+	if ((deadline == armedDeadline) && (armedDeadline > timepoint))
+		return;
+
+	if (deadline == kevent::WaitInfinite)
+	{
+		m_apic.stopTimer();
+		cpuSetLocalData(LOCAL_CPU_TIMER_DEADLINE, deadline);
+		return;
+	}
+
+	const TimePoint delay = (deadline > timepoint) ? (deadline - timepoint) : 0;
+	cpuSetLocalData(LOCAL_CPU_TIMER_DEADLINE, timepoint + m_apic.startTimer(delay));
+}
+
 uintptr_t TaskManager::beginTaskSwitch(uintptr_t currentStack)
 {
 	Task* currentTask = current();
@@ -280,9 +539,11 @@ uintptr_t TaskManager::beginTaskSwitch(uintptr_t currentStack)
 	else
 		currentTask->m_readyForSleep = false;
 	cpuSetLocalData(LOCAL_CPU_NEED_TASK_SWITCH, 0);
-	Task* newTask = TaskManager::system()->shedule(currentTask);
+	TaskManager* mgr = TaskManager::system();
+	Task* newTask = mgr->shedule(currentTask);
 	if (currentTask == newTask)
 	{
+		mgr->armCpuTimer(currentTask);
 		currentTask->m_spin.unlock();
 		return 0;
 	}
@@ -306,19 +567,31 @@ void TaskManager::endTaskSwitch()
 	{
 		mgr->m_idleInfo[cpuCurrentId()].m_run.store(false, std::memory_order_release);
 	}
+	else if ((oldTask->m_state == Task::State::Active) && (oldTask->m_schedulingClass == kthread::SchedulingClass::Realtime))
+	{
+		// preempted by a higher level, runs again before the rest of its level
+		oldTask->m_state = Task::State::PriorityWait;
+		mgr->pushRealtimeQueue(oldTask, realtimeLevel(oldTask), true);
+		if (!oldTask->m_affinity.test(cpuCurrentId()))
+			mgr->preemptLowestCpu(oldTask->m_affinity, taskRank(oldTask));
+	}
 	else if (oldTask->m_state == Task::State::Active)
 	{
-		klock_guard lock(mgr->m_activeTaskQueueSpin);
 		oldTask->m_state = Task::State::Wait;
 		oldTask->m_wakeTime = mgr->m_timer->fastTimepoint();
 		if (newTask->m_state != Task::State::PriorityWait)
 			oldTask->m_wakeTime += oldTask->m_desiredMaxWait;
-		mgr->m_waitTaskQueue.push(oldTask);
+		const unsigned int cpuId = mgr->selectCpu(oldTask, cpuCurrentId());
+		oldTask->m_cpu = cpuId;
+		mgr->pushRunQueue(cpuId, oldTask);
+		if ((cpuId == cpuCurrentId()) || !mgr->preemptCpu(cpuId, taskRank(oldTask)))
+			mgr->wakeIdleCpu(cpuCurrentId(), oldTask->m_affinity);
 	}
 	else if (oldTask->m_state == Task::State::TimedSleep)
 	{
-		klock_guard lock(mgr->m_timedSleepTaskQueueSpin);
-		mgr->m_timedSleepTaskQueue.push(oldTask);
+		oldTask->m_sleepTimer.m_handler = &onSleepTimeout;
+		oldTask->m_sleepTimer.m_context = oldTask;
+		mgr->m_timerWheels[cpuCurrentId()].add(&oldTask->m_sleepTimer, oldTask->m_wakeTime);
 	}
 	else if (oldTask->m_state == Task::State::Terminated)
 	{
@@ -345,16 +618,13 @@ void TaskManager::endTaskSwitch()
 	}
 
 	newTask->m_state = Task::State::Active;
+	newTask->m_cpu = cpuCurrentId();
+	mgr->m_runQueues[newTask->m_cpu].m_runningRank.store(taskRank(newTask), std::memory_order_relaxed);
 	setCurrent(newTask);
+	mgr->armCpuTimer(newTask);
 	newTask->m_spin.unlock();
 }
 
-void TaskManager::onSystemTimerInterrupt()
-{
-	needTaskSwitch();
-	system()->m_apic.sendBroadcastIpi(CPU_EXTERN_TASK_SW_VECTOR);
-}
-
 void TaskManager::needTaskSwitch()
 {
 	cpuSetLocalData(LOCAL_CPU_NEED_TASK_SWITCH, 1);
@@ -387,59 +657,177 @@ bool TaskManager::prepareToSleep(Task* task, TimePoint timeout)
 
 void TaskManager::addWaitTask(Task* task)
 {
-	task->m_state = Task::State::Wait;
-	task->m_wakeTime = m_timer->fastTimepoint() + task->m_desiredMaxWait;
+	cancelTimer(&task->m_sleepTimer);
+	if (task->m_schedulingClass == kthread::SchedulingClass::Realtime)
 	{
-		klock_guard lock(m_activeTaskQueueSpin);
-		m_waitTaskQueue.push(task);
+		addWaitTaskRealtime(task);
+		return;
 	}
+
+	const unsigned int currCpuId = cpuCurrentId();
+	const unsigned int cpuId = selectCpu(task, currCpuId);
+	enqueueTask(task, cpuId);
+
+	// idle CPUs take no ticks, they must be told about new work
+	if (!preemptCpu(cpuId, taskRank(task)))
+		wakeIdleCpu(currCpuId, task->m_affinity);
 }
 
+// back to the CPU the task ran on unless that one is halted, the waker's CPU otherwise
+unsigned int TaskManager::selectCpu(const Task* task, unsigned int currCpuId) const
+{
+	const bool lastAllowed = task->m_affinity.test(task->m_cpu);
+	if (lastAllowed && !m_idleInfo[task->m_cpu].m_run.load(std::memory_order_relaxed))
+		return task->m_cpu;
+
+	if (task->m_affinity.test(currCpuId))
+		return currCpuId;
+
+	return lastAllowed ? task->m_cpu : task->m_affinity.first(m_numCpu);
+}
+
+// realtime tasks at their level, the others once ahead of all normal tasks
 void TaskManager::addWaitTaskRealtime(Task* task)
 {
+	cancelTimer(&task->m_sleepTimer);
 	task->m_state = Task::State::PriorityWait;
+	const unsigned int level = realtimeLevel(task);
+	pushRealtimeQueue(task, level);
+	preemptLowestCpu(task->m_affinity, RealtimeRank + level);
+}
+
+void TaskManager::setScheduling(Task* task, kthread::SchedulingClass schedulingClass, int priority)
+{
+	priority = kmax<int>(kthread::MinPriority, kmin<int>(priority, kthread::MaxPriority));
+	TaskSwitchLock tsLock;
+	klock_guard lock(task->m_spin);
+	task->m_schedulingClass = schedulingClass;
+	task->m_priority = priority;
+	task->m_desiredMaxWait = m_forcedTaskSwitchTimeInterval * g_priorityWeights[kthread::DefaultPriority] / g_priorityWeights[priority];
+	// a running task keeps its CPU but the rank and time slice change at once
+	if (task->m_state == Task::State::Active)
 	{
-		klock_guard lock(m_realtimeListSpin);
-		Task* head = m_realtimeListHead.load(std::memory_order_relaxed);
-		task->m_realtimeNext = head;
-		m_realtimeListHead.store(task, std::memory_order_relaxed);
+		m_runQueues[task->m_cpu].m_runningRank.store(taskRank(task), std::memory_order_relaxed);
+		rescheduleCpu(task->m_cpu);
 	}
 }
 
-void TaskManager::smpBalancing()
+// a running task moves at once, also from another CPU, a waiting one when it is picked or woken next
+bool TaskManager::setAffinity(Task* task, const kcpu_set& cpus)
 {
-	const unsigned int currCpuId = cpuCurrentId();
-	auto checkCpu = [this](unsigned int cpuId) -> bool {
-		IdleInfo& info = m_idleInfo[cpuId];
-		bool desired = true;
-		if (!info.m_run.load(std::memory_order_relaxed))
-			return false;
-		
-		if (!info.m_run.compare_exchange_weak(desired, false, std::memory_order_acquire, std::memory_order_relaxed))
-			return false;
-		
-		const TimePoint cutTime = m_timer->fastTimepoint();
-		if (info.m_nextIpiTime > cutTime)
+	if (cpus.first(m_numCpu) == m_numCpu)
+		return false;
+
+	TaskSwitchLock tsLock;
+	klock_guard lock(task->m_spin);
+	task->m_affinity = cpus;
+	if ((task->m_state == Task::State::Active) && !cpus.test(task->m_cpu))
+		rescheduleCpu(task->m_cpu);
+	return true;
+}
+
+// reschedules the CPU if the task made ready outranks the running one
+bool TaskManager::preemptCpu(unsigned int cpuId, unsigned int rank)
+{
+	// the task queued before is seen by a CPU going idle, or its idle rank is seen here
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (rank <= m_runQueues[cpuId].m_runningRank.load(std::memory_order_relaxed))
+		return false;
+
+	rescheduleCpu(cpuId);
+	return true;
+}
+
+void TaskManager::rescheduleCpu(unsigned int cpuId)
+{
+	if (cpuId == cpuCurrentId())
+		needTaskSwitch();
+	else
+		m_apic.sendIpi(LocalApic::systemCpuIdToApic(cpuId), CPU_EXTERN_TASK_SW_VECTOR);
+}
+
+void TaskManager::preemptLowestCpu(const kcpu_set& cpus, unsigned int rank)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	unsigned int lowestCpuId = m_numCpu;
+	unsigned int lowestRank = rank;
+	for (unsigned int cpuId = 0; (cpuId < m_numCpu) && (lowestRank > IdleRank); ++cpuId)
+	{
+		const unsigned int runningRank = m_runQueues[cpuId].m_runningRank.load(std::memory_order_relaxed);
+		if (cpus.test(cpuId) && (runningRank < lowestRank))
 		{
-			info.m_run.store(true, std::memory_order_release);
-			return false;
+			lowestCpuId = cpuId;
+			lowestRank = runningRank;
 		}
-		
-		info.m_nextIpiTime = cutTime + m_forcedTaskSwitchTimeInterval;
+	}
+	if (lowestCpuId != m_numCpu)
+		preemptCpu(lowestCpuId, rank);
+}
+
+void TaskManager::idleThreadProc()
+{
+	RamAllocator& ramAllocator = RamAllocator::getInstance();
+	TaskManager* mgr = system();
+	for (;;)
+	{
+		if (!ramAllocator.zeroIdlePage())
+			mgr->haltIdleCpu();
+	}
+}
+
+// a waker which saw the CPU still busy queued its task without an IPI, so the idle task
+// looks for such tasks after its idle state is published and halts only if there are none
+void TaskManager::haltIdleCpu()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!hasReadyTask(cpuCurrentId()))
+	{
+		cpuHalt();
+		return;
+	}
+
+	TaskSwitchLock lock;
+	needTaskSwitch();
+}
+
+bool TaskManager::hasReadyTask(unsigned int cpuId)
+{
+	const RunQueue& queue = m_runQueues[cpuId];
+	if ((queue.m_size.load(std::memory_order_relaxed) != 0) || (queue.m_backgroundSize.load(std::memory_order_relaxed) != 0))
 		return true;
-	};
-	if (!checkCpu(currCpuId))
+
+	if (m_realtimeQueue.m_levels.load(std::memory_order_acquire) == 0)
+		return false;
+
+	klock_guard lock(m_realtimeQueue.m_spin);
+	for (uint64_t levels = m_realtimeQueue.m_levels.load(std::memory_order_relaxed); levels != 0; levels &= levels - 1)
 	{
-		for (unsigned int cpuId = 0; cpuId < m_numCpu; ++cpuId)
+		for (const Task* task = m_realtimeQueue.m_heads[__builtin_ctzll(levels)]; task != nullptr; task = task->m_realtimeNext)
 		{
-			if ((cpuId != currCpuId) && checkCpu(cpuId))
-			{
-				m_apic.sendIpi(LocalApic::systemCpuIdToApic(cpuId), CPU_EXTERN_TASK_SW_VECTOR);
-				return;
-			}
+			if (task->m_affinity.test(cpuId))
+				return true;
 		}
 	}
-	needTaskSwitch();
+	return false;
+}
+
+bool TaskManager::wakeIdleCpu(unsigned int currCpuId, const kcpu_set& cpus)
+{
+	for (unsigned int cpuId = 0; cpuId < m_numCpu; ++cpuId)
+	{
+		IdleInfo& info = m_idleInfo[cpuId];
+		bool desired = true;
+		if ((cpuId == currCpuId) || !cpus.test(cpuId) || !info.m_run.load(std::memory_order_relaxed))
+			continue;
+
+		// cleared until the CPU picks idle again, so it is kicked once per pass through shedule
+		if (!info.m_run.compare_exchange_weak(desired, false, std::memory_order_acquire, std::memory_order_relaxed))
+			continue;
+
+		m_apic.sendIpi(LocalApic::systemCpuIdToApic(cpuId), CPU_EXTERN_TASK_SW_VECTOR);
+		return true;
+	}
+	return false;
 }
 
 void TaskManager::terminateCurrentTask()
@@ -507,3 +895,100 @@ extern "C"
 	}
 }
 
+void TaskManager::reserveTask()
+{
+	const size_t taskCount = m_taskCount.fetch_add(1, std::memory_order_relaxed) + 1;
+	if (taskCount <= m_runQueueSize.load(std::memory_order_acquire))
+		return;
+
+	klock_guard lock(m_runQueueGrowMutex);
+	const size_t size = m_runQueueSize.load(std::memory_order_relaxed);
+	if (taskCount <= size)
+		return;
+
+	// arrays are allocated and freed outside of the queue locks
+	const size_t newSize = kmax(size * 2, taskCount);
+	for (unsigned int cpuId = 0; cpuId < m_numCpu; ++cpuId)
+	{
+		RunQueue& queue = m_runQueues[cpuId];
+		for (TaskPriorityQueue* tasks : {&queue.m_tasks, &queue.m_backgroundTasks})
+		{
+			Task** pointersArray = new Task*[newSize];
+			Task** oldArray;
+			{
+				TaskSwitchLock tsLock;
+				klock_guard queueLock(queue.m_spin);
+				oldArray = tasks->grow(pointersArray, newSize);
+			}
+			delete[] oldArray;
+		}
+	}
+	m_runQueueSize.store(newSize, std::memory_order_release);
+}
+
+void TaskManager::releaseTask()
+{
+	m_taskCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void TaskManager::startTimer(TimerEntry* entry, TimePoint deadline)
+{
+	cancelTimer(entry);
+	TaskSwitchLock tsLock;
+	m_timerWheels[cpuCurrentId()].add(entry, deadline);
+	CpuInterruptLockSave intLock;
+	armCpuTimer(current());
+}
+
+bool TaskManager::cancelTimer(TimerEntry* entry)
+{
+	// the entry may expire or be started on another CPU meanwhile
+	for (;;)
+	{
+		const unsigned int wheel = entry->m_wheel.load(std::memory_order_acquire);
+		if (wheel == TimerEntry::NoWheel)
+			return false;
+
+		if (m_timerWheels[wheel].remove(entry))
+			return true;
+	}
+}
+
+void TaskManager::cancelTimerSync(TimerEntry* entry)
+{
+	// a handler may start its own timer again
+	do
+	{
+		cancelTimer(entry);
+		for (unsigned int cpuId = 0; cpuId < m_numCpu; ++cpuId)
+		{
+			while (m_timerWheels[cpuId].running(entry))
+				cpuPause();
+		}
+	} while (entry->m_wheel.load(std::memory_order_acquire) != TimerEntry::NoWheel);
+}
+
+void TaskManager::onLocalTimer()
+{
+	cpuFastEio();
+	// the one-shot may fire a bit before the timepoint reaches its deadline, it is armed again in any case
+	cpuSetLocalData(LOCAL_CPU_TIMER_DEADLINE, 0);
+	TaskManager* mgr = system();
+	mgr->m_timerWheels[cpuCurrentId()].expire(mgr->m_timer->fastTimepoint());
+
+	// reschedules on the way out of the interrupt, which also arms the timer again
+	needTaskSwitch();
+}
+
+// the task may have been woken and put to sleep again since the timer expired
+void TaskManager::onSleepTimeout(void* context)
+{
+	Task* task = static_cast<Task*>(context);
+	TaskManager* mgr = system();
+	klock_guard lock(task->m_spin);
+	if ((task->m_state != Task::State::TimedSleep) || (task->m_wakeTime > mgr->m_timer->fastTimepoint()))
+		return;
+
+	EventObject::excludeTaskFromWaiting(task, EventObject::WaitTimeout);
+	mgr->addWaitTask(task);
+}
@@ -21,15 +21,20 @@
 
 #pragma once
 #include <kthread.h>
+#include <kevent.h>
 #include <kvector.h>
+#include <kmutex.h>
 #include <memory>
 #include "Task.h"
 #include "AbstractTimer.h"
+#include "TimerWheel.h"
 
 enum
 {
 	SYSTEM_FORCED_TASK_SWITCH_TIME_MS = 10,
-	SYSTEM_TIMER_FREQUENCY_DIV = (1000 / SYSTEM_FORCED_TASK_SWITCH_TIME_MS)
+	SYSTEM_TIMER_FREQUENCY_DIV = (1000 / SYSTEM_FORCED_TASK_SWITCH_TIME_MS),
+	SYSTEM_RUN_QUEUE_BALANCE_TIME_MS = 4 * SYSTEM_FORCED_TASK_SWITCH_TIME_MS,
+	SYSTEM_TIMER_WHEEL_TICK_US = 100
 };
 
 extern "C"
@@ -39,7 +44,6 @@ extern "C"
 	int tackManagerEndTaskSwitch();
 }
 
-static size_t SystemMaxThreads = 0x10000;
 class LocalApic;
 class TaskManager
 {
@@ -51,7 +55,16 @@ public:
 	static Task* current();
 	void addWaitTask(Task* task);
 	void addWaitTaskRealtime(Task* task);
-	void smpBalancing();
+	void setScheduling(Task* task, kthread::SchedulingClass schedulingClass, int priority);
+	bool setAffinity(Task* task, const kcpu_set& cpus);
+	// run queues grow with the number of threads, each of them may hold all of them
+	void reserveTask();
+	void releaseTask();
+	// the handler runs in interrupt context on the CPU which started the timer
+	void startTimer(TimerEntry* entry, TimePoint deadline);
+	bool cancelTimer(TimerEntry* entry);
+	// also waits for a running handler, not to be called from the handler itself
+	void cancelTimerSync(TimerEntry* entry);
 
 	uint64_t contextSwitchCount() const
 	{
@@ -61,17 +74,49 @@ public:
 	static TaskManager* system();
 	static void init();
 	static bool prepareToSleep(Task* task, TimePoint timeout);
-	static void onSystemTimerInterrupt();
 	static bool onUseFpu();
 
 	static void terminateCurrentTask();
+	static void onLocalTimer();
 
 private:
-	struct IdleInfo
+	struct alignas(CPU_CACHE_LINE_SIZE) IdleInfo
 	{
 		Task* m_task = nullptr;
 		std::atomic<bool> m_run{false};
-		TimePoint m_nextIpiTime = 0;
+	};
+
+	enum : size_t
+	{
+		InitialRunQueueSize = 64
+	};
+
+	// waiting tasks of a CPU ordered by wake time, background tasks go after all normal ones
+	struct alignas(CPU_CACHE_LINE_SIZE) RunQueue
+	{
+		TaskPriorityQueue m_tasks{new Task*[InitialRunQueueSize], InitialRunQueueSize};
+		TaskPriorityQueue m_backgroundTasks{new Task*[InitialRunQueueSize], InitialRunQueueSize};
+		QueuedSpinLockSm m_spin;
+		std::atomic<size_t> m_size{0};
+		std::atomic<size_t> m_backgroundSize{0};
+		std::atomic<unsigned int> m_runningRank{0};
+		TimePoint m_nextBalanceTime = 0;
+	};
+
+	enum
+	{
+		RealtimeLevels = kthread::MaxPriority + 2,
+		MaxSkippedTasks = 8
+	};
+
+	// ready realtime tasks of all CPUs, FIFO within a level;
+	// level 0 is for other tasks woken through addWaitTaskRealtime
+	struct RealtimeQueue
+	{
+		Task* m_heads[RealtimeLevels] = {};
+		Task* m_tails[RealtimeLevels] = {};
+		std::atomic<uint64_t> m_levels{0};
+		QueuedSpinLock m_spin;
 	};
 
 private:
@@ -85,19 +130,40 @@ private:
 	static uintptr_t postInterrurptHandler(uintptr_t currentStack);
 	static void endTaskSwitch();
 	static void needTaskSwitch();
+	void pushRunQueue(unsigned int cpuId, Task* task);
+	Task* popRunQueue(RunQueue& queue, unsigned int cpuId, bool withBackground);
+	void pushRealtimeQueue(Task* task, unsigned int level, bool front = false);
+	Task* popRealtimeQueue(unsigned int cpuId, unsigned int currentRank);
+	unsigned int selectCpu(const Task* task, unsigned int currCpuId) const;
+	void enqueueTask(Task* task, unsigned int cpuId);
+	bool preemptCpu(unsigned int cpuId, unsigned int rank);
+	void rescheduleCpu(unsigned int cpuId);
+	void preemptLowestCpu(const kcpu_set& cpus, unsigned int rank);
+	unsigned int busiestRunQueue(unsigned int cpuId) const;
+	Task* stealTask(unsigned int cpuId);
+	void balanceRunQueues(unsigned int cpuId, TimePoint timepoint);
+	void armCpuTimer(const Task* task);
+	bool wakeIdleCpu(unsigned int currCpuId, const kcpu_set& cpus);
+	static void idleThreadProc();
+	void haltIdleCpu();
+	bool hasReadyTask(unsigned int cpuId);
+	static void onSleepTimeout(void* context);
 
 private:
 	unsigned const int m_numCpu;
 	LocalApic& m_apic;
 	kthread m_kernelMainThread;
-	std::atomic<Task*> m_realtimeListHead{nullptr};
-	QueuedSpinLock m_realtimeListSpin;
-	TaskPriorityQueue m_waitTaskQueue{new Task*[SystemMaxThreads], SystemMaxThreads};
-	QueuedSpinLockSm m_activeTaskQueueSpin;
-	TaskPriorityQueue m_timedSleepTaskQueue{new Task*[SystemMaxThreads], SystemMaxThreads};
-	QueuedSpinLockSm m_timedSleepTaskQueueSpin;
+	RealtimeQueue m_realtimeQueue;
+	RunQueue* m_runQueues;
+	// the kernel main thread is counted from the start, idle tasks are never queued
+	std::atomic<size_t> m_taskCount{1};
+	std::atomic<size_t> m_runQueueSize{InitialRunQueueSize};
+	kmutex m_runQueueGrowMutex;
+	TimerWheel* m_timerWheels;
 	AbstractTimer* m_timer = AbstractTimer::system();
+	const TimePoint m_timerWheelTick;
 	const TimePoint m_forcedTaskSwitchTimeInterval;
+	const TimePoint m_balanceTimeInterval;
 	kvector<IdleInfo> m_idleInfo;
 	std::atomic<uint64_t> m_contextSwitchCount;
 
@@ -46,8 +46,13 @@ ThreadPool& ThreadPool::system()
 
 ThreadPoolPrivate::ThreadPoolPrivate(size_t numThreads)
 {
+	// workers are spread over the CPUs and stay where they start
+	const unsigned int numCpu = cpuLogicalCount();
 	for (size_t idx = 0; idx < numThreads; ++idx)
+	{
 		m_threads.emplace_back(std::bind(&ThreadPoolPrivate::threadProc, this));
+		m_threads.back().setAffinity(kcpu_set::single(static_cast<unsigned int>(idx % numCpu)));
+	}
 }
 
 ThreadPoolPrivate::~ThreadPoolPrivate()
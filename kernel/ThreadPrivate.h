@@ -40,6 +40,8 @@ private:
 	ThreadPrivate& operator=(const ThreadPrivate&) = delete;
 	void init(size_t systemStackSize);
 	void initStack(bool user);
+	void* allocStack(size_t size);
+	void freeStack(void* stack, size_t size);
 
 	static void entryProc(ThreadPrivate* objPriv);
 
@@ -49,6 +51,7 @@ private:
 	kthread* m_obj;
 	Process& m_process;
 	void* m_userStack = nullptr;
+	size_t m_stackSize = 0;
 	EventObject m_terminateEvent{false, true};
 	const std::function<void()> m_entry;
 
@@ -0,0 +1,199 @@
+/*
+   TimerWheel.cpp
+   Per CPU timer wheel
+   SHM DOS64
+   Copyright (c) 2023, Ilya Shamukov, ilya.shamukov@gmail.com
+   
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option) 
+   any later version.
+   
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for 
+   more details.
+   
+   You should have received a copy of the GNU General Public License along with 
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple 
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <cpu.h>
+#include <kalgorithm.h>
+#include "TimerWheel.h"
+
+void TimerWheel::init(unsigned int id, TimePoint tickPeriod, TimePoint timepoint)
+{
+	m_id = id;
+	m_tickPeriod = tickPeriod;
+	m_currentTick = timepoint / tickPeriod;
+}
+
+// on the CPU of the wheel, the entry must not be pending
+void TimerWheel::add(TimerEntry* entry, TimePoint deadline)
+{
+	CpuInterruptLockSave intLock;
+	klock_guard lock(m_spin);
+	entry->m_expires = deadline / m_tickPeriod + (((deadline % m_tickPeriod) != 0) ? 1 : 0);
+	insert(entry);
+	entry->m_wheel.store(m_id, std::memory_order_release);
+	updateNextEventTime();
+}
+
+bool TimerWheel::remove(TimerEntry* entry)
+{
+	CpuInterruptLockSave intLock;
+	klock_guard lock(m_spin);
+	if (entry->m_wheel.load(std::memory_order_relaxed) != m_id)
+		return false;
+
+	unlink(entry);
+	entry->m_wheel.store(TimerEntry::NoWheel, std::memory_order_release);
+	updateNextEventTime();
+	return true;
+}
+
+void TimerWheel::expire(TimePoint timepoint)
+{
+	const uint64_t nowTick = timepoint / m_tickPeriod;
+	for (;;)
+	{
+		void (*handler)(void*) = nullptr;
+		void* context = nullptr;
+		{
+			CpuInterruptLockSave intLock;
+			klock_guard lock(m_spin);
+			TimerEntry* entry = popExpired(nowTick);
+			if (entry == nullptr)
+			{
+				m_running.store(nullptr, std::memory_order_release);
+				updateNextEventTime();
+				return;
+			}
+
+			// marked running before it stops being pending, a synchronous cancel sees one or the other
+			handler = entry->m_handler;
+			context = entry->m_context;
+			m_running.store(entry, std::memory_order_release);
+			entry->m_wheel.store(TimerEntry::NoWheel, std::memory_order_release);
+		}
+		handler(context);
+	}
+}
+
+// m_spin locked
+void TimerWheel::insert(TimerEntry* entry)
+{
+	// late entries go to the next tick processed, the level is the lowest one
+	// the entry fits in less than a full turn of, beyond the top level it waits at the far end
+	const uint64_t expires = kmax(entry->m_expires, m_currentTick);
+	unsigned int level = 0;
+	while ((level < Levels - 1) && ((expires >> (LevelBits * level)) - (m_currentTick >> (LevelBits * level)) >= LevelSlots))
+		++level;
+
+	uint64_t granule = expires >> (LevelBits * level);
+	granule = kmin(granule, (m_currentTick >> (LevelBits * level)) + LevelSlots - 1);
+	const unsigned int slot = granule & SlotMask;
+	TimerLink& head = m_slots[level][slot];
+	entry->m_level = level;
+	entry->m_slot = slot;
+	entry->m_next = &head;
+	entry->m_prev = head.m_prev;
+	head.m_prev->m_next = entry;
+	head.m_prev = entry;
+	m_occupied[level] |= (1ULL << slot);
+}
+
+// m_spin locked
+void TimerWheel::unlink(TimerEntry* entry)
+{
+	entry->m_prev->m_next = entry->m_next;
+	entry->m_next->m_prev = entry->m_prev;
+	TimerLink& head = m_slots[entry->m_level][entry->m_slot];
+	if (head.m_next == &head)
+		m_occupied[entry->m_level] &= ~(1ULL << entry->m_slot);
+	entry->m_next = entry;
+	entry->m_prev = entry;
+}
+
+// m_spin locked
+void TimerWheel::cascade(unsigned int level, unsigned int slot)
+{
+	TimerLink& head = m_slots[level][slot];
+	TimerLink* link = head.m_next;
+	head.m_next = &head;
+	head.m_prev = &head;
+	m_occupied[level] &= ~(1ULL << slot);
+	while (link != &head)
+	{
+		TimerLink* next = link->m_next;
+		insert(static_cast<TimerEntry*>(link));
+		link = next;
+	}
+}
+
+// m_spin locked
+uint64_t TimerWheel::nextEventTick() const
+{
+	uint64_t result = ~0ULL;
+	for (unsigned int level = 0; level < Levels; ++level)
+	{
+		const uint64_t occupied = m_occupied[level];
+		if (occupied == 0)
+			continue;
+
+		// slots follow each other in time starting from the one of the current tick
+		const uint64_t granule = m_currentTick >> (LevelBits * level);
+		const unsigned int shift = granule & SlotMask;
+		const uint64_t rotated = (shift == 0) ? occupied : ((occupied >> shift) | (occupied << (LevelSlots - shift)));
+		const uint64_t tick = (granule + __builtin_ctzll(rotated)) << (LevelBits * level);
+		result = kmin(result, kmax(tick, m_currentTick));
+	}
+	return result;
+}
+
+// m_spin locked
+void TimerWheel::updateNextEventTime()
+{
+	const uint64_t tick = nextEventTick();
+	const TimePoint timepoint = (tick > kevent::WaitInfinite / m_tickPeriod) ? kevent::WaitInfinite : (tick * m_tickPeriod);
+	m_nextEventTime.store(timepoint, std::memory_order_release);
+}
+
+// m_spin locked, returns a still linked entry due by the tick or nullptr
+TimerEntry* TimerWheel::popExpired(uint64_t nowTick)
+{
+	for (;;)
+	{
+		// the slot drained also holds entries of a turn later added meanwhile, they are behind the due ones
+		if (m_draining)
+		{
+			TimerLink& head = m_slots[0][m_drainTick & SlotMask];
+			TimerEntry* entry = static_cast<TimerEntry*>(head.m_next);
+			if ((&head != head.m_next) && (entry->m_expires <= m_drainTick))
+			{
+				unlink(entry);
+				return entry;
+			}
+			m_draining = false;
+		}
+
+		const uint64_t nextTick = nextEventTick();
+		if (nextTick > nowTick)
+		{
+			m_currentTick = kmax(m_currentTick, nowTick + 1);
+			return nullptr;
+		}
+
+		m_currentTick = nextTick;
+		for (unsigned int level = Levels - 1; level > 0; --level)
+		{
+			const unsigned int slot = (m_currentTick >> (LevelBits * level)) & SlotMask;
+			if ((m_occupied[level] & (1ULL << slot)) != 0)
+				cascade(level, slot);
+		}
+		m_drainTick = m_currentTick++;
+		m_draining = true;
+	}
+}
@@ -0,0 +1,98 @@
+/*
+   TimerWheel.h
+   Kernel header
+   SHM DOS64
+   Copyright (c) 2023, Ilya Shamukov <ilya.shamukov@gmail.com>
+   
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option) 
+   any later version.
+   
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for 
+   more details.
+   
+   You should have received a copy of the GNU General Public License along with 
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple 
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#pragma once
+#include <atomic>
+#include <common_types.h>
+#include <kevent.h>
+#include "SpinLock.h"
+
+struct TimerLink
+{
+	TimerLink* m_next = this;
+	TimerLink* m_prev = this;
+};
+
+// a pending callback, linked into the wheel of the CPU which started it
+struct TimerEntry : TimerLink
+{
+	static constexpr unsigned int NoWheel = ~0u;
+
+	void (*m_handler)(void* context) = nullptr;
+	void* m_context = nullptr;
+	uint64_t m_expires = 0;
+	uint8_t m_level = 0;
+	uint8_t m_slot = 0;
+	std::atomic<unsigned int> m_wheel{NoWheel};
+};
+
+// hierarchical timer wheel of a CPU: each level has 64 slots of 64 times the granularity of the level below,
+// entries move down a level whenever the current tick enters their slot
+class alignas(CPU_CACHE_LINE_SIZE) TimerWheel
+{
+public:
+	void init(unsigned int id, TimePoint tickPeriod, TimePoint timepoint);
+	void add(TimerEntry* entry, TimePoint deadline);
+	bool remove(TimerEntry* entry);
+	// runs the handlers of all entries expired by the timepoint, each without the wheel locked
+	void expire(TimePoint timepoint);
+	TimePoint nextEventTime() const
+	{
+		return m_nextEventTime.load(std::memory_order_acquire);
+	}
+	bool running(const TimerEntry* entry) const
+	{
+		return (m_running.load(std::memory_order_acquire) == entry);
+	}
+
+private:
+	enum : unsigned int
+	{
+		LevelBits = 6,
+		LevelSlots = (1 << LevelBits),
+		SlotMask = LevelSlots - 1,
+		Levels = 5
+	};
+
+	static constexpr uint64_t levelTicks(unsigned int level)
+	{
+		return (1ULL << (LevelBits * level));
+	}
+
+	void insert(TimerEntry* entry);
+	void unlink(TimerEntry* entry);
+	void cascade(unsigned int level, unsigned int slot);
+	uint64_t nextEventTick() const;
+	void updateNextEventTime();
+	TimerEntry* popExpired(uint64_t nowTick);
+
+private:
+	TimerLink m_slots[Levels][LevelSlots];
+	uint64_t m_occupied[Levels] = {};
+	uint64_t m_currentTick = 0;
+	uint64_t m_drainTick = 0;
+	bool m_draining = false;
+	TimePoint m_tickPeriod = 1;
+	unsigned int m_id = 0;
+	std::atomic<TimePoint> m_nextEventTime{kevent::WaitInfinite};
+	std::atomic<const TimerEntry*> m_running{nullptr};
+	QueuedSpinLockSm m_spin;
+};
@@ -34,12 +34,24 @@ enum : uintptr_t
 	VMM_REG_PTR_MASK = (~3ULL),
 	VMM_REG_ALLOC_FLAG = 1,
 	VMM_REG_BUSY_FLAG = 2,
-	VMM_REG_ALL_FLAGS = (VMM_REG_ALLOC_FLAG | VMM_REG_BUSY_FLAG)
+	VMM_REG_COMMIT_FLAG = 4,
+	VMM_REG_ALL_FLAGS = (VMM_REG_ALLOC_FLAG | VMM_REG_BUSY_FLAG | VMM_REG_COMMIT_FLAG)
 };
 
 static const size_t g_maxAllocIterations = 32;
 static const uintptr_t g_invalidPageOffset = std::numeric_limits<uintptr_t>::max();
 
+static unsigned int largePageOrder(uintptr_t addr, size_t numPages)
+{
+	if (cpuSupport1GbPages() && (numPages >= (size_t(1) << RamAllocator::PageOrder1G)) && ((addr & ((PAGE_SIZE << RamAllocator::PageOrder1G) - 1)) == 0))
+		return RamAllocator::PageOrder1G;
+
+	if ((numPages >= (size_t(1) << RamAllocator::PageOrder2M)) && ((addr & ((PAGE_SIZE << RamAllocator::PageOrder2M) - 1)) == 0))
+		return RamAllocator::PageOrder2M;
+
+	return 0;
+}
+
 VirtualMemoryManager::VirtualMemoryManager()
 {
 	static VirtualMemoryManagerPrivate vmmp;
@@ -59,12 +71,22 @@ VirtualMemoryManager& VirtualMemoryManager::system()
 
 void* VirtualMemoryManager::alloc(size_t size, uintptr_t flags)
 {
-	return m_private->alloc(size, flags);
+	return m_private->alloc(size, flags, MemoryAccount::ofCode(__builtin_return_address(0)));
+}
+
+void* VirtualMemoryManager::alloc(size_t size, uintptr_t flags, MemoryAccount& account)
+{
+	return m_private->alloc(size, flags, account);
 }
 
 bool VirtualMemoryManager::free(void* pointer)
 {
-	return m_private->free(pointer);
+	return m_private->free(pointer, MemoryAccount::ofCode(__builtin_return_address(0)));
+}
+
+bool VirtualMemoryManager::free(void* pointer, MemoryAccount& account)
+{
+	return m_private->free(pointer, account);
 }
 
 void VirtualMemoryManager::freeRamPages(void* base, size_t size, bool realloc)
@@ -72,6 +94,11 @@ void VirtualMemoryManager::freeRamPages(void* base, size_t size, bool realloc)
 	return m_private->freeRamPages(base, size, realloc);
 }
 
+size_t VirtualMemoryManager::freeRamPages(const VirtualMemoryRange* ranges, size_t count, bool realloc)
+{
+	return m_private->freeRamPages(ranges, count, realloc);
+}
+
 void* VirtualMemoryManager::mapMmio(uintptr_t mmioBase, size_t size, MemoryType memoryType)
 {
 	return m_private->mapMmio(mmioBase, size, memoryType);
@@ -103,51 +130,93 @@ VirtualMemoryManagerPrivate::VirtualMemoryManagerPrivate()
 		PANIC(L"Incorrect kernel virtual memory settings");
 
 	const size_t needPages = (needAllMemory - alreadyUsedInit) / PAGE_SIZE;
-	const size_t regionsSize = cpuAlignAddrHi<size_t>((needPages + 1) * sizeof(uintptr_t));
-	m_paging.setPagesFlags(freeStart, regionsSize, PAGE_MASK, PAGE_FLAG_ALLOCATED | PAGE_FLAG_WRITE | PAGE_FLAG_MEMZERO);
-	m_memoryRegions = reinterpret_cast<uintptr_t*>(freeStart);
-	freeStart += regionsSize;
-	const size_t freeListSize = cpuAlignAddrHi<size_t>(needPages * sizeof(VmmFreeMemoryListItem));
-	m_paging.setPagesFlags(freeStart, freeListSize, PAGE_MASK, PAGE_FLAG_ALLOCATED | PAGE_FLAG_WRITE | PAGE_FLAG_MEMZERO);
-	m_freeListItemsStart = reinterpret_cast<VmmFreeMemoryListItem*>(freeStart);
 	m_freeListTableSize = cpuLastOneBitIndex(needPages) + 1;
-	kmemset(m_freeListTable, 0, sizeof(m_freeListTable));
-	kmemset(m_freeListTableCounters, 0, sizeof(m_freeListTableCounters));
-	freeStart += freeListSize;
-	m_virtualPages = needPages - ((regionsSize + freeListSize) / PAGE_SIZE);
+	const size_t chunkOwnersSize = cpuAlignAddrHi<size_t>(needPages / ArenaChunkPages + 1);
+	m_paging.setPagesFlags(freeStart, chunkOwnersSize, PAGE_MASK, PAGE_FLAG_ALLOCATED | PAGE_FLAG_WRITE | PAGE_FLAG_MEMZERO);
+	m_chunkOwners = reinterpret_cast<uint8_t*>(freeStart);
+	freeStart += chunkOwnersSize;
+	m_virtualPages = needPages - (chunkOwnersSize / PAGE_SIZE);
 	m_virtualBase = freeStart;
-	addFreeRegion(0, m_virtualPages);
+	m_globalArena.m_id = GlobalArenaId;
+	addFreeRegion(m_globalArena, 0, m_virtualPages);
 }
 
-void VirtualMemoryManagerPrivate::addFreeRegion(uintptr_t pageBase, size_t numPages)
+VmmFreeMemoryListItem* VirtualMemoryManagerPrivate::allocListItem(VmmArena& arena)
 {
-	VmmFreeMemoryListItem* item;
-	if (m_freeListItems == nullptr)
-		item = m_freeListItemsStart++;
-	else
+	VmmFreeMemoryListItem* item = arena.m_freeListItems;
+	if (item == nullptr)
 	{
-		item = m_freeListItems;
-		m_freeListItems = item->m_next;
+		// items are carved from whole pages and then recycled inside the arena
+		item = static_cast<VmmFreeMemoryListItem*>(RamAllocator::getInstance().allocPagePtr(false));
+		const size_t count = PAGE_SIZE / sizeof (*item);
+		for (size_t idx = 1; idx < count; ++idx)
+			item[idx].m_next = (idx + 1 < count) ? &item[idx + 1] : nullptr;
+		arena.m_freeListItems = &item[1];
+		return item;
 	}
+
+	arena.m_freeListItems = item->m_next;
+	return item;
+}
+
+void VmmRegionTree::set(uintptr_t page, uintptr_t tag)
+{
+	static_assert((KERNEL_MAX_VIRTUAL_MEMORY / PAGE_SIZE) <= (size_t(1) << (3 * FanoutShift)));
+	static_assert((sizeof (Node) == PAGE_SIZE) && (sizeof (Leaf) == PAGE_SIZE));
+	Leaf* leaf = const_cast<Leaf*>(findLeaf(page));
+	if (leaf == nullptr)
+	{
+		if (tag == 0)
+			return;
+
+		// nodes are shared by all arenas, a lost race frees the new page
+		RamAllocator& allocator = RamAllocator::getInstance();
+		std::atomic<Node*>& nodeRef = m_root[page >> (2 * FanoutShift)];
+		Node* node = nodeRef.load(std::memory_order_acquire);
+		if (node == nullptr)
+		{
+			Node* newNode = static_cast<Node*>(allocator.allocPagePtr(true));
+			if (nodeRef.compare_exchange_strong(node, newNode, std::memory_order_acq_rel, std::memory_order_acquire))
+				node = newNode;
+			else
+				allocator.freePagePtr(newNode);
+		}
+		std::atomic<Leaf*>& leafRef = node->m_leaves[(page >> FanoutShift) & (Fanout - 1)];
+		leaf = leafRef.load(std::memory_order_acquire);
+		if (leaf == nullptr)
+		{
+			Leaf* newLeaf = static_cast<Leaf*>(allocator.allocPagePtr(true));
+			if (leafRef.compare_exchange_strong(leaf, newLeaf, std::memory_order_acq_rel, std::memory_order_acquire))
+				leaf = newLeaf;
+			else
+				allocator.freePagePtr(newLeaf);
+		}
+	}
+	leaf->m_tags[page & (Fanout - 1)] = tag;
+}
+
+void VirtualMemoryManagerPrivate::addFreeRegion(VmmArena& arena, uintptr_t pageBase, size_t numPages)
+{
+	VmmFreeMemoryListItem* item = allocListItem(arena);
 	const size_t tblIndex = cpuLastOneBitIndex(numPages);
 	item->m_numPages = numPages;
 	item->m_pageBase = pageBase;
 	item->m_prev = nullptr;
-	VmmFreeMemoryListItem* flt = m_freeListTable[tblIndex];
+	VmmFreeMemoryListItem* flt = arena.m_freeListTable[tblIndex];
 	item->m_next = flt;
 	if (flt != nullptr)
 		flt->m_prev = item;
-	m_freeListTable[tblIndex] = item;
-	m_freeListTableCounters[tblIndex]++;
-	m_memoryRegions[pageBase] = reinterpret_cast<uintptr_t>(item);
+	arena.m_freeListTable[tblIndex] = item;
+	arena.m_freeListTableCounters[tblIndex]++;
+	m_regions.set(pageBase, reinterpret_cast<uintptr_t>(item));
 	if (numPages > 1)
-		m_memoryRegions[pageBase + numPages - 1] = reinterpret_cast<uintptr_t>(item);
+		m_regions.set(pageBase + numPages - 1, reinterpret_cast<uintptr_t>(item));
 }
 
-void VirtualMemoryManagerPrivate::deleteFreeRegion(size_t tableIndex, VmmFreeMemoryListItem* region)
+void VirtualMemoryManagerPrivate::deleteFreeRegion(VmmArena& arena, size_t tableIndex, VmmFreeMemoryListItem* region)
 {
-	if (region == m_freeListTable[tableIndex])
-		m_freeListTable[tableIndex] = region->m_next;
+	if (region == arena.m_freeListTable[tableIndex])
+		arena.m_freeListTable[tableIndex] = region->m_next;
 	else
 	{
 		VmmFreeMemoryListItem* rNext = region->m_next;
@@ -155,29 +224,29 @@ void VirtualMemoryManagerPrivate::deleteFreeRegion(size_t tableIndex, VmmFreeMem
 		if (rNext != nullptr)
 			rNext->m_prev = region->m_prev;
 	}
-	region->m_next = m_freeListItems;
-	m_freeListItems = region;
-	m_freeListTableCounters[tableIndex]--;
+	region->m_next = arena.m_freeListItems;
+	arena.m_freeListItems = region;
+	arena.m_freeListTableCounters[tableIndex]--;
 }
 
-void VirtualMemoryManagerPrivate::setBusyRegion(unsigned tableIndex, VmmFreeMemoryListItem* region, size_t numPages)
+void VirtualMemoryManagerPrivate::setBusyRegion(VmmArena& arena, unsigned tableIndex, VmmFreeMemoryListItem* region, size_t numPages)
 {
 	const uintptr_t pagesBase = region->m_pageBase;
-	deleteFreeRegion(tableIndex, region);
-	m_memoryRegions[pagesBase] = (numPages << VMM_REG_SIZE_SHIFT) | VMM_REG_BUSY_FLAG;
+	deleteFreeRegion(arena, tableIndex, region);
+	m_regions.set(pagesBase, (numPages << VMM_REG_SIZE_SHIFT) | VMM_REG_BUSY_FLAG);
 	if (numPages > 1)
-		m_memoryRegions[pagesBase + numPages - 1] = VMM_REG_BUSY_FLAG;
+		m_regions.set(pagesBase + numPages - 1, VMM_REG_BUSY_FLAG);
 }
 
-uintptr_t VirtualMemoryManagerPrivate::allocPages(size_t numPages)
+uintptr_t VirtualMemoryManagerPrivate::allocPages(VmmArena& arena, size_t numPages)
 {
 	const size_t tblIndex = cpuLastOneBitIndex(numPages);
-	const size_t maxIterateNodes = kmin(m_freeListTableCounters[tblIndex], g_maxAllocIterations);
+	const size_t maxIterateNodes = kmin(arena.m_freeListTableCounters[tblIndex], g_maxAllocIterations);
 	VmmFreeMemoryListItem* curListItem = nullptr;
 	if (maxIterateNodes > 0)
 	{
 		VmmFreeMemoryListItem* minItem = nullptr;
-		curListItem = m_freeListTable[tblIndex];
+		curListItem = arena.m_freeListTable[tblIndex];
 		size_t minDelta = std::numeric_limits<size_t>::max();
 		for (size_t idx = 0; idx < maxIterateNodes; idx++)
 		{
@@ -187,7 +256,7 @@ uintptr_t VirtualMemoryManagerPrivate::allocPages(size_t numPages)
 				if (delta == 0)
 				{
 					const uintptr_t retPb = curListItem->m_pageBase;
-					setBusyRegion(tblIndex, curListItem, numPages);
+					setBusyRegion(arena, tblIndex, curListItem, numPages);
 					return retPb;
 				}
 				else if (delta < minDelta)
@@ -201,19 +270,20 @@ uintptr_t VirtualMemoryManagerPrivate::allocPages(size_t numPages)
 		if (minItem != nullptr)
 		{
 			const uintptr_t retPb = minItem->m_pageBase;
-			setBusyRegion(tblIndex, minItem, numPages);
-			addFreeRegion(minItem->m_pageBase + numPages, minDelta);
+			setBusyRegion(arena, tblIndex, minItem, numPages);
+			addFreeRegion(arena, retPb + numPages, minDelta);
 			return retPb;
 		}
 	}
 	for (size_t idx = tblIndex + 1; idx < m_freeListTableSize; idx++)
 	{
-		if (m_freeListTableCounters[idx] > 0)
+		if (arena.m_freeListTableCounters[idx] > 0)
 		{
-			VmmFreeMemoryListItem* item = m_freeListTable[idx];
+			VmmFreeMemoryListItem* item = arena.m_freeListTable[idx];
 			const uintptr_t retPb = item->m_pageBase;
-			setBusyRegion(idx, item, numPages);
-			addFreeRegion(item->m_pageBase + numPages, item->m_numPages - numPages);
+			const size_t itemNumPages = item->m_numPages;
+			setBusyRegion(arena, idx, item, numPages);
+			addFreeRegion(arena, retPb + numPages, itemNumPages - numPages);
 			return retPb;
 		}
 	}
@@ -222,7 +292,7 @@ uintptr_t VirtualMemoryManagerPrivate::allocPages(size_t numPages)
 		if (curListItem->m_numPages >= numPages)
 		{
 			const uintptr_t retPb = curListItem->m_pageBase;
-			setBusyRegion(tblIndex, curListItem, numPages);
+			setBusyRegion(arena, tblIndex, curListItem, numPages);
 			return retPb;
 		}
 		curListItem = curListItem->m_next;
@@ -231,9 +301,45 @@ uintptr_t VirtualMemoryManagerPrivate::allocPages(size_t numPages)
 	return g_invalidPageOffset;
 }
 
-uintptr_t VirtualMemoryManagerPrivate::freePages(uintptr_t pageBase)
+void VirtualMemoryManagerPrivate::setBusyPages(uintptr_t pageBase, size_t numPages)
+{
+	m_regions.set(pageBase, (numPages << VMM_REG_SIZE_SHIFT) | VMM_REG_BUSY_FLAG);
+	if (numPages > 1)
+		m_regions.set(pageBase + numPages - 1, VMM_REG_BUSY_FLAG);
+}
+
+uintptr_t VirtualMemoryManagerPrivate::allocAlignedPages(VmmArena& arena, size_t numPages, size_t alignPages, uintptr_t alignOffset)
+{
+	if (alignPages > 1)
+	{
+		// over-allocate and return the unaligned head and tail back to the free lists
+		const size_t allocNumPages = numPages + alignPages - 1;
+		const uintptr_t base = allocPages(arena, allocNumPages);
+		if (base != g_invalidPageOffset)
+		{
+			const uintptr_t firstPage = (m_virtualBase / PAGE_SIZE) + base;
+			const size_t headPages = (alignOffset - firstPage) & (alignPages - 1);
+			const size_t tailPages = allocNumPages - headPages - numPages;
+			setBusyPages(base + headPages, numPages);
+			if (headPages > 0)
+			{
+				setBusyPages(base, headPages);
+				freePages(arena, base);
+			}
+			if (tailPages > 0)
+			{
+				setBusyPages(base + headPages + numPages, tailPages);
+				freePages(arena, base + headPages + numPages);
+			}
+			return (base + headPages);
+		}
+	}
+	return allocPages(arena, numPages);
+}
+
+uintptr_t VirtualMemoryManagerPrivate::freePages(VmmArena& arena, uintptr_t pageBase)
 {
-	size_t numPages = m_memoryRegions[pageBase];
+	size_t numPages = m_regions.get(pageBase);
 	if ((numPages & VMM_REG_BUSY_FLAG) == 0)
 		return 0;
 
@@ -241,11 +347,12 @@ uintptr_t VirtualMemoryManagerPrivate::freePages(uintptr_t pageBase)
 	if (numPages == 0)
 		return 0;
 
+	// free regions are merged only inside the same arena
 	uintptr_t regBase = pageBase;
 	uintptr_t regSize = numPages;
-	if (pageBase > 0)
+	if ((pageBase > 0) && (chunkOwner(pageBase - 1) == arena.m_id))
 	{
-		uintptr_t listPtr = m_memoryRegions[pageBase - 1];
+		uintptr_t listPtr = m_regions.get(pageBase - 1);
 		if ((listPtr & VMM_REG_BUSY_FLAG) == 0)
 		{
 			listPtr &= VMM_REG_PTR_MASK;
@@ -256,40 +363,121 @@ uintptr_t VirtualMemoryManagerPrivate::freePages(uintptr_t pageBase)
 				regBase = item->m_pageBase;
 				regSize += itemNumPages;
 				const size_t tableIdx = cpuLastOneBitIndex(itemNumPages);
-				deleteFreeRegion(tableIdx, item);
-				m_memoryRegions[pageBase] = 0;
+				deleteFreeRegion(arena, tableIdx, item);
+				m_regions.set(pageBase, 0);
 				if (itemNumPages > 1)
-					m_memoryRegions[pageBase - 1] = 0;
+					m_regions.set(pageBase - 1, 0);
 			}
 		}
 	}
-	uintptr_t listPtr = m_memoryRegions[pageBase + numPages];
-	if ((listPtr & VMM_REG_BUSY_FLAG) == 0)
+	if (((pageBase + numPages) < m_virtualPages) && (chunkOwner(pageBase + numPages) == arena.m_id))
 	{
-		listPtr &= VMM_REG_PTR_MASK;
-		if (listPtr != 0)
+		uintptr_t listPtr = m_regions.get(pageBase + numPages);
+		if ((listPtr & VMM_REG_BUSY_FLAG) == 0)
 		{
-			VmmFreeMemoryListItem* item = reinterpret_cast<VmmFreeMemoryListItem*>(listPtr);
-			const size_t itemNumPages = item->m_numPages;
-			regSize += itemNumPages;
-			deleteFreeRegion(cpuLastOneBitIndex(itemNumPages), item);
-			m_memoryRegions[item->m_pageBase - 1] = 0;
-			m_memoryRegions[item->m_pageBase] = 0;
+			listPtr &= VMM_REG_PTR_MASK;
+			if (listPtr != 0)
+			{
+				VmmFreeMemoryListItem* item = reinterpret_cast<VmmFreeMemoryListItem*>(listPtr);
+				const size_t itemNumPages = item->m_numPages;
+				regSize += itemNumPages;
+				deleteFreeRegion(arena, cpuLastOneBitIndex(itemNumPages), item);
+				m_regions.set(item->m_pageBase - 1, 0);
+				m_regions.set(item->m_pageBase, 0);
+			}
 		}
 	}
-	addFreeRegion(regBase, regSize);
+	addFreeRegion(arena, regBase, regSize);
 	return numPages;
 }
 
-void* VirtualMemoryManagerPrivate::alloc(size_t size, uintptr_t flags)
+VmmArena* VirtualMemoryManagerPrivate::localArena()
+{
+	const unsigned int cpuId = cpuCurrentId();
+	VmmArena* arena = m_cpuArenas[cpuId].load(std::memory_order_acquire);
+	if (arena != nullptr)
+		return arena;
+
+	static_assert(sizeof (VmmArena) <= PAGE_SIZE);
+	RamAllocator& allocator = RamAllocator::getInstance();
+	void* page = allocator.allocPagePtr(false);
+	if (page == nullptr)
+		return nullptr;
+
+	VmmArena* newArena = new (page) VmmArena();
+	newArena->m_id = static_cast<uint8_t>(cpuId + 1);
+	if (!m_cpuArenas[cpuId].compare_exchange_strong(arena, newArena, std::memory_order_acq_rel, std::memory_order_acquire))
+	{
+		newArena->~VmmArena();
+		allocator.freePagePtr(page);
+		return arena;
+	}
+	return newArena;
+}
+
+VmmArena& VirtualMemoryManagerPrivate::ownerArena(uintptr_t pageBase)
+{
+	const uint8_t owner = chunkOwner(pageBase);
+	if (owner == GlobalArenaId)
+		return m_globalArena;
+
+	return *m_cpuArenas[owner - 1].load(std::memory_order_acquire);
+}
+
+uintptr_t VirtualMemoryManagerPrivate::allocGlobalPages(size_t numPages, size_t alignPages, uintptr_t alignOffset, uintptr_t regionFlags)
+{
+	klock_guard lock(m_globalArena.m_mutex);
+	const uintptr_t base = allocAlignedPages(m_globalArena, numPages, alignPages, alignOffset);
+	if (base != g_invalidPageOffset)
+		m_regions.set(base, m_regions.get(base) | regionFlags);
+	return base;
+}
+
+uintptr_t VirtualMemoryManagerPrivate::allocLocalPages(size_t numPages, uintptr_t regionFlags)
+{
+	VmmArena* arena = localArena();
+	if (arena == nullptr)
+		return g_invalidPageOffset;
+
+	klock_guard lock(arena->m_mutex);
+	uintptr_t base = allocPages(*arena, numPages);
+	if (base == g_invalidPageOffset)
+	{
+		// take the next chunk of address space from the global arena
+		uintptr_t chunkBase;
+		{
+			klock_guard globalLock(m_globalArena.m_mutex);
+			chunkBase = allocAlignedPages(m_globalArena, ArenaChunkPages, ArenaChunkPages, m_virtualBase / PAGE_SIZE);
+			if (chunkBase != g_invalidPageOffset)
+				m_chunkOwners[chunkBase / ArenaChunkPages] = arena->m_id;
+		}
+		if (chunkBase == g_invalidPageOffset)
+			return g_invalidPageOffset;
+
+		addFreeRegion(*arena, chunkBase, ArenaChunkPages);
+		base = allocPages(*arena, numPages);
+	}
+	if (base != g_invalidPageOffset)
+		m_regions.set(base, m_regions.get(base) | regionFlags);
+	return base;
+}
+
+void* VirtualMemoryManagerPrivate::alloc(size_t size, uintptr_t flags, MemoryAccount& account)
 {
 	uintptr_t pflags = m_pageDefaultFlag;
 	size_t numPages = (size + PAGE_MASK) / PAGE_SIZE;
 	if (numPages == 0)
 		return nullptr;
 
-	klock_guard lock(m_mutex);
-	const uintptr_t base = allocPages(numPages);
+	uintptr_t regionFlags = (flags & (VMM_COMMIT | VMM_READWRITE | VMM_READONLY)) ? VMM_REG_ALLOC_FLAG : 0;
+	if (flags & VMM_COMMIT)
+		regionFlags |= VMM_REG_COMMIT_FLAG;
+	uintptr_t base = g_invalidPageOffset;
+	// small allocations come from the CPU arena, large and aligned from the global one
+	if (numPages <= ArenaMaxAllocPages)
+		base = allocLocalPages(numPages, regionFlags);
+	if (base == g_invalidPageOffset)
+		base = allocGlobalPages(numPages, (flags & VMM_COMMIT) ? (size_t(1) << largePageOrder(0, numPages)) : 1, 0, regionFlags);
 	if (base == g_invalidPageOffset)
 		return nullptr;
 
@@ -305,37 +493,59 @@ void* VirtualMemoryManagerPrivate::alloc(size_t size, uintptr_t flags)
 			pflags |= PAGE_FLAG_PRESENT;
 
 		uintptr_t curPageBase = vBase;
+		const uintptr_t vEnd = vBase + numPages * PAGE_SIZE;
 		RamAllocator& allocator = RamAllocator::getInstance();
-		while (numPages-- > 0)
+		const unsigned int numaNode = static_cast<unsigned int>((flags & VMM_NUMA_NODE_MASK) >> VMM_NUMA_NODE_SHIFT);
+		const unsigned int node = (numaNode != 0) ? (numaNode - 1) : RamAllocator::currentNode();
+		TlbBatch tlbBatch(m_paging);
+		while (curPageBase < vEnd)
 		{
-			const uintptr_t physBase = allocator.allocPage(false);
-			if (physBase == g_invalidPageOffset)
+			unsigned int order = largePageOrder(curPageBase, (vEnd - curPageBase) / PAGE_SIZE);
+			uintptr_t physBase = 0;
+			for (; order > 0; order = (order == RamAllocator::PageOrder1G) ? RamAllocator::PageOrder2M : 0)
+			{
+				physBase = allocator.allocPagesOnNode(node, order, false);
+				if (physBase != 0)
+					break;
+			}
+			if (order > 0)
 			{
-				m_paging.freeRamPages(vBase, curPageBase - vBase, false);
-				freePages(base);
+				m_paging.mapPages(curPageBase, physBase, PAGE_SIZE << order, pflags, &tlbBatch);
+				curPageBase += PAGE_SIZE << order;
+				continue;
+			}
+
+			physBase = (numaNode != 0) ? allocator.allocPageOnNode(node, false) : allocator.tryAllocPage(false);
+			if ((physBase == 0) || (physBase == g_invalidPageOffset))
+			{
+				m_paging.freeRamPages(vBase, curPageBase - vBase, false, &tlbBatch);
+				tlbBatch.flush();
+				VmmArena& arena = ownerArena(base);
+				klock_guard lock(arena.m_mutex);
+				freePages(arena, base);
 				return nullptr;
 			}
 
-			m_paging.mapPage(curPageBase, physBase, pflags);
+			m_paging.mapPage(curPageBase, physBase, pflags, &tlbBatch);
 			curPageBase += PAGE_SIZE;
 		}
-		m_memoryRegions[base] |= VMM_REG_ALLOC_FLAG;
 	}
-	else
+	else if (flags & (VMM_READWRITE | VMM_READONLY))
 	{
 		if (flags & VMM_READWRITE)
 			pflags |= PAGE_FLAG_ALLOCATED | PAGE_FLAG_WRITE;
-		else if (flags & VMM_READONLY)
-			pflags |= PAGE_FLAG_ALLOCATED;
 		else
-			return pointer;
+			pflags |= PAGE_FLAG_ALLOCATED;
 		m_paging.setPagesFlags(vBase, size, PAGE_MASK, pflags);
-		m_memoryRegions[base] |= VMM_REG_ALLOC_FLAG;
 	}
+	// lazily committed pages are not charged, they show up in the RAM allocator only
+	account.chargeVirtual(static_cast<ptrdiff_t>(numPages * PAGE_SIZE));
+	if (flags & VMM_COMMIT)
+		account.chargePhysicalPages(static_cast<ptrdiff_t>(numPages));
 	return pointer;
 }
 
-bool VirtualMemoryManagerPrivate::free(void* pointer)
+bool VirtualMemoryManagerPrivate::free(void* pointer, MemoryAccount& account)
 {
 	uintptr_t base = reinterpret_cast<uintptr_t>(pointer);
 	if (base < m_virtualBase)
@@ -345,15 +555,23 @@ bool VirtualMemoryManagerPrivate::free(void* pointer)
 	if (base >= m_virtualPages)
 		return false;
 
-	klock_guard lock(m_mutex);
-	const bool free = m_memoryRegions[base] & VMM_REG_ALLOC_FLAG;
-	const size_t numPages = freePages(base);
+	// page tables are released before the range can be handed out again
+	const uintptr_t region = m_regions.get(base);
+	if ((region & VMM_REG_BUSY_FLAG) == 0)
+		return false;
+
+	const size_t numPages = region >> VMM_REG_SIZE_SHIFT;
 	if (numPages == 0)
 		return false;
 
-	if (free)
+	if ((region & VMM_REG_ALLOC_FLAG) != 0)
 		m_paging.freeRamPages(reinterpret_cast<uintptr_t>(pointer), numPages * PAGE_SIZE, false);
-	return true;
+	account.chargeVirtual(-static_cast<ptrdiff_t>(numPages * PAGE_SIZE));
+	if ((region & VMM_REG_COMMIT_FLAG) != 0)
+		account.chargePhysicalPages(-static_cast<ptrdiff_t>(numPages));
+	VmmArena& arena = ownerArena(base);
+	klock_guard lock(arena.m_mutex);
+	return (freePages(arena, base) != 0);
 }
 
 void VirtualMemoryManagerPrivate::freeRamPages(void* base, size_t size, bool realloc)
@@ -382,12 +600,30 @@ void VirtualMemoryManagerPrivate::freeRamPages(void* base, size_t size, bool rea
 		m_paging.freeRamPages(reinterpret_cast<uintptr_t>(base), size, realloc);
 }
 
-void* VirtualMemoryManagerPrivate::mapMmio(uintptr_t mmioBase, size_t size, MemoryType memoryType)
+size_t VirtualMemoryManagerPrivate::freeRamPages(const VirtualMemoryRange* ranges, size_t count, bool realloc)
 {
-	const size_t alignSize = (mmioBase & PAGE_MASK) + size;
-	const uintptr_t vBase = reinterpret_cast<uintptr_t>(alloc(alignSize, VMM_RESERVED));
-	if (vBase == 0)
-		return nullptr;
+	if ((count != 0) && isRamMappingPtr(ranges[0].m_base))
+	{
+		size_t released = 0;
+		for (size_t idx = 0; idx < count; ++idx)
+		{
+			freeRamPages(ranges[idx].m_base, ranges[idx].m_size, realloc);
+			released += ranges[idx].m_size / PAGE_SIZE;
+		}
+		return released;
+	}
+
+	return m_paging.freeRamPages(ranges, count, realloc);
+}
+
+uintptr_t VirtualMemoryManagerPrivate::mapMmioPages(uintptr_t physBase, size_t numPages, MemoryType memoryType)
+{
+	// same offset in large page for virtual and physical addresses allows to map by large pages
+	const uintptr_t base = allocGlobalPages(numPages, size_t(1) << largePageOrder(0, numPages), physBase / PAGE_SIZE, 0);
+	if (base == g_invalidPageOffset)
+		return 0;
+
+	const uintptr_t vBase = m_virtualBase + (base * PAGE_SIZE);
 
 	uintptr_t pageFlags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | m_pageDefaultFlag;
 	switch (memoryType)
@@ -412,33 +648,168 @@ void* VirtualMemoryManagerPrivate::mapMmio(uintptr_t mmioBase, size_t size, Memo
 			break;
 	}
 
-	if (alignSize <= PAGE_SIZE)
-		m_paging.mapPage(vBase, mmioBase, pageFlags);
+	if (numPages == 1)
+		m_paging.mapPage(vBase, physBase, pageFlags);
 	else
-		m_paging.mapPages(vBase, mmioBase, alignSize, pageFlags);
-	return reinterpret_cast<void*> (vBase + (mmioBase & PAGE_MASK));
+		m_paging.mapPages(vBase, physBase, numPages * PAGE_SIZE, pageFlags);
+	return vBase;
 }
 
-bool VirtualMemoryManagerPrivate::unmapMmio(void* pointer)
+size_t VirtualMemoryManagerPrivate::unmapMmioPages(uintptr_t virtualBase)
 {
-	uintptr_t base = reinterpret_cast<uintptr_t>(pointer);
-	if (base < m_virtualBase)
-		return false;
+	if (virtualBase < m_virtualBase)
+		return 0;
 
-	base = (base - m_virtualBase) / PAGE_SIZE;
+	const uintptr_t base = (virtualBase - m_virtualBase) / PAGE_SIZE;
 	if (base >= m_virtualPages)
-		return false;
+		return 0;
+
+	const uintptr_t region = m_regions.get(base);
+	if ((region & VMM_REG_BUSY_FLAG) == 0)
+		return 0;
 
-	klock_guard lock(m_mutex);
-	const size_t numPages = freePages(base);
+	const size_t numPages = region >> VMM_REG_SIZE_SHIFT;
 	if (numPages == 0)
-		return false;
+		return 0;
 
-	if (numPages == 1)
-		m_paging.mapPage(reinterpret_cast<uintptr_t>(pointer), 0, 0);
-	else
-		m_paging.setPagesFlags(reinterpret_cast<uintptr_t>(pointer), numPages, static_cast<uintptr_t>(-1), 0);
-	return true;
+	// the range goes back to the arena after its TLB entries are gone
+	const uintptr_t pageBase = m_virtualBase + base * PAGE_SIZE;
+	m_paging.setPagesFlags(pageBase, numPages * PAGE_SIZE, static_cast<uintptr_t>(-1), 0);
+	VmmArena& arena = ownerArena(base);
+	klock_guard lock(arena.m_mutex);
+	return freePages(arena, base);
+}
+
+// m_mmioMutex locked
+void VirtualMemoryManagerPrivate::evictMmioMappings()
+{
+	size_t count = 0;
+	for (size_t idx = 0; idx < m_mmioMappingCount; ++idx)
+	{
+		if (m_mmioMappings[idx].m_refCount != 0)
+			kswap(m_mmioMappings[count++], m_mmioMappings[idx]);
+	}
+	unmapMmioMappings(count);
+}
+
+// m_mmioMutex locked, the mappings from the index to the end of the cache are torn down with a single TLB flush
+void VirtualMemoryManagerPrivate::unmapMmioMappings(size_t first)
+{
+	TlbBatch tlbBatch(m_paging);
+	for (size_t idx = first; idx < m_mmioMappingCount; ++idx)
+	{
+		const VmmMmioMapping& mapping = m_mmioMappings[idx];
+		m_paging.setPagesFlags(mapping.m_virtualBase, mapping.m_numPages * PAGE_SIZE, static_cast<uintptr_t>(-1), 0, &tlbBatch);
+	}
+	tlbBatch.flush();
+	for (size_t idx = first; idx < m_mmioMappingCount; ++idx)
+	{
+		const uintptr_t base = (m_mmioMappings[idx].m_virtualBase - m_virtualBase) / PAGE_SIZE;
+		VmmArena& arena = ownerArena(base);
+		klock_guard lock(arena.m_mutex);
+		freePages(arena, base);
+	}
+	m_mmioMappingCount = first;
+}
+
+void* VirtualMemoryManagerPrivate::mapMmio(uintptr_t mmioBase, size_t size, MemoryType memoryType)
+{
+	if (size == 0)
+		return nullptr;
+
+	const uintptr_t physBase = cpuAlignAddrLo(mmioBase);
+	const uintptr_t physEnd = cpuAlignAddrHi(mmioBase + size);
+	klock_guard lock(m_mmioMutex);
+	for (size_t idx = 0; idx < m_mmioMappingCount; ++idx)
+	{
+		VmmMmioMapping& mapping = m_mmioMappings[idx];
+		if (!mapping.m_retired && (mapping.m_memoryType == memoryType) && (mapping.m_physBase <= physBase) && (physEnd <= mapping.m_physBase + mapping.m_numPages * PAGE_SIZE))
+		{
+			++mapping.m_refCount;
+			return reinterpret_cast<void*>(mapping.m_virtualBase + (mmioBase - mapping.m_physBase));
+		}
+	}
+
+	uintptr_t mapBase = physBase;
+	uintptr_t mapEnd = physEnd;
+	if (memoryType == MemoryType::CacheDisabled)
+	{
+		const uintptr_t windowMask = MmioWindowPages * PAGE_SIZE - 1;
+		mapBase &= ~windowMask;
+		mapEnd = (mapEnd + windowMask) & ~windowMask;
+	}
+
+	// overlapping and adjacent mappings of the type are merged into one, they are moved to the end of the cache
+	size_t mergedFirst = m_mmioMappingCount;
+	for (bool grown = true; grown; )
+	{
+		grown = false;
+		for (size_t idx = 0; idx < mergedFirst; )
+		{
+			VmmMmioMapping& mapping = m_mmioMappings[idx];
+			const uintptr_t end = mapping.m_physBase + mapping.m_numPages * PAGE_SIZE;
+			if (mapping.m_retired || (mapping.m_memoryType != memoryType) || (end < mapBase) || (mapping.m_physBase > mapEnd))
+			{
+				++idx;
+				continue;
+			}
+
+			mapBase = kmin(mapBase, mapping.m_physBase);
+			mapEnd = kmax(mapEnd, end);
+			kswap(mapping, m_mmioMappings[--mergedFirst]);
+			grown = true;
+		}
+	}
+
+	// the merged mappings still in use are retired, the others are torn down now
+	size_t unusedFirst = mergedFirst;
+	for (size_t idx = mergedFirst; idx < m_mmioMappingCount; ++idx)
+	{
+		if (m_mmioMappings[idx].m_refCount != 0)
+		{
+			m_mmioMappings[idx].m_retired = true;
+			kswap(m_mmioMappings[unusedFirst++], m_mmioMappings[idx]);
+		}
+	}
+	unmapMmioMappings(unusedFirst);
+	if (m_mmioMappingCount == MmioCacheSize)
+		evictMmioMappings();
+
+	const size_t numPages = (mapEnd - mapBase) / PAGE_SIZE;
+	const uintptr_t vBase = mapMmioPages(mapBase, numPages, memoryType);
+	if (vBase == 0)
+		return nullptr;
+
+	// a full cache leaves the mapping private to the caller
+	if (m_mmioMappingCount < MmioCacheSize)
+		m_mmioMappings[m_mmioMappingCount++] = VmmMmioMapping{mapBase, numPages, vBase, 1, memoryType, false};
+	return reinterpret_cast<void*>(vBase + (mmioBase - mapBase));
+}
+
+bool VirtualMemoryManagerPrivate::unmapMmio(void* pointer)
+{
+	const uintptr_t addr = reinterpret_cast<uintptr_t>(pointer);
+	{
+		// cached mappings stay mapped until the cache needs the slots
+		klock_guard lock(m_mmioMutex);
+		for (size_t idx = 0; idx < m_mmioMappingCount; ++idx)
+		{
+			VmmMmioMapping& mapping = m_mmioMappings[idx];
+			if ((mapping.m_virtualBase <= addr) && (addr < mapping.m_virtualBase + mapping.m_numPages * PAGE_SIZE))
+			{
+				if (mapping.m_refCount == 0)
+					return false;
+
+				if ((--mapping.m_refCount == 0) && mapping.m_retired)
+				{
+					kswap(mapping, m_mmioMappings[m_mmioMappingCount - 1]);
+					unmapMmioMappings(m_mmioMappingCount - 1);
+				}
+				return true;
+			}
+		}
+	}
+	return (unmapMmioPages(addr) != 0);
 }
 
 bool VirtualMemoryManagerPrivate::setPagesFlags(void* pointer, size_t size, uintptr_t flags)
@@ -454,7 +825,7 @@ bool VirtualMemoryManagerPrivate::setPagesFlags(void* pointer, size_t size, uint
 		return false;
 	
 	const uintptr_t numPages = end - base;
-	uintptr_t regNumPages = m_memoryRegions[base];
+	uintptr_t regNumPages = m_regions.get(base);
 	if( (regNumPages & VMM_REG_BUSY_FLAG) == 0)
 		return false;
 	
@@ -468,11 +839,11 @@ bool VirtualMemoryManagerPrivate::setPagesFlags(void* pointer, size_t size, uint
 	else if( (flags & VMM_READONLY) != 0)
 		pflags = PAGE_FLAG_PRESENT;
 	else 
-		flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE;
+		pflags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE;
 	if( (flags & VMM_NOCACHE) != 0)
 		pflags |= PAGE_FLAG_CACHE_DISABLE;
 	const uintptr_t pageMask = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_CACHE_DISABLE;
-	m_paging.setPagesFlags(reinterpret_cast<uintptr_t>(base), numPages * PAGE_SIZE, pageMask, pflags);
+	m_paging.setPagesFlags(m_virtualBase + base * PAGE_SIZE, numPages * PAGE_SIZE, pageMask, pflags);
 	return true;
 }
 
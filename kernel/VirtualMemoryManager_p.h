@@ -20,9 +20,12 @@
 */
 
 #pragma once
+#include <atomic>
 #include <common_types.h>
+#include <cpu.h>
 #include <kmutex.h>
 #include <VirtualMemoryManager.h>
+#include <MemoryAccount.h>
 #include "paging.h"
 
 struct VmmFreeMemoryListItem
@@ -33,37 +36,129 @@ struct VmmFreeMemoryListItem
 	VmmFreeMemoryListItem* m_next;
 };
 
+// Region boundary tags keyed by page number. Leaves are allocated on the first
+// store, so the metadata follows the used part of the address space.
+class VmmRegionTree
+{
+public:
+	uintptr_t get(uintptr_t page) const
+	{
+		const Leaf* leaf = findLeaf(page);
+		return (leaf != nullptr) ? leaf->m_tags[page & (Fanout - 1)] : 0;
+	}
+
+	void set(uintptr_t page, uintptr_t tag);
+
+private:
+	enum : size_t
+	{
+		FanoutShift = 9,
+		Fanout = size_t(1) << FanoutShift
+	};
+
+	struct Leaf
+	{
+		uintptr_t m_tags[Fanout];
+	};
+
+	struct Node
+	{
+		std::atomic<Leaf*> m_leaves[Fanout];
+	};
+
+	const Leaf* findLeaf(uintptr_t page) const
+	{
+		const Node* node = m_root[page >> (2 * FanoutShift)].load(std::memory_order_acquire);
+		if (node == nullptr)
+			return nullptr;
+
+		return node->m_leaves[(page >> FanoutShift) & (Fanout - 1)].load(std::memory_order_acquire);
+	}
+
+	std::atomic<Node*> m_root[Fanout] = {};
+};
+
+struct VmmArena
+{
+	VmmFreeMemoryListItem* m_freeListTable[sizeof(uintptr_t) * 8] = {};
+	size_t m_freeListTableCounters[sizeof (uintptr_t) * 8] = {};
+	VmmFreeMemoryListItem* m_freeListItems = nullptr;
+	uint8_t m_id = 0;
+	kmutex m_mutex;
+};
+
+struct VmmMmioMapping
+{
+	uintptr_t m_physBase;
+	size_t m_numPages;
+	uintptr_t m_virtualBase;
+	size_t m_refCount;
+	MemoryType m_memoryType;
+	// merged into a larger mapping, goes away with its last user
+	bool m_retired;
+};
+
 class VirtualMemoryManagerPrivate
 {
 public:
 	VirtualMemoryManagerPrivate();
-	void* alloc(size_t size, uintptr_t flags);
-	bool free(void* pointer);
+	void* alloc(size_t size, uintptr_t flags, MemoryAccount& account);
+	bool free(void* pointer, MemoryAccount& account);
 	void freeRamPages(void* base, size_t size, bool realloc);
+	size_t freeRamPages(const VirtualMemoryRange* ranges, size_t count, bool realloc);
 	void* mapMmio(uintptr_t mmioBase, size_t size, MemoryType memoryType);
 	bool unmapMmio(void* pointer);
 	bool setPagesFlags(void* pointer, size_t size, uintptr_t flags);
 	PagingManager64* pagingManager();
 
+private:
+	enum : size_t
+	{
+		// 16 MiB of address space is handed to a CPU arena at once
+		ArenaChunkPages = 0x1000,
+		ArenaMaxAllocPages = 0x40,
+		GlobalArenaId = 0,
+		// uncached requests are widened to share mappings between neighbours
+		MmioWindowPages = 0x10,
+		MmioCacheSize = 128
+	};
+
 private:
 	VirtualMemoryManagerPrivate(const VirtualMemoryManager&) = delete;
 	VirtualMemoryManagerPrivate(VirtualMemoryManager&&) = delete;
-	void addFreeRegion(uintptr_t pageBase, size_t numPages);
-	void deleteFreeRegion(size_t tableIndex, VmmFreeMemoryListItem* region);
-	void setBusyRegion(unsigned tableIndex, VmmFreeMemoryListItem* region, size_t numPages);
-	uintptr_t allocPages(size_t numPages);
-	uintptr_t freePages(uintptr_t pageBase);
+	void addFreeRegion(VmmArena& arena, uintptr_t pageBase, size_t numPages);
+	void deleteFreeRegion(VmmArena& arena, size_t tableIndex, VmmFreeMemoryListItem* region);
+	void setBusyRegion(VmmArena& arena, unsigned tableIndex, VmmFreeMemoryListItem* region, size_t numPages);
+	uintptr_t allocPages(VmmArena& arena, size_t numPages);
+	uintptr_t allocAlignedPages(VmmArena& arena, size_t numPages, size_t alignPages, uintptr_t alignOffset);
+	void setBusyPages(uintptr_t pageBase, size_t numPages);
+	uintptr_t freePages(VmmArena& arena, uintptr_t pageBase);
+	uintptr_t allocLocalPages(size_t numPages, uintptr_t regionFlags);
+	uintptr_t allocGlobalPages(size_t numPages, size_t alignPages, uintptr_t alignOffset, uintptr_t regionFlags);
+	VmmArena* localArena();
+	VmmArena& ownerArena(uintptr_t pageBase);
+	VmmFreeMemoryListItem* allocListItem(VmmArena& arena);
+	uintptr_t mapMmioPages(uintptr_t physBase, size_t numPages, MemoryType memoryType);
+	size_t unmapMmioPages(uintptr_t virtualBase);
+	void evictMmioMappings();
+	void unmapMmioMappings(size_t first);
+
+	uint8_t chunkOwner(uintptr_t pageBase) const
+	{
+		return m_chunkOwners[pageBase / ArenaChunkPages];
+	}
 
 private:
 	PagingManager64& m_paging;
-	uintptr_t* m_memoryRegions = nullptr;
-	VmmFreeMemoryListItem* m_freeListTable[sizeof(uintptr_t) * 8];
-	size_t m_freeListTableCounters[sizeof (uintptr_t) * 8];
+	VmmRegionTree m_regions;
+	uint8_t* m_chunkOwners = nullptr;
 	size_t m_freeListTableSize = 0;
-	VmmFreeMemoryListItem* m_freeListItems = nullptr;
-	VmmFreeMemoryListItem* m_freeListItemsStart = nullptr;
 	uintptr_t m_virtualBase = 0;
 	uintptr_t m_virtualPages = 0;
 	const uintptr_t m_pageDefaultFlag = 0;
-	kmutex m_mutex;
+	VmmArena m_globalArena;
+	std::atomic<VmmArena*> m_cpuArenas[MAX_CPU] = {};
+	VmmMmioMapping m_mmioMappings[MmioCacheSize] = {};
+	size_t m_mmioMappingCount = 0;
+	kmutex m_mmioMutex;
 };
@@ -101,6 +101,19 @@ uintptr_t cpuMaxPhysAddr()
 	return result;
 }
 
+bool cpuSupport1GbPages()
+{
+	static const bool result = [] {
+		uint32_t eax = CPUID_PROCESSOR_INFOEX_EAX;
+		uint32_t ebx;
+		uint32_t ecx;
+		uint32_t edx;
+		cpuCpuid(eax, ebx, edx, ecx);
+		return ((edx & CPUID_PROCESSOR_INFOEX_EDX_1GBPAGES) != 0);
+	}();
+	return result;
+}
+
 unsigned int cpuLogicalCount()
 {
 	static const unsigned int count = [] {
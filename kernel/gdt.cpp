@@ -85,6 +85,8 @@ namespace SystemGDT
 	void installOnBootCpu()
 	{
 		static SystemTaskSegmentState bootTss = {};
+		static uint8_t bootExceptionStack[SYSTEM_EXCEPTION_STACK_SIZE] alignas(16) = {};
+		initExceptionStack(bootTss, bootExceptionStack);
 		install(BOOT_CPU_ID, &bootTss);
 	}
 
@@ -112,4 +114,9 @@ namespace SystemGDT
 	{
 		return *static_cast<SystemTaskSegmentState*>(cpuGetLocalPtr(LOCAL_CPU_TSS));
 	}
+
+	void initExceptionStack(SystemTaskSegmentState& tss, void* stack)
+	{
+		tss.m_ist[SYSTEM_EXCEPTION_IST - 1] = reinterpret_cast<uintptr_t>(stack) + SYSTEM_EXCEPTION_STACK_SIZE;
+	}
 }
\ No newline at end of file
@@ -35,7 +35,14 @@ enum : uint16_t
 
 enum : size_t
 {
-	GDT_TABLE_DEFAULT_ITEMS_COUNT = 5
+	GDT_TABLE_DEFAULT_ITEMS_COUNT = 5,
+	SYSTEM_EXCEPTION_STACK_SIZE = 0x4000
+};
+
+// page and double faults switch to their own stack: kernel stacks are committed on demand
+enum : uint8_t
+{
+	SYSTEM_EXCEPTION_IST = 1
 };
 
 #pragma pack(push, 1)
@@ -60,4 +67,5 @@ namespace SystemGDT
 	void install(unsigned int cpuId, const SystemTaskSegmentState* tss);
 	void storeBootPart(void* gdt, void* pointer);
 	SystemTaskSegmentState& getTSS();
+	void initExceptionStack(SystemTaskSegmentState& tss, void* stack);
 }
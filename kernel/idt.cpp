@@ -60,4 +60,9 @@ namespace SystemIDT
 		gate.m_type = (disableInterrupts ? 0x8E : 0x8F);
 		gate.m_reserved = 0;
 	}
+
+	void setInterruptStack(uint8_t vector, uint8_t ist)
+	{
+		g_idt[vector].m_ist = ist;
+	}
 }
@@ -27,6 +27,7 @@ namespace SystemIDT
 	typedef void (*InterruptHandler)();
 	void install();
 	void setHandler(uint8_t vector, InterruptHandler handler, bool disableInterrupts);
+	void setInterruptStack(uint8_t vector, uint8_t ist);
 }
 
 
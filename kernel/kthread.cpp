@@ -26,8 +26,44 @@
 #include "gdt.h"
 #include "panic.h"
 #include "ThreadPrivate.h"
+#include "paging.h"
 
 static const TimePoint g_defaultDesiredTaskMaxWaitTimeMs = 10;
+static const size_t g_threadMemoryPoolCapacity = 8;
+
+// recently released thread memory, reused without going through the VMM
+struct ThreadMemoryPool
+{
+	size_t m_count;
+	void* m_items[g_threadMemoryPoolCapacity];
+};
+
+struct CpuThreadMemoryPools
+{
+	ThreadMemoryPool m_stacks;
+	ThreadMemoryPool m_fpuData;
+	ThreadMemoryPool m_localData;
+};
+
+static kcache_aligned<CpuThreadMemoryPools> g_threadMemoryPools[MAX_CPU];
+
+static void* popThreadMemory(ThreadMemoryPool CpuThreadMemoryPools::* member)
+{
+	CpuInterruptLockSave intLock;
+	ThreadMemoryPool& pool = g_threadMemoryPools[cpuCurrentId()].get().*member;
+	return (pool.m_count > 0) ? pool.m_items[--pool.m_count] : nullptr;
+}
+
+static bool pushThreadMemory(ThreadMemoryPool CpuThreadMemoryPools::* member, void* item)
+{
+	CpuInterruptLockSave intLock;
+	ThreadMemoryPool& pool = g_threadMemoryPools[cpuCurrentId()].get().*member;
+	if (pool.m_count == g_threadMemoryPoolCapacity)
+		return false;
+
+	pool.m_items[pool.m_count++] = item;
+	return true;
+}
 
 kthread::kthread()
 	: m_private(nullptr)
@@ -82,12 +118,50 @@ void kthread::join()
 	m_private->m_terminateEvent.wait(EventObject::WaitInfinite);
 }
 
+void kthread::setSchedulingClass(SchedulingClass schedulingClass)
+{
+	Task* task = m_private->m_task.get();
+	TaskManager::system()->setScheduling(task, schedulingClass, task->m_priority);
+}
+
+void kthread::setPriority(int priority)
+{
+	Task* task = m_private->m_task.get();
+	TaskManager::system()->setScheduling(task, task->m_schedulingClass, priority);
+}
+
+kthread::SchedulingClass kthread::schedulingClass() const
+{
+	return m_private->m_task->m_schedulingClass;
+}
+
+int kthread::priority() const
+{
+	return m_private->m_task->m_priority;
+}
+
+bool kthread::setAffinity(const kcpu_set& cpus)
+{
+	return TaskManager::system()->setAffinity(m_private->m_task.get(), cpus);
+}
+
+kcpu_set kthread::affinity() const
+{
+	return m_private->m_task->m_affinity;
+}
+
 namespace kthis_thread
 {
 	KERNEL_SHARED kthread::id get_id()
 	{
 		return reinterpret_cast<kthread::id>(TaskManager::current());
 	}
+
+	KERNEL_SHARED void pin_to_current_cpu()
+	{
+		TaskSwitchLock lock;
+		TaskManager::system()->setAffinity(TaskManager::current(), kcpu_set::single(cpuCurrentId()));
+	}
 }
 
 void ThreadPrivate::init(size_t kernelStackSize)
@@ -97,17 +171,17 @@ void ThreadPrivate::init(size_t kernelStackSize)
 		cpuSaveFpuContext(result);
 		return result;
 	}();
-	if (kernelStackSize != 0)
-	{
-		m_task->m_systemStack = m_sysVmm.alloc(kernelStackSize, (m_process.supervisor() ? (VMM_READWRITE | VMM_COMMIT) : VMM_READWRITE));
-	}
-	else
-	{
-		m_task->m_systemStack = nullptr;
-	}
+	m_stackSize = kernelStackSize;
+	m_task->m_systemStack = (kernelStackSize != 0) ? allocStack(kernelStackSize) : nullptr;
 	m_task->m_stackTop = reinterpret_cast<uintptr_t>(m_task->m_systemStack) + kernelStackSize;
-	m_task->m_fpuData = m_sysVmm.alloc(PAGE_SIZE, VMM_READWRITE);
-	m_task->m_threadLocalData = m_sysVmm.alloc(LOCAL_THREAD_STORAGE_DATA_SIZE, VMM_READWRITE);
+	m_task->m_fpuData = popThreadMemory(&CpuThreadMemoryPools::m_fpuData);
+	if (m_task->m_fpuData == nullptr)
+		m_task->m_fpuData = m_sysVmm.alloc(PAGE_SIZE, VMM_READWRITE);
+	m_task->m_threadLocalData = popThreadMemory(&CpuThreadMemoryPools::m_localData);
+	if (m_task->m_threadLocalData != nullptr)
+		kmemset(m_task->m_threadLocalData, 0, LOCAL_THREAD_STORAGE_DATA_SIZE);
+	else
+		m_task->m_threadLocalData = m_sysVmm.alloc(LOCAL_THREAD_STORAGE_DATA_SIZE, VMM_READWRITE);
 	kmemcpy(m_task->m_fpuData, defaultFpuData, PAGE_SIZE);
 	m_task->m_threadPrivate = this;
 	uintptr_t* tls = static_cast<uintptr_t*>(m_task->m_threadLocalData);
@@ -115,6 +189,7 @@ void ThreadPrivate::init(size_t kernelStackSize)
 	m_task->m_kernel = (&m_process == &Process::kernel());
 	m_task->m_pagingManager = m_process.vmm().pagingManager();
 	m_task->m_desiredMaxWait = AbstractTimer::system()->fromMilliseconds(g_defaultDesiredTaskMaxWaitTimeMs);
+	m_task->m_cpu = cpuCurrentId();
 }
 
 ThreadPrivate::ThreadPrivate(kthread* obj, Process& process, const std::function<void()>& entry, bool enqueue, size_t kernelStackSize, size_t /*userStackSize*/)
@@ -128,6 +203,9 @@ ThreadPrivate::ThreadPrivate(kthread* obj, Process& process, const std::function
 	}
 
 	m_process.addThread(m_obj);
+	// threads of the task manager itself are made before it is set up and never wait in run queues
+	if (TaskManager::system() != nullptr)
+		TaskManager::system()->reserveTask();
 	init(kernelStackSize);
 	if (kernelStackSize != 0)
 	{
@@ -135,9 +213,7 @@ ThreadPrivate::ThreadPrivate(kthread* obj, Process& process, const std::function
 		if (enqueue)
 		{
 			TaskSwitchLock lock;
-			TaskManager* taskMgr = TaskManager::system();
-			taskMgr->addWaitTask(m_task.get());
-			taskMgr->smpBalancing();
+			TaskManager::system()->addWaitTask(m_task.get());
 		}
 	}
 }
@@ -149,12 +225,43 @@ ThreadPrivate::~ThreadPrivate()
 		PANIC(L"Attempt to destroy active thread");
 	}
 
-	m_sysVmm.free(m_task->m_systemStack);
-	m_sysVmm.free(m_task->m_fpuData);
-	m_sysVmm.free(m_task->m_threadLocalData);
+	TaskManager::system()->cancelTimerSync(&m_task->m_sleepTimer);
+	TaskManager::system()->releaseTask();
+	if (m_task->m_systemStack != nullptr)
+		freeStack(m_task->m_systemStack, m_stackSize);
+	if (!pushThreadMemory(&CpuThreadMemoryPools::m_fpuData, m_task->m_fpuData))
+		m_sysVmm.free(m_task->m_fpuData);
+	if (!pushThreadMemory(&CpuThreadMemoryPools::m_localData, m_task->m_threadLocalData))
+		m_sysVmm.free(m_task->m_threadLocalData);
 	m_process.removeThread(m_obj);
 }
 
+void* ThreadPrivate::allocStack(size_t size)
+{
+	if (size == DEFAULT_KERNEL_THREAD_STASK_SIZE)
+	{
+		void* stack = popThreadMemory(&CpuThreadMemoryPools::m_stacks);
+		if (stack != nullptr)
+			return stack;
+	}
+
+	// committed on demand, the lowest page is left unmapped to catch overflows
+	const uintptr_t base = reinterpret_cast<uintptr_t>(m_sysVmm.alloc(size + PAGE_SIZE, VMM_READWRITE));
+	if (base == 0)
+		PANIC(L"Can't allocate thread stack");
+
+	m_sysVmm.pagingManager()->setPagesFlags(base, PAGE_SIZE, PAGE_MASK, 0);
+	return reinterpret_cast<void*>(base + PAGE_SIZE);
+}
+
+void ThreadPrivate::freeStack(void* stack, size_t size)
+{
+	if ((size == DEFAULT_KERNEL_THREAD_STASK_SIZE) && pushThreadMemory(&CpuThreadMemoryPools::m_stacks, stack))
+		return;
+
+	m_sysVmm.free(static_cast<uint8_t*>(stack) - PAGE_SIZE);
+}
+
 void ThreadPrivate::initStack(bool user)
 {
 	InterruptFullState* is = reinterpret_cast<InterruptFullState*>(m_task->m_stackTop - sizeof(InterruptFullState));
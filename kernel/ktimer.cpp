@@ -0,0 +1,70 @@
+/*
+   ktimer.cpp
+   Kernel timer
+   SHM DOS64
+   Copyright (c) 2023, Ilya Shamukov, ilya.shamukov@gmail.com
+   
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option) 
+   any later version.
+   
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or 
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for 
+   more details.
+   
+   You should have received a copy of the GNU General Public License along with 
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple 
+   Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <ktimer.h>
+#include "TaskManager.h"
+
+class TimerObject : public TimerEntry
+{
+public:
+	TimerObject(const std::function<void()>& callback)
+		: m_callback(callback)
+	{
+		m_handler = &onExpire;
+		m_context = this;
+	}
+
+private:
+	static void onExpire(void* context)
+	{
+		static_cast<TimerObject*>(context)->m_callback();
+	}
+
+private:
+	const std::function<void()> m_callback;
+};
+
+ktimer::ktimer(const std::function<void()>& callback)
+	: m_private(new TimerObject(callback))
+{
+
+}
+
+ktimer::~ktimer()
+{
+	TaskManager::system()->cancelTimerSync(m_private);
+	delete m_private;
+}
+
+void ktimer::start(TimePoint timeout)
+{
+	TaskManager::system()->startTimer(m_private, AbstractTimer::system()->fastTimepoint() + timeout);
+}
+
+bool ktimer::cancel()
+{
+	return TaskManager::system()->cancelTimer(m_private);
+}
+
+bool ktimer::pending() const
+{
+	return (m_private->m_wheel.load(std::memory_order_acquire) != TimerEntry::NoWheel);
+}
@@ -36,6 +36,7 @@
 #include "Hpet.h"
 #include "TaskManager.h"
 #include "InterruptQueuePool.h"
+#include "Heap.h"
 #include "PeLoader.h"
 #include "panic.h"
 #include "KernelPower.h"
@@ -51,13 +52,17 @@ void KernelMain()
 	VirtualMemoryManager::system();
 	LocalApic::system().initCurrentCpu();
 	AcpiTables::instance();
+	RamAllocator::getInstance().initNuma();
 	ExternalInterrupts::system();
 	Hpet::install();
 	TaskManager::init();
 	SystemSMP::init();
 	InterruptQueuePool::system();
+	Heap::system().startPurgeThread();
+	RamAllocator::getInstance().startReclaimThread();
 	KernelPower::init();
 	PeLoader::loadKernelModules();
+	RamAllocator::getInstance().releaseBootMemory();
 	runTests();
 	
 	TaskManager::terminateCurrentTask();
@@ -19,7 +19,10 @@
    Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#include <new>
 #include <kernel_export.h>
+#include <kmemory.h>
+#include <MemoryAccount.h>
 #include "Heap.h"
 #include "paging.h"
 
@@ -27,6 +30,7 @@
 
 #ifdef PAGE_HEAP
 #include <cpu.h>
+#include "panic.h"
 #include <VirtualMemoryManager.h>
 
 void* allocPageHeap(size_t size)
@@ -43,10 +47,11 @@ void freePageHeap(void *ptr)
 }
 #endif
 
+// heap memory is charged to the module the operators are called from, a free releases the charge of the allocation
 KERNEL_SHARED void* operator new[](size_t size) 
 {
 #ifndef PAGE_HEAP
-	return Heap::system().alloc(size);
+	return Heap::system().alloc(size, MemoryAccount::ofCode(__builtin_return_address(0)));
 #else
 	return allocPageHeap(size);
 #endif
@@ -73,7 +78,7 @@ KERNEL_SHARED void operator delete[](void* ptr, size_t)
 KERNEL_SHARED void* operator new(size_t size)
 {
 #ifndef PAGE_HEAP
-	return Heap::system().alloc(size);
+	return Heap::system().alloc(size, MemoryAccount::ofCode(__builtin_return_address(0)));
 #else
 	return allocPageHeap(size);
 #endif
@@ -95,4 +100,79 @@ KERNEL_SHARED void operator delete(void* ptr, size_t)
 #else
 	freePageHeap(ptr);
 #endif
-}
\ No newline at end of file
+}
+
+KERNEL_SHARED void* operator new(size_t size, std::align_val_t align)
+{
+#ifndef PAGE_HEAP
+	return Heap::system().allocAligned(size, static_cast<size_t>(align), MemoryAccount::ofCode(__builtin_return_address(0)));
+#else
+	(void)align;
+	return VirtualMemoryManager::system().alloc(size, VMM_READWRITE);
+#endif
+}
+
+KERNEL_SHARED void* operator new[](size_t size, std::align_val_t align)
+{
+#ifndef PAGE_HEAP
+	return Heap::system().allocAligned(size, static_cast<size_t>(align), MemoryAccount::ofCode(__builtin_return_address(0)));
+#else
+	(void)align;
+	return VirtualMemoryManager::system().alloc(size, VMM_READWRITE);
+#endif
+}
+
+KERNEL_SHARED void operator delete(void* ptr, std::align_val_t)
+{
+#ifndef PAGE_HEAP
+	Heap::system().free(ptr);
+#else
+	freePageHeap(ptr);
+#endif
+}
+
+KERNEL_SHARED void operator delete(void* ptr, size_t, std::align_val_t)
+{
+#ifndef PAGE_HEAP
+	Heap::system().free(ptr);
+#else
+	freePageHeap(ptr);
+#endif
+}
+
+KERNEL_SHARED void operator delete[](void* ptr, std::align_val_t)
+{
+#ifndef PAGE_HEAP
+	Heap::system().free(ptr);
+#else
+	freePageHeap(ptr);
+#endif
+}
+
+KERNEL_SHARED void operator delete[](void* ptr, size_t, std::align_val_t)
+{
+#ifndef PAGE_HEAP
+	Heap::system().free(ptr);
+#else
+	freePageHeap(ptr);
+#endif
+}
+
+KERNEL_SHARED bool kexpand(void* ptr, size_t size)
+{
+#ifndef PAGE_HEAP
+	return Heap::system().tryExpand(ptr, size);
+#else
+	return false;
+#endif
+}
+
+KERNEL_SHARED void* krealloc(void* ptr, size_t size)
+{
+#ifndef PAGE_HEAP
+	return Heap::system().realloc(ptr, size, MemoryAccount::ofCode(__builtin_return_address(0)));
+#else
+	PANIC(L"krealloc is not supported by page heap");
+	return nullptr;
+#endif
+}
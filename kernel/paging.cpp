@@ -19,6 +19,7 @@
    Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#include <limits>
 #include <cpu.h>
 #include <kernel_params.h>
 #include <vmem_utils.h>
@@ -36,7 +37,17 @@
 
 enum : uint64_t
 {
-	CPU_VIRTUAL_ADDRESS_MASK = 0xFFFFFFFFFFFF
+	CPU_VIRTUAL_ADDRESS_MASK = 0xFFFFFFFFFFFF,
+	PAGE_ADDRESS_MASK = CPU_PHYSICAL_ADDRESS_MASK & ~PAGE_MASK,
+	PAGE_DIR_ENTRIES = 512,
+	PAGE_DIR_SHIFT = 9
+};
+
+struct PagingManager64::PagesWalk
+{
+	bool m_needShootdown = false;
+	bool m_mergeLarge = false;
+	uint64_t* m_freeTables = nullptr;
 };
 
 struct TlbShotdownItem
@@ -56,7 +67,8 @@ struct CpuTlbShootdownTask
 };
 
 static CpuTlbShootdownTask* g_cpuTlbShootdownTask[MAX_CPU];
-static std::atomic<PagingManager64*> g_pagingManagers[MAX_CPU];
+static std::atomic<uintptr_t> g_zeroPage{0};
+static kcache_aligned<std::atomic<PagingManager64*>> g_pagingManagers[MAX_CPU];
 
 static void localCpuFlushTlb(uintptr_t virtualBase, size_t size)
 {
@@ -88,11 +100,9 @@ INTERRUPT_HANDLER(tlbShootdownHandler, "")
 		{
 			while (tlbTask->m_readIndex != tlbTask->m_writeIndex)
 			{
-				const TlbShotdownItem& item = tlbTask->m_items[tlbTask->m_readIndex++ % g_defaultTlbRingBufferSize];
+				const TlbShotdownItem item = tlbTask->m_items[tlbTask->m_readIndex++ % g_defaultTlbRingBufferSize];
 				lock.unlock();
-				const uintptr_t end = item.m_addr + item.m_size;
-				for (uintptr_t addr = item.m_addr; addr < end; addr += PAGE_SIZE)
-					cpuFlushTLB(addr);
+				localCpuFlushTlb(item.m_addr, item.m_size);
 				lock.lock();
 			}
 		}
@@ -100,9 +110,102 @@ INTERRUPT_HANDLER(tlbShootdownHandler, "")
 	cpuFastEio();
 }
 
-static uint64_t* accessToChildDir(uint64_t* dir, int index, uint64_t dirFlags)
+static uintptr_t zeroPage()
+{
+	uintptr_t page = g_zeroPage.load(std::memory_order_acquire);
+	if (page != 0)
+		return page;
+
+	RamAllocator& allocator = RamAllocator::getInstance();
+	const uintptr_t newPage = allocator.allocPage(true);
+	if (g_zeroPage.compare_exchange_strong(page, newPage, std::memory_order_acq_rel))
+		return newPage;
+
+	allocator.freePage(newPage);
+	return page;
+}
+
+// lazily allocated entries mapped to the shared zero page stay PRESENT | ALLOCATED,
+// write access is kept as PAGE_FLAG_COPY_ON_WRITE
+static inline bool isZeroPageEntry(uint64_t entry)
+{
+	return ((entry & (PAGE_FLAG_PRESENT | PAGE_FLAG_ALLOCATED)) == (PAGE_FLAG_PRESENT | PAGE_FLAG_ALLOCATED));
+}
+
+static inline uint64_t zeroPageEntryAccess(uint64_t entry)
+{
+	if ((entry & PAGE_FLAG_COPY_ON_WRITE) != 0)
+		entry = (entry & ~PAGE_FLAG_COPY_ON_WRITE) | PAGE_FLAG_WRITE;
+	return entry;
+}
+
+static inline uint64_t makeZeroPageEntry(uint64_t entry)
+{
+	if ((entry & PAGE_FLAG_PRESENT) == 0)
+		return (entry & (PAGE_MASK ^ PAGE_FLAG_COPY_ON_WRITE));
+
+	if ((entry & PAGE_FLAG_WRITE) != 0)
+		entry = (entry & ~PAGE_FLAG_WRITE) | PAGE_FLAG_COPY_ON_WRITE;
+	return (entry & PAGE_MASK) | PAGE_FLAG_ALLOCATED | zeroPage();
+}
+
+static inline void releaseZeroPageEntry(uint64_t& entry, bool virtualAllocated)
+{
+	entry = zeroPageEntryAccess(entry) & (PAGE_MASK ^ (PAGE_FLAG_PRESENT | PAGE_FLAG_ALLOCATED));
+	if (virtualAllocated)
+		entry |= PAGE_FLAG_ALLOCATED;
+}
+
+static inline bool isLargePageAllowed(uint64_t pageShift)
+{
+	return ((pageShift == PAGE_DIR_SHIFT) || ((pageShift == (PAGE_DIR_SHIFT * 2)) && cpuSupport1GbPages()));
+}
+
+static inline bool isLargeOrEmptyEntry(uint64_t entry)
+{
+	return ((entry == 0) || ((entry & PAGE_FLAG_SIZE) != 0));
+}
+
+// pageShift is log2 of the number of 4 KiB pages covered by the entry
+static void splitLargePage(uint64_t& entry, uint64_t pageShift)
+{
+	uint64_t* table = RamAllocator::getInstance().allocPagePtrCast<uint64_t>(false);
+	const uint64_t childSize = PAGE_SIZE << (pageShift - PAGE_DIR_SHIFT);
+	uint64_t childEntry = entry;
+	if (pageShift == PAGE_DIR_SHIFT)
+		childEntry &= ~PAGE_FLAG_SIZE;
+	for (size_t idx = 0; idx < PAGE_DIR_ENTRIES; ++idx, childEntry += childSize)
+		table[idx] = childEntry;
+	entry = virtualToPhysInt(table) | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | (entry & PAGE_FLAG_USER);
+}
+
+static bool mergeLargePage(uint64_t& entry, uint64_t pageShift)
+{
+	if (!isLargePageAllowed(pageShift))
+		return false;
+
+	const uint64_t* table = physToVirtualInt<uint64_t>(entry & PAGE_ADDRESS_MASK);
+	const uint64_t childSize = PAGE_SIZE << (pageShift - PAGE_DIR_SHIFT);
+	const uint64_t ignoreFlags = PAGE_FLAG_ACCESSED | PAGE_FLAG_DIRTY;
+	const uint64_t first = table[0] & ~ignoreFlags;
+	const uint64_t needSizeFlag = (pageShift == PAGE_DIR_SHIFT) ? 0 : PAGE_FLAG_SIZE;
+	if (((first & PAGE_FLAG_PRESENT) == 0) || ((first & PAGE_FLAG_SIZE) != needSizeFlag))
+		return false;
+
+	if (((first & PAGE_ADDRESS_MASK) & ((PAGE_SIZE << pageShift) - 1)) != 0)
+		return false;
+
+	for (size_t idx = 1; idx < PAGE_DIR_ENTRIES; ++idx)
+	{
+		if ((table[idx] & ~ignoreFlags) != (first + idx * childSize))
+			return false;
+	}
+	entry = first | PAGE_FLAG_SIZE;
+	return true;
+}
+
+static uint64_t* accessToChildDir(uint64_t& entry, uint64_t pageShift, uint64_t dirFlags)
 {
-	uint64_t& entry = dir[index];
 	if (entry == 0)
 	{
 		if (dirFlags == 0)
@@ -110,7 +213,11 @@ static uint64_t* accessToChildDir(uint64_t* dir, int index, uint64_t dirFlags)
 
 		entry = RamAllocator::getInstance().allocPage(true) | dirFlags;
 	}
-	return physToVirtualInt<uint64_t>(entry & (CPU_PHYSICAL_ADDRESS_MASK & ~PAGE_MASK));
+	else if ((entry & PAGE_FLAG_SIZE) != 0)
+	{
+		splitLargePage(entry, pageShift);
+	}
+	return physToVirtualInt<uint64_t>(entry & PAGE_ADDRESS_MASK);
 }
 
 PagingManager64::PagingManager64(bool system)
@@ -132,8 +239,8 @@ PagingManager64::~PagingManager64()
 	PANIC(L"not implemented");
 }
 
-template<typename Runnable>
-void PagingManager64::processPagesLevel(unsigned int level, uint64_t* dir, uint64_t pageStart, uint64_t pageEnd, uint64_t dirFlags, Runnable callback, bool& needShootdown)
+template<typename Runnable, typename LargeRunnable>
+void PagingManager64::processPagesLevel(unsigned int level, uint64_t* dir, uint64_t pageStart, uint64_t pageEnd, uint64_t dirFlags, Runnable callback, LargeRunnable largeCallback, PagesWalk& walk)
 {
 	if (level == Levels)
 	{
@@ -141,92 +248,130 @@ void PagingManager64::processPagesLevel(unsigned int level, uint64_t* dir, uint6
 		{
 			uint64_t& value = dir[pageStart++];
 			if ((value & PAGE_FLAG_PRESENT) != 0)
-				needShootdown = true;
+				walk.m_needShootdown = true;
 			callback(value);
 		}
 		return;
 	}
 
-	const uint64_t shift = (Levels - level) * 9;
-	const uint64_t size = (1LL << shift);
-	const uint64_t mask = size - 1;
-	const uint64_t fistLimit = (pageStart + size) & ~mask;
-	uint64_t* child = accessToChildDir(dir, static_cast<int>(pageStart >> shift), dirFlags);
-	if (pageEnd < fistLimit)
-	{
-		processPagesLevel(level + 1, child, pageStart & mask, pageEnd & mask, dirFlags, callback, needShootdown);
-		return;
-	}
-	else
+	const uint64_t shift = (Levels - level) * PAGE_DIR_SHIFT;
+	const uint64_t mask = (1ULL << shift) - 1;
+	const uint64_t firstIndex = pageStart >> shift;
+	const uint64_t lastIndex = pageEnd >> shift;
+	for (uint64_t index = firstIndex; index <= lastIndex; ++index)
 	{
-		processPagesLevel(level + 1, child, pageStart & mask, mask, dirFlags, callback, needShootdown);
-		const int lastPage = static_cast<int>((pageEnd + 1) >> shift);
-		for (int index = static_cast<int>(fistLimit >> shift); index < lastPage; index++)
+		const uint64_t start = (index == firstIndex) ? (pageStart & mask) : 0;
+		const uint64_t end = (index == lastIndex) ? (pageEnd & mask) : mask;
+		uint64_t& entry = dir[index];
+		if ((start == 0) && (end == mask) && isLargePageAllowed(shift) && isLargeOrEmptyEntry(entry))
 		{
-			child = accessToChildDir(dir, index, dirFlags);
-			processPagesLevel(level + 1, child, 0, mask, dirFlags, callback, needShootdown);
+			const bool present = ((entry & PAGE_FLAG_PRESENT) != 0);
+			if (largeCallback(entry, shift))
+			{
+				walk.m_needShootdown = walk.m_needShootdown || present;
+				continue;
+			}
 		}
-		if (((pageEnd + 1) & mask) != 0)
+
+		uint64_t* child = accessToChildDir(entry, shift, dirFlags);
+		processPagesLevel(level + 1, child, start, end, dirFlags, callback, largeCallback, walk);
+		if (walk.m_mergeLarge && mergeLargePage(entry, shift))
 		{
-			child = accessToChildDir(dir, lastPage, dirFlags);
-			processPagesLevel(level + 1, child, 0, pageEnd & mask, dirFlags, callback, needShootdown);
+			// the old table is released after TLB flush
+			child[0] = reinterpret_cast<uint64_t>(walk.m_freeTables);
+			walk.m_freeTables = child;
+			walk.m_needShootdown = true;
 		}
 	}
 }
 
-template<typename Runnable>
-void PagingManager64::processPages(uintptr_t virtualBase, size_t size, uint64_t dirFlags, Runnable callback)
+template<typename Runnable, typename LargeRunnable>
+void PagingManager64::processPages(uintptr_t virtualBase, size_t size, uint64_t dirFlags, Runnable callback, LargeRunnable largeCallback, bool mergeLarge, TlbBatch* batch)
 {
-	if (size == 0)
+	const VirtualMemoryRange range{reinterpret_cast<void*>(virtualBase), size};
+	processPages(&range, 1, dirFlags, callback, largeCallback, mergeLarge, batch);
+}
+
+template<typename Runnable, typename LargeRunnable>
+void PagingManager64::processPages(const VirtualMemoryRange* ranges, size_t count, uint64_t dirFlags, Runnable callback, LargeRunnable largeCallback, bool mergeLarge, TlbBatch* batch)
+{
+	if (count == 0)
 		return;
 	
-	if (!m_system && virtualBase >= KERNEL_VIRTUAL_BASE)
+	if (!m_system && reinterpret_cast<uintptr_t>(ranges[0].m_base) >= KERNEL_VIRTUAL_BASE)
 	{
 		PagingManager64* system = &PagingManager64::system();
 		if (this != system)
-			return system->processPages(virtualBase, size, dirFlags, callback);
+			return system->processPages(ranges, count, dirFlags, callback, largeCallback, mergeLarge, batch);
 	}
 
-	uintptr_t normalizeVirtualBase = virtualBase & CPU_VIRTUAL_ADDRESS_MASK;
-	bool needShutdown = false;
+	probeStack();
+	TlbBatch localBatch(*this);
+	TlbBatch& tlbBatch = (batch != nullptr) ? *batch : localBatch;
+	PagesWalk walk;
+	walk.m_mergeLarge = mergeLarge;
 	{
+		CpuInterruptLockSave intLock;
 		klock_guard lock(m_spin);
-		processPagesLevel(
-			1,
-			m_dir256tb,
-			(normalizeVirtualBase >> PAGE_SHIFT),
-			(((size + normalizeVirtualBase + PAGE_MASK) >> PAGE_SHIFT) - 1),
-			dirFlags,
-			callback,
-			needShutdown);
+		for (size_t idx = 0; idx < count; ++idx)
+		{
+			const uintptr_t virtualBase = reinterpret_cast<uintptr_t>(ranges[idx].m_base);
+			const size_t size = ranges[idx].m_size;
+			if (size == 0)
+				continue;
+
+			const uintptr_t normalizeVirtualBase = virtualBase & CPU_VIRTUAL_ADDRESS_MASK;
+			walk.m_needShootdown = false;
+			processPagesLevel(
+				1,
+				m_dir256tb,
+				(normalizeVirtualBase >> PAGE_SHIFT),
+				(((size + normalizeVirtualBase + PAGE_MASK) >> PAGE_SHIFT) - 1),
+				dirFlags,
+				callback,
+				largeCallback,
+				walk);
+			tlbBatch.add(virtualBase, size, walk.m_needShootdown);
+		}
+	}
+	// old tables are released after the TLB flush
+	while (walk.m_freeTables != nullptr)
+	{
+		uint64_t* table = walk.m_freeTables;
+		walk.m_freeTables = reinterpret_cast<uint64_t*>(table[0]);
+		tlbBatch.releaseTable(table);
 	}
-	flushPagesTlb(virtualBase, size, needShutdown);
 }
 
 template<typename Runnable>
-void PagingManager64::processPage(uintptr_t virtualBase, uint64_t dirFlags, Runnable callback)
+void PagingManager64::processPage(uintptr_t virtualBase, uint64_t dirFlags, Runnable callback, TlbBatch* batch)
 {
 	if (!m_system && virtualBase >= KERNEL_VIRTUAL_BASE)
 	{
 		PagingManager64* system = &PagingManager64::system();
 		if (this != system)
-			return system->processPage(virtualBase, dirFlags, callback);
+			return system->processPage(virtualBase, dirFlags, callback, batch);
 	}
 
+	probeStack();
 	uint64_t* dir = m_dir256tb;
 	bool needShutdown;
 	{
+		CpuInterruptLockSave intLock;
 		klock_guard lock(m_spin);
-		for (uint64_t shift = PAGE_SHIFT + (Levels - 1) * 9; shift > PAGE_SHIFT; shift -= 9)
-			dir = accessToChildDir(dir, (virtualBase >> shift) & 0x1FF, dirFlags);
+		for (uint64_t shift = (Levels - 1) * PAGE_DIR_SHIFT; shift > 0; shift -= PAGE_DIR_SHIFT)
+			dir = accessToChildDir(dir[(virtualBase >> (shift + PAGE_SHIFT)) & 0x1FF], shift, dirFlags);
 		uint64_t& value = dir[(virtualBase >> PAGE_SHIFT) & 0x1FF];
 		needShutdown = ((value & PAGE_FLAG_PRESENT) != 0);
 		callback(value);
 	}
-	flushPagesTlb(virtualBase, PAGE_SIZE, needShutdown);
+	if (batch != nullptr)
+		batch->add(virtualBase, PAGE_SIZE, needShutdown);
+	else
+		flushPagesTlb(virtualBase, PAGE_SIZE, needShutdown);
 }
 
-void PagingManager64::mapPages(uintptr_t virtualBase, uintptr_t physBase, size_t size, uint64_t pageFlags)
+void PagingManager64::mapPages(uintptr_t virtualBase, uintptr_t physBase, size_t size, uint64_t pageFlags, TlbBatch* batch)
 {
 	processPages(
 		virtualBase,
@@ -235,41 +380,102 @@ void PagingManager64::mapPages(uintptr_t virtualBase, uintptr_t physBase, size_t
 		[&physBase, pageFlags](uint64_t & pageEntry) {
 			pageEntry = physBase | pageFlags;
 			physBase += PAGE_SIZE;
-		});
+		},
+		[&physBase, pageFlags](uint64_t & dirEntry, uint64_t pageShift) {
+			const uint64_t size = PAGE_SIZE << pageShift;
+			if (((pageFlags & PAGE_FLAG_PRESENT) != 0) && ((physBase & (size - 1)) == 0))
+				dirEntry = physBase | pageFlags | PAGE_FLAG_SIZE;
+			else if ((pageFlags == 0) && (physBase == 0))
+				dirEntry = 0;
+			else
+				return false;
+
+			physBase += size;
+			return true;
+		},
+		true,
+		batch);
 }
 
-void PagingManager64::setPagesFlags(uintptr_t virtualBase, size_t size, uint64_t mask, uint64_t pageFlags)
+void PagingManager64::setPagesFlags(uintptr_t virtualBase, size_t size, uint64_t mask, uint64_t pageFlags, TlbBatch* batch)
 {
 	processPages(
 		virtualBase,
 		size,
 		((pageFlags & PAGE_FLAG_USER) | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE),
 		[mask, pageFlags](uint64_t & pageEntry) {
+			if (isZeroPageEntry(pageEntry))
+			{
+				pageEntry = makeZeroPageEntry((zeroPageEntryAccess(pageEntry) & ~mask) | pageFlags);
+				return;
+			}
+
 			pageEntry &= ~mask;
 			pageEntry |= pageFlags;
-		});
+		},
+		[mask, pageFlags](uint64_t & dirEntry, uint64_t) {
+			const uint64_t value = (dirEntry & ~mask) | pageFlags;
+			if (value == 0)
+				dirEntry = 0;
+			else if ((dirEntry != 0) && ((value & PAGE_FLAG_PRESENT) != 0) && ((mask & PAGE_ADDRESS_MASK) == 0))
+				dirEntry = value | PAGE_FLAG_SIZE;
+			else
+				return false;
+
+			return true;
+		},
+		true,
+		batch);
 }
 
-void PagingManager64::freeRamPages(uintptr_t virtualBase, size_t size, bool virtualAllocated)
+void PagingManager64::freeRamPages(uintptr_t virtualBase, size_t size, bool virtualAllocated, TlbBatch* batch)
+{
+	const VirtualMemoryRange range{reinterpret_cast<void*>(virtualBase), size};
+	freeRamPages(&range, 1, virtualAllocated, batch);
+}
+
+size_t PagingManager64::freeRamPages(const VirtualMemoryRange* ranges, size_t count, bool virtualAllocated, TlbBatch* batch)
 {
 	RamAllocator& allocator = RamAllocator::getInstance();
+	size_t released = 0;
 	processPages(
-		virtualBase,
-		size,
+		ranges,
+		count,
 		0,
-		[&allocator, virtualAllocated](uint64_t & pageEntry) {
-			if ((pageEntry & PAGE_FLAG_PRESENT) != 0)
+		[&allocator, &released, virtualAllocated](uint64_t & pageEntry) {
+			if (isZeroPageEntry(pageEntry))
+			{
+				releaseZeroPageEntry(pageEntry, virtualAllocated);
+			}
+			else if ((pageEntry & PAGE_FLAG_PRESENT) != 0)
 			{
 				const uintptr_t addr = pageEntry & (CPU_PHYSICAL_ADDRESS_MASK & ~PAGE_MASK);
 				if (addr != 0)
 				{
 					allocator.freePage(addr);
+					++released;
 					pageEntry &= PAGE_MASK ^ PAGE_FLAG_PRESENT;
 					if (virtualAllocated)
 						pageEntry |= PAGE_FLAG_ALLOCATED;
 				}
 			}
-		});
+		},
+		[&allocator, &released, virtualAllocated](uint64_t & dirEntry, uint64_t pageShift) {
+			if (dirEntry == 0)
+				return true;
+
+			// lazy reallocation needs 4 KiB entries
+			if (virtualAllocated)
+				return false;
+
+			allocator.freePages(dirEntry & PAGE_ADDRESS_MASK, static_cast<unsigned int>(pageShift));
+			released += size_t(1) << pageShift;
+			dirEntry = 0;
+			return true;
+		},
+		false,
+		batch);
+	return released;
 }
 
 void PagingManager64::freeRamPage(uintptr_t virtualBase, bool virtualAllocated)
@@ -278,7 +484,11 @@ void PagingManager64::freeRamPage(uintptr_t virtualBase, bool virtualAllocated)
 		virtualBase,
 		0,
 		[virtualAllocated](uint64_t & pageEntry) {
-			if ((pageEntry & PAGE_FLAG_PRESENT) != 0)
+			if (isZeroPageEntry(pageEntry))
+			{
+				releaseZeroPageEntry(pageEntry, virtualAllocated);
+			}
+			else if ((pageEntry & PAGE_FLAG_PRESENT) != 0)
 			{
 				const uintptr_t addr = pageEntry & (CPU_PHYSICAL_ADDRESS_MASK & ~PAGE_MASK);
 				if (addr != 0)
@@ -294,10 +504,10 @@ void PagingManager64::freeRamPage(uintptr_t virtualBase, bool virtualAllocated)
 
 void PagingManager64::processPages(uintptr_t virtualBase, size_t size, PageProc callback, uint64_t dirFlags)
 {
-	processPages<PageProc>(virtualBase, size, dirFlags, callback);
+	processPages(virtualBase, size, dirFlags, callback, [](uint64_t&, uint64_t) { return false; }, false, nullptr);
 }
 
-void PagingManager64::mapPage(uintptr_t virtualBase, uintptr_t physBase, uint64_t pageFlags)
+void PagingManager64::mapPage(uintptr_t virtualBase, uintptr_t physBase, uint64_t pageFlags, TlbBatch* batch)
 {
 	const auto entryValue = physBase | pageFlags;
 	processPage(
@@ -305,7 +515,8 @@ void PagingManager64::mapPage(uintptr_t virtualBase, uintptr_t physBase, uint64_
 		((pageFlags & PAGE_FLAG_USER) | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE),
 		[entryValue](uint64_t & pageEntry) {
 			pageEntry = entryValue;
-		});
+		},
+		batch);
 }
 
 void PagingManager64::processPage(uintptr_t virtualBase, PageProc callback, uint64_t dirFlags)
@@ -331,12 +542,23 @@ bool PagingManager64::onPageFault(uintptr_t addr, uint64_t errorCode)
 
 	enum : uint64_t
 	{
-		ecPageProtection = (1 << 0)
+		ecPageProtection = (1 << 0),
+		ecWrite = (1 << 1),
+		ecUser = (1 << 2)
 	};
-	if ((errorCode & ecPageProtection) != 0)
+	const bool protection = ((errorCode & ecPageProtection) != 0);
+	const bool write = ((errorCode & ecWrite) != 0);
+	const bool user = ((errorCode & ecUser) != 0);
+	// only a write to a copy-on-write leaf may get past a protection fault
+	if (protection && !write)
 		return false;
 
+	// declared before the lock: copy-on-write shootdown goes after unlocking
+	TlbBatch tlbBatch(*this);
 	uint64_t* dir = m_dir256tb;
+	// a stale translation is only flushed when the whole walk permits the access
+	uint64_t access = PAGE_FLAG_WRITE | PAGE_FLAG_USER;
+	CpuInterruptLockSave intLock;
 	klock_guard lock(m_spin);
 	for (uint64_t shift = PAGE_SHIFT + (Levels - 1) * 9; shift > PAGE_SHIFT; shift -= 9)
 	{
@@ -345,15 +567,52 @@ bool PagingManager64::onPageFault(uintptr_t addr, uint64_t errorCode)
 		if (phys == 0)
 			return false;
 
+		access &= dirValue;
 		if ((dirValue & PAGE_FLAG_SIZE) != 0)
-			PANIC(L"Fault in large page");
+		{
+			if (protection || user || (write && ((access & PAGE_FLAG_WRITE) == 0)))
+				return false;
+
+			// mapped by large page on other CPU
+			cpuFlushTLB(addr);
+			return true;
+		}
 
 		dir = physToVirtualInt<uint64_t>(phys);
 	}
-	uint64_t& pageValue = dir[(addr >> PAGE_SHIFT) & 0x1FF];
-	if ((pageValue & PAGE_FLAG_PRESENT) != 0)	
+	const size_t pageIdx = (addr >> PAGE_SHIFT) & 0x1FF;
+	const uint64_t pageValue = dir[pageIdx];
+	access &= pageValue;
+	if (user && ((access & PAGE_FLAG_USER) == 0))
+		return false;
+
+	if (isZeroPageEntry(pageValue))
 	{
-		// allocated on other CPU
+		if (!write)
+		{
+			// mapped on other CPU
+			cpuFlushTLB(addr);
+			return true;
+		}
+		if ((pageValue & PAGE_FLAG_COPY_ON_WRITE) == 0)
+			return false;
+
+		// the shared page is all zeros, so a zeroed private page is its copy
+		void* page;
+		if (RamAllocator::getInstance().allocPagesBatch(&page, 1, true) == 0)
+			PANIC(L"No enough memory");
+
+		releaseZeroPageEntry(dir[pageIdx], false);
+		dir[pageIdx] |= virtualToPhysInt(page) | PAGE_FLAG_PRESENT;
+		tlbBatch.add(addr, PAGE_SIZE, true);
+		return true;
+	}
+	else if ((pageValue & PAGE_FLAG_PRESENT) != 0)	
+	{
+		if (write && ((access & PAGE_FLAG_WRITE) == 0))
+			return false;
+
+		// allocated on other CPU, or a copy-on-write page upgraded before its shootdown reached here
 		cpuFlushTLB(addr);
 		return true;
 	}
@@ -362,9 +621,47 @@ bool PagingManager64::onPageFault(uintptr_t addr, uint64_t errorCode)
 		return false;
 	}
 
-	const uint64_t physPage = RamAllocator::getInstance().allocPage((pageValue & PAGE_FLAG_MEMZERO) != 0);
-	pageValue &= PAGE_MASK ^ PAGE_FLAG_ALLOCATED;
-	pageValue |= static_cast<uint64_t>(physPage) | PAGE_FLAG_PRESENT;
+	// fault-around: the window grows while faults land just past the previously populated range,
+	// kept per CPU so that streams of other CPUs don't reset it
+	const uintptr_t faultPage = addr >> PAGE_SHIFT;
+	const uintptr_t faultNextPage = cpuGetLocalData(LOCAL_CPU_FAULT_NEXT_PAGE);
+	const size_t faultAroundPages = kmax<size_t>(cpuGetLocalData(LOCAL_CPU_FAULT_AROUND_PAGES), 1);
+	const bool sequential = (faultPage >= faultNextPage) && ((faultPage - faultNextPage) <= faultAroundPages);
+	const size_t window = sequential ? kmin<size_t>(faultAroundPages * 2, FaultAroundMaxPages) : 1;
+	const size_t maxPages = kmin<size_t>(window, PAGE_DIR_ENTRIES - pageIdx);
+	size_t numPages = 1;
+	for (; numPages < maxPages; ++numPages)
+	{
+		const uint64_t value = dir[pageIdx + numPages];
+		if (((value & (PAGE_FLAG_PRESENT | PAGE_FLAG_ALLOCATED)) != PAGE_FLAG_ALLOCATED) || ((value & PAGE_FLAG_MEMZERO) != (pageValue & PAGE_FLAG_MEMZERO)))
+			break;
+	}
+
+	if (!write)
+	{
+		// reads see the shared zero page until the first write
+		for (size_t idx = 0; idx < numPages; ++idx)
+		{
+			uint64_t& value = dir[pageIdx + idx];
+			value = makeZeroPageEntry(value | PAGE_FLAG_PRESENT);
+		}
+	}
+	else
+	{
+		void* pages[FaultAroundMaxPages];
+		numPages = RamAllocator::getInstance().allocPagesBatch(pages, numPages, (pageValue & PAGE_FLAG_MEMZERO) != 0);
+		if (numPages == 0)
+			PANIC(L"No enough memory");
+
+		for (size_t idx = 0; idx < numPages; ++idx)
+		{
+			uint64_t& value = dir[pageIdx + idx];
+			value &= PAGE_MASK ^ PAGE_FLAG_ALLOCATED;
+			value |= virtualToPhysInt(pages[idx]) | PAGE_FLAG_PRESENT;
+		}
+	}
+	cpuSetLocalData(LOCAL_CPU_FAULT_NEXT_PAGE, faultPage + numPages);
+	cpuSetLocalData(LOCAL_CPU_FAULT_AROUND_PAGES, window);
 	cpuFlushTLB(addr);
 	return true;
 }
@@ -377,7 +674,7 @@ PagingManager64* PagingManager64::current()
 void PagingManager64::setCurrent(PagingManager64* pagingMgr)
 {
 	cpuSetLocalPtr(LOCAL_CPU_PAGING_MGR, pagingMgr);
-	g_pagingManagers[cpuCurrentId()].store(pagingMgr, std::memory_order_relaxed);
+	g_pagingManagers[cpuCurrentId()]->store(pagingMgr, std::memory_order_relaxed);
 	cpuSetCR3(pagingMgr->m_cr3);
 }
 
@@ -397,7 +694,7 @@ void PagingManager64::initSmp()
 		g_cpuTlbShootdownTask[cpuId] = static_cast<CpuTlbShootdownTask*>(task);
 	}
 	
-	g_pagingManagers[BOOT_CPU_ID].store(&PagingManager64::system(), std::memory_order_relaxed);
+	g_pagingManagers[BOOT_CPU_ID]->store(&PagingManager64::system(), std::memory_order_relaxed);
 	cpuSetLocalPtr(LOCAL_CPU_TLB_TASK, g_cpuTlbShootdownTask[BOOT_CPU_ID]);
 	SystemIDT::setHandler(CPU_TLB_SHOOTDOWN_VECTOR, &tlbShootdownHandler, true);
 }
@@ -410,63 +707,148 @@ void PagingManager64::initCpu(unsigned int cpuId)
 	tlbTask->m_readIndex = 0;
 	tlbTask->m_writeIndex = 0;
 	tlbTask->m_needFull = false;
-	g_pagingManagers[cpuId].store(this, std::memory_order_relaxed);
+	g_pagingManagers[cpuId]->store(this, std::memory_order_relaxed);
+}
+
+// Kernel stacks are committed on demand and the fault path takes the paging and
+// RAM allocator locks. Both are held with interrupts disabled, so no handler grows
+// the stack under them, and their holders touch the headroom of their own frames.
+__attribute__((noinline)) void PagingManager64::probeStack()
+{
+	volatile uint8_t probe[StackProbeSize];
+	for (size_t offset = 0; offset < StackProbeSize; offset += PAGE_SIZE)
+		probe[offset] = 0;
+	probe[StackProbeSize - 1] = 0;
 }
 
 void PagingManager64::flushPagesTlb(uintptr_t virtualBase, size_t size, bool needShootdown)
 {
-	localCpuFlushTlb(virtualBase, size);
-	if (needShootdown && SystemSMP::isInit())
+	TlbBatch batch(*this);
+	batch.add(virtualBase, size, needShootdown);
+}
+
+TlbBatch::TlbBatch(PagingManager64& pagingMgr)
+	: m_pagingMgr(pagingMgr)
+{
+
+}
+
+TlbBatch::~TlbBatch()
+{
+	flush();
+}
+
+void TlbBatch::add(uintptr_t virtualBase, size_t size, bool needShootdown)
+{
+	if (size == 0)
+		return;
+
+	m_needShootdown = m_needShootdown || needShootdown;
+	m_kernelMem = m_kernelMem || (virtualBase >= KERNEL_VIRTUAL_BASE);
+	m_size += size;
+	if (m_size >= CPU_UPDATE_TLB_LIMIT)
+		m_needFull = true;
+	if (m_count > 0)
 	{
-		const unsigned int curCpuId = cpuCurrentId();
-		const unsigned int numCpu = cpuLogicalCount();
-		const TlbShotdownItem item{virtualBase, size};
-		LocalApic& apic = LocalApic::system();
-		const bool userMem = (virtualBase < KERNEL_VIRTUAL_BASE);
-		const bool needFull = size >= CPU_UPDATE_TLB_LIMIT;
-		unsigned int cpuList[MAX_CPU];
-		unsigned int cpuListCount = 0;
-		for (unsigned int cpuId = 0; cpuId < numCpu; ++cpuId)
+		if (m_needFull)
+			return;
+
+		Range& last = m_ranges[m_count - 1];
+		if ((virtualBase >= last.m_addr) && (virtualBase <= (last.m_addr + last.m_size)))
 		{
-			if (cpuId == curCpuId)
-				continue;
-			
-			if (userMem && (g_pagingManagers[cpuId].load(std::memory_order_acquire) != this))
+			last.m_size = kmax(last.m_size, virtualBase + size - last.m_addr);
+			return;
+		}
+	}
+	// the first range is kept anyway: it selects the address space for a full flush
+	if (m_count == MaxRanges)
+		m_needFull = true;
+	else
+		m_ranges[m_count++] = Range{virtualBase, size};
+}
+
+void TlbBatch::releaseTable(uint64_t* table)
+{
+	table[0] = reinterpret_cast<uint64_t>(m_freeTables);
+	m_freeTables = table;
+}
+
+void TlbBatch::flush()
+{
+	if (m_needFull)
+		cpuFullFlushTLB(m_kernelMem ? 0 : m_ranges[0].m_addr);
+	else
+	{
+		for (size_t idx = 0; idx < m_count; ++idx)
+			localCpuFlushTlb(m_ranges[idx].m_addr, m_ranges[idx].m_size);
+	}
+	if (m_needShootdown && SystemSMP::isInit())
+		shootdown();
+
+	RamAllocator& allocator = RamAllocator::getInstance();
+	while (m_freeTables != nullptr)
+	{
+		uint64_t* table = m_freeTables;
+		m_freeTables = reinterpret_cast<uint64_t*>(table[0]);
+		allocator.freePagePtr(table);
+	}
+	m_count = 0;
+	m_size = 0;
+	m_needShootdown = false;
+	m_needFull = false;
+	m_kernelMem = false;
+}
+
+void TlbBatch::shootdown()
+{
+	PagingManager64::probeStack();
+	const unsigned int curCpuId = cpuCurrentId();
+	const unsigned int numCpu = cpuLogicalCount();
+	LocalApic& apic = LocalApic::system();
+	unsigned int cpuList[MAX_CPU];
+	unsigned int cpuListCount = 0;
+	for (unsigned int cpuId = 0; cpuId < numCpu; ++cpuId)
+	{
+		if (cpuId == curCpuId)
+			continue;
+		
+		// user mappings are only cached by CPUs running on the same page tables
+		if (!m_kernelMem && (g_pagingManagers[cpuId]->load(std::memory_order_acquire) != &m_pagingMgr))
+			continue;
+		
+		CpuTlbShootdownTask* tlbTask = g_cpuTlbShootdownTask[cpuId];
+		{
+			CpuInterruptLockSave intLock;
+			klock_guard lock(tlbTask->m_spin);
+			if (tlbTask->m_needFull)
 				continue;
 			
-			CpuTlbShootdownTask* tlbTask = g_cpuTlbShootdownTask[cpuId];
+			const size_t oldItems = (tlbTask->m_writeIndex - tlbTask->m_readIndex) % g_defaultTlbRingBufferSize;
+			if (m_needFull || ((oldItems + m_count) >= g_defaultTlbRingBufferSize))
 			{
-				CpuInterruptLockSave intLock;
-				klock_guard lock(tlbTask->m_spin);
-				if (tlbTask->m_needFull)
-					continue;
-				
-				const size_t oldItems = (tlbTask->m_writeIndex - tlbTask->m_readIndex) % g_defaultTlbRingBufferSize;
-				if ((oldItems == (g_defaultTlbRingBufferSize - 1)) || needFull)
-				{
-					tlbTask->m_writeIndex = 0;
-					tlbTask->m_readIndex = 0;
-					tlbTask->m_needFull = true;
-				}
-				else
-				{
-					tlbTask->m_items[tlbTask->m_writeIndex++ % g_defaultTlbRingBufferSize] = item;
-				}
-				if (oldItems == 0)
-				{
-					cpuList[cpuListCount++] = cpuId;
-				}
+				tlbTask->m_writeIndex = 0;
+				tlbTask->m_readIndex = 0;
+				tlbTask->m_needFull = true;
+			}
+			else
+			{
+				for (size_t idx = 0; idx < m_count; ++idx)
+					tlbTask->m_items[tlbTask->m_writeIndex++ % g_defaultTlbRingBufferSize] = TlbShotdownItem{m_ranges[idx].m_addr, m_ranges[idx].m_size};
+			}
+			if (oldItems == 0)
+			{
+				cpuList[cpuListCount++] = cpuId;
 			}
-		}
-		
-		if ( (cpuListCount + 1) != numCpu)
-		{
-			for (unsigned int idx = 0; idx < cpuListCount; ++idx)
-				apic.sendIpi(LocalApic::systemCpuIdToApic(cpuList[idx]), CPU_TLB_SHOOTDOWN_VECTOR);
-		}
-		else
-		{
-			apic.sendBroadcastIpi(CPU_TLB_SHOOTDOWN_VECTOR);
 		}
 	}
-}
\ No newline at end of file
+	
+	if ( (cpuListCount + 1) != numCpu)
+	{
+		for (unsigned int idx = 0; idx < cpuListCount; ++idx)
+			apic.sendIpi(LocalApic::systemCpuIdToApic(cpuList[idx]), CPU_TLB_SHOOTDOWN_VECTOR);
+	}
+	else
+	{
+		apic.sendBroadcastIpi(CPU_TLB_SHOOTDOWN_VECTOR);
+	}
+}
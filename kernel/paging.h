@@ -22,8 +22,44 @@
 #pragma once
 
 #include <common_types.h>
+#include <VirtualMemoryManager.h>
 #include "SpinLock.h"
 
+class PagingManager64;
+
+// Gathers TLB invalidations of several page table edits and flushes them
+// with a single shootdown round. Flushed on destruction.
+class TlbBatch
+{
+public:
+	TlbBatch(PagingManager64& pagingMgr);
+	~TlbBatch();
+	void add(uintptr_t virtualBase, size_t size, bool needShootdown);
+	void releaseTable(uint64_t* table);
+	void flush();
+
+private:
+	TlbBatch(const TlbBatch&) = delete;
+	TlbBatch(TlbBatch&&) = delete;
+	void shootdown();
+
+private:
+	enum { MaxRanges = 16 };
+	struct Range
+	{
+		uintptr_t m_addr;
+		size_t m_size;
+	};
+	PagingManager64& m_pagingMgr;
+	Range m_ranges[MaxRanges];
+	size_t m_count = 0;
+	size_t m_size = 0;
+	uint64_t* m_freeTables = nullptr;
+	bool m_needShootdown = false;
+	bool m_needFull = false;
+	bool m_kernelMem = false;
+};
+
 class PagingManager64
 {
 public:
@@ -33,12 +69,13 @@ public:
 	static PagingManager64& system();
 	PagingManager64(bool system);
 
-	void mapPages(uintptr_t virtualBase, uintptr_t physBase, size_t size, uint64_t pageFlags);
-	void setPagesFlags(uintptr_t virtualBase, size_t size, uint64_t mask, uint64_t pageFlags);
-	void freeRamPages(uintptr_t virtualBase, size_t size, bool virtualAllocated);
+	void mapPages(uintptr_t virtualBase, uintptr_t physBase, size_t size, uint64_t pageFlags, TlbBatch* batch = nullptr);
+	void setPagesFlags(uintptr_t virtualBase, size_t size, uint64_t mask, uint64_t pageFlags, TlbBatch* batch = nullptr);
+	void freeRamPages(uintptr_t virtualBase, size_t size, bool virtualAllocated, TlbBatch* batch = nullptr);
+	size_t freeRamPages(const VirtualMemoryRange* ranges, size_t count, bool virtualAllocated, TlbBatch* batch = nullptr);
 	void freeRamPage(uintptr_t virtualBase, bool virtualAllocated);
 	void processPages(uintptr_t virtualBase, size_t size, PageProc callback, uint64_t dirFlags = 0);
-	void mapPage(uintptr_t virtualBase, uintptr_t physBase, uint64_t pageFlags);
+	void mapPage(uintptr_t virtualBase, uintptr_t physBase, uint64_t pageFlags, TlbBatch* batch = nullptr);
 	void processPage(uintptr_t virtualBase, PageProc callback, uint64_t dirFlags = 0);
 	void storeRootTable(void* table);
 
@@ -47,6 +84,7 @@ public:
 	static void setCurrent(PagingManager64* pagingMgr);
 	static void initSmp();
 	void initCpu(unsigned int cpuId);
+	static void probeStack();
 
 	bool onPageFault(uintptr_t addr, uint64_t errorCode);
 
@@ -55,18 +93,23 @@ private:
 	PagingManager64(PagingManager64&&) = delete;
 	~PagingManager64();
 
+	struct PagesWalk;
+	template<typename Runnable, typename LargeRunnable>
+	void processPagesLevel(unsigned int level, uint64_t* dir, uint64_t pageStart, uint64_t pageEnd, uint64_t dirFlags, Runnable callback, LargeRunnable largeCallback, PagesWalk& walk);
+	template<typename Runnable, typename LargeRunnable>
+	void processPages(uintptr_t virtualBase, size_t size, uint64_t dirFlags, Runnable callback, LargeRunnable largeCallback, bool mergeLarge, TlbBatch* batch);
+	template<typename Runnable, typename LargeRunnable>
+	void processPages(const VirtualMemoryRange* ranges, size_t count, uint64_t dirFlags, Runnable callback, LargeRunnable largeCallback, bool mergeLarge, TlbBatch* batch);
 	template<typename Runnable>
-	void processPagesLevel(unsigned int level, uint64_t* dir, uint64_t pageStart, uint64_t pageEnd, uint64_t dirFlags, Runnable callback, bool& needShootdown);
-	template<typename Runnable>
-	void processPages(uintptr_t virtualBase, size_t size, uint64_t dirFlags, Runnable callback);
-	template<typename Runnable>
-	void processPage(uint64_t virtualBase, uint64_t dirFlags, Runnable callback);
+	void processPage(uint64_t virtualBase, uint64_t dirFlags, Runnable callback, TlbBatch* batch = nullptr);
 	void flushPagesTlb(uintptr_t virtualBase, size_t size, bool needShootdown);
 
 private:
 	enum
 	{
-		Levels = 4
+		Levels = 4,
+		FaultAroundMaxPages = 64,
+		StackProbeSize = 2 * PAGE_SIZE
 	};
 	uint64_t* m_dir256tb = nullptr;
 	uint64_t m_cr3;
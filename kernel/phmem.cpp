@@ -21,12 +21,51 @@
 
 #include <cpu.h>
 #include <conout.h>
+#include <kevent.h>
+#include <kthread.h>
+#include "AbstractTimer.h"
 #include "panic.h"
+#include "smp.h"
+#include "AcpiTables.h"
 #include "phmem.h"
+#include "paging.h"
+#include "LocalApic.h"
+#include "idt.h"
 
 static void* g_endList = nullptr;
 void** RamAllocator::m_pEndList = &g_endList;
 
+struct RamAllocator::CpuPageCache
+{
+	size_t m_count;
+	void** m_pages[CpuPageCacheCapacity];
+};
+
+INTERRUPT_HANDLER(pageCacheDrainHandler, "")
+{
+	(void)state;
+	RamAllocator::getInstance().onCacheDrainRequest();
+	cpuFastEio();
+}
+
+struct RamAllocator::FreeBlock
+{
+	FreeBlock* m_next;
+	FreeBlock* m_prev;
+	size_t m_order;
+};
+
+struct RamAllocator::FreeExtent
+{
+	uintptr_t m_startPfn;
+	uintptr_t m_endPfn;
+};
+
+static inline uintptr_t blockPfn(const void* block)
+{
+	return (virtualToPhysInt(block) >> PAGE_SHIFT);
+}
+
 RamAllocator::RamAllocator()
 {
 	print(L"Initializing RAM pages... ");
@@ -34,56 +73,871 @@ RamAllocator::RamAllocator()
 	for (size_t idx = 0; idx < params.m_regions; idx++)
 	{
 		auto& region = params.m_physicalMemoryRegions[idx];
-		void** startPtr = physToVirtualInt<void*>(region.m_start);
-		void** ptr = startPtr;
-		const size_t regSize = region.m_end - region.m_start;
 		m_maxRamAddr = kmax(m_maxRamAddr, region.m_end);
-		m_avaibleRamSize += regSize;
-		size_t pageCnt = regSize / PAGE_SIZE;
-		if (pageCnt == 0)
-			continue;
+		m_avaibleRamSize += region.m_end - region.m_start;
+	}
+
+	// one bit per page marks heads of free blocks, one byte per 2 MiB block keeps its group;
+	// both are set up a 1 GiB section at a time as the section is first released
+	const uintptr_t pageCount = m_maxRamAddr >> PAGE_SHIFT;
+	const uintptr_t sectionCount = (pageCount + (uintptr_t(1) << SectionOrder) - 1) >> SectionOrder;
+	const size_t freeBlockMapSize = (sectionCount << SectionOrder) / 8;
+	const size_t groupsSize = sectionCount << (SectionOrder - PageBlockOrder);
+	// spare extents are used to split regions at NUMA node boundaries
+	const size_t extentsSize = (params.m_regions + MaxExtentSplits) * sizeof (FreeExtent);
+	const size_t mapSize = cpuAlignAddrHi(extentsSize + freeBlockMapSize + groupsSize + sectionCount * 2);
+	uintptr_t mapStart = 0;
+	for (size_t idx = 0; idx < params.m_regions; idx++)
+	{
+		auto& region = params.m_physicalMemoryRegions[idx];
+		if ((region.m_end - region.m_start) >= mapSize)
+		{
+			mapStart = region.m_start;
+			break;
+		}
+	}
+	if (mapStart == 0)
+		PANIC(L"No enough memory for RAM allocator map");
 
-		while (--pageCnt > 0)
+	uint8_t* map = physToVirtualInt<uint8_t>(mapStart);
+	m_extents = reinterpret_cast<FreeExtent*>(map);
+	m_freeBlockMap = reinterpret_cast<uint64_t*>(map + extentsSize);
+	m_pageBlockGroups = reinterpret_cast<PageGroup*>(map + extentsSize + freeBlockMapSize);
+	m_sectionReady = map + extentsSize + freeBlockMapSize + groupsSize;
+	m_sectionNodes = m_sectionReady + sectionCount;
+	m_sectionCount = sectionCount;
+	m_extentCapacity = params.m_regions + MaxExtentSplits;
+	kmemset(m_sectionReady, 0, sectionCount * 2);
+	for (size_t idx = 0; idx < params.m_regions; idx++)
+	{
+		auto& region = params.m_physicalMemoryRegions[idx];
+		const uintptr_t start = (region.m_start == mapStart) ? (mapStart + mapSize) : region.m_start;
+		if (start < region.m_end)
 		{
-			void** nextPtr = ptr + (PAGE_SIZE / sizeof (ptr));
-			*ptr = nextPtr;
-			ptr = nextPtr;
+			m_extents[m_extentCount++] = FreeExtent{start >> PAGE_SHIFT, region.m_end >> PAGE_SHIFT};
+			m_freePages.fetch_add((region.m_end - start) >> PAGE_SHIFT, std::memory_order_relaxed);
 		}
-		*ptr = m_header.m_head;
-		m_header.m_head = startPtr;
 	}
+	m_lowWatermark = kmax<size_t>(m_freePages.load(std::memory_order_relaxed) / 64, MinLowWatermark);
+	m_highWatermark = 2 * m_lowWatermark;
+	// the rest of RAM is handed to the buddy lists on demand
+	releasePendingSection(0);
 	println(L"OK (", (m_avaibleRamSize >> 20), L"MB)");
 }
 
-void* RamAllocator::allocPagePtr(bool memzero)
+RamAllocator::FreeBlock*& RamAllocator::freeList(uintptr_t pfn, unsigned int order)
+{
+	NodePool& pool = m_nodes[pfnNode(pfn)];
+	if (order >= PageBlockOrder)
+		return pool.m_pageBlockFreeLists[order - PageBlockOrder];
+
+	return pool.m_groupFreeLists[m_pageBlockGroups[pfn >> PageBlockOrder]][order];
+}
+
+bool RamAllocator::isFreeBlock(uintptr_t pfn, unsigned int order) const
+{
+	if (((pfn << PAGE_SHIFT) >= m_maxRamAddr) || (m_sectionReady[pfn >> SectionOrder] == 0))
+		return false;
+
+	if ((m_freeBlockMap[pfn / 64] & (uint64_t(1) << (pfn % 64))) == 0)
+		return false;
+
+	return (physToVirtualInt<FreeBlock>(pfn << PAGE_SHIFT)->m_order == order);
+}
+
+void RamAllocator::insertFreeBlock(uintptr_t pfn, unsigned int order)
+{
+	FreeBlock* block = physToVirtualInt<FreeBlock>(pfn << PAGE_SHIFT);
+	FreeBlock*& list = freeList(pfn, order);
+	block->m_order = order;
+	block->m_prev = nullptr;
+	block->m_next = list;
+	if (list != nullptr)
+		list->m_prev = block;
+	list = block;
+	m_freeBlockMap[pfn / 64] |= (uint64_t(1) << (pfn % 64));
+}
+
+void RamAllocator::removeFreeBlock(uintptr_t pfn, unsigned int order)
+{
+	FreeBlock* block = physToVirtualInt<FreeBlock>(pfn << PAGE_SHIFT);
+	if (block->m_prev != nullptr)
+		block->m_prev->m_next = block->m_next;
+	else
+		freeList(pfn, order) = block->m_next;
+	if (block->m_next != nullptr)
+		block->m_next->m_prev = block->m_prev;
+	m_freeBlockMap[pfn / 64] &= ~(uint64_t(1) << (pfn % 64));
+}
+
+void RamAllocator::releaseBlock(uintptr_t pfn, unsigned int order)
+{
+	for (; order < MaxPageOrder; ++order)
+	{
+		const uintptr_t buddyPfn = pfn ^ (uintptr_t(1) << order);
+		if (!isFreeBlock(buddyPfn, order))
+			break;
+
+		removeFreeBlock(buddyPfn, order);
+		pfn &= ~(uintptr_t(1) << order);
+	}
+	insertFreeBlock(pfn, order);
+}
+
+void RamAllocator::releaseRange(uintptr_t pfn, uintptr_t endPfn)
+{
+	while (pfn < endPfn)
+	{
+		unsigned int order = 0;
+		while ((order < MaxPageOrder) && ((pfn & ((uintptr_t(2) << order) - 1)) == 0) && ((pfn + (uintptr_t(2) << order)) <= endPfn))
+			++order;
+		releaseBlock(pfn, order);
+		pfn += (uintptr_t(1) << order);
+	}
+}
+
+void RamAllocator::prepareSection(uintptr_t section)
+{
+	if (m_sectionReady[section] != 0)
+		return;
+
+	const uintptr_t sectionPages = uintptr_t(1) << SectionOrder;
+	kmemset(&m_freeBlockMap[(section * sectionPages) / 64], 0, sectionPages / 8);
+	kmemset(&m_pageBlockGroups[(section * sectionPages) >> PageBlockOrder], 0, sectionPages >> PageBlockOrder);
+	m_sectionReady[section] = 1;
+}
+
+// called with the node pool lock held
+bool RamAllocator::releasePendingSection(unsigned int node)
+{
+	uintptr_t pfn = 0;
+	uintptr_t endPfn = 0;
+	{
+		klock_guard lock(m_extentSpin);
+		for (size_t idx = 0; idx < m_extentCount; ++idx)
+		{
+			FreeExtent& extent = m_extents[idx];
+			if ((extent.m_startPfn >= extent.m_endPfn) || (pfnNode(extent.m_startPfn) != node))
+				continue;
+
+			pfn = extent.m_startPfn;
+			endPfn = kmin(extent.m_endPfn, (pfn | ((uintptr_t(1) << SectionOrder) - 1)) + 1);
+			extent.m_startPfn = endPfn;
+			break;
+		}
+	}
+	if (pfn == endPfn)
+		return false;
+
+	prepareSection(pfn >> SectionOrder);
+	releaseRange(pfn, endPfn);
+	return true;
+}
+
+void RamAllocator::splitExtents()
+{
+	for (size_t idx = 0; idx < m_extentCount; ++idx)
+	{
+		FreeExtent& extent = m_extents[idx];
+		const unsigned int node = pfnNode(extent.m_startPfn);
+		uintptr_t section = (extent.m_startPfn >> SectionOrder) + 1;
+		for (; (section << SectionOrder) < extent.m_endPfn; ++section)
+		{
+			if (m_sectionNodes[section] != node)
+				break;
+		}
+		if ((section << SectionOrder) >= extent.m_endPfn)
+			continue;
+
+		if (m_extentCount == m_extentCapacity)
+		{
+			println(L"No spare RAM extents, NUMA placement may be remote");
+			return;
+		}
+		// the tail is checked again when the loop reaches it
+		m_extents[m_extentCount++] = FreeExtent{section << SectionOrder, extent.m_endPfn};
+		extent.m_endPfn = section << SectionOrder;
+	}
+}
+
+uintptr_t RamAllocator::splitBlock(uintptr_t pfn, unsigned int blockOrder, unsigned int order, PageGroup group)
+{
+	removeFreeBlock(pfn, blockOrder);
+	if ((blockOrder >= PageBlockOrder) && (order < PageBlockOrder))
+		m_pageBlockGroups[pfn >> PageBlockOrder] = group;
+	while (blockOrder > order)
+	{
+		--blockOrder;
+		insertFreeBlock(pfn + (uintptr_t(1) << blockOrder), blockOrder);
+	}
+	return (pfn << PAGE_SHIFT);
+}
+
+// called with the node pool lock held
+uintptr_t RamAllocator::allocNodeBlock(NodePool& pool, unsigned int node, unsigned int order, PageGroup group)
+{
+	for (unsigned int blockOrder = order; blockOrder < PageBlockOrder; ++blockOrder)
+	{
+		FreeBlock* block = pool.m_groupFreeLists[group][blockOrder];
+		if (block != nullptr)
+			return splitBlock(blockPfn(block), blockOrder, order, group);
+	}
+
+	do
+	{
+		for (unsigned int blockOrder = kmax<unsigned int>(order, PageBlockOrder); blockOrder <= MaxPageOrder; ++blockOrder)
+		{
+			FreeBlock* block = pool.m_pageBlockFreeLists[blockOrder - PageBlockOrder];
+			if (block != nullptr)
+				return splitBlock(blockPfn(block), blockOrder, order, group);
+		}
+	}
+	while (releasePendingSection(node));
+
+	// no whole 2 MiB blocks left: take the largest block of another group to mix them as little as possible
+	for (unsigned int blockOrder = PageBlockOrder; blockOrder-- > order; )
+	{
+		for (unsigned int otherGroup = 0; otherGroup < PageGroupCount; ++otherGroup)
+		{
+			FreeBlock* block = pool.m_groupFreeLists[otherGroup][blockOrder];
+			if ((otherGroup != group) && (block != nullptr))
+				return splitBlock(blockPfn(block), blockOrder, order, group);
+		}
+	}
+	return 0;
+}
+
+uintptr_t RamAllocator::allocBlock(unsigned int node, unsigned int order, PageGroup group)
+{
+	if (node >= m_nodeCount)
+		node = currentNode();
+
+	// a mixed page block on the own node is still cheaper than remote memory
+	CpuInterruptLockSave intLock;
+	for (unsigned int idx = 0; idx < m_nodeCount; ++idx)
+	{
+		const unsigned int candidate = m_nodeOrder[node][idx];
+		NodePool& pool = m_nodes[candidate];
+		klock_guard lock(pool.m_spin);
+		const uintptr_t addr = allocNodeBlock(pool, candidate, order, group);
+		if (addr != 0)
+		{
+			m_freePages.fetch_sub(size_t(1) << order, std::memory_order_relaxed);
+			return addr;
+		}
+	}
+	return 0;
+}
+
+size_t RamAllocator::allocBuddyPages(unsigned int node, void*** pages, size_t count)
+{
+	size_t result = 0;
+	if (count == BatchSize)
+	{
+		const uintptr_t addr = allocBlock(node, BatchOrder, PageGroupScattered);
+		if (addr != 0)
+		{
+			for (; result < BatchSize; ++result)
+				pages[result] = physToVirtualInt<void*>(addr + result * PAGE_SIZE);
+			return result;
+		}
+	}
+	for (; result < count; ++result)
+	{
+		const uintptr_t addr = allocBlock(node, 0, PageGroupScattered);
+		if (addr == 0)
+			break;
+
+		pages[result] = physToVirtualInt<void*>(addr);
+	}
+	return result;
+}
+
+void RamAllocator::freeBuddyPages(void*** pages, size_t count)
+{
+	CpuInterruptLockSave intLock;
+	size_t idx = 0;
+	while (idx < count)
+	{
+		const unsigned int node = pfnNode(blockPfn(pages[idx]));
+		klock_guard lock(m_nodes[node].m_spin);
+		for (; (idx < count) && (pfnNode(blockPfn(pages[idx])) == node); ++idx)
+			releaseBlock(blockPfn(pages[idx]), 0);
+	}
+	m_freePages.fetch_add(count, std::memory_order_relaxed);
+}
+
+void** RamAllocator::popPage(volatile RegionListHeader& list, size_t link)
 {
 	RegionListHeader header;
 	void** ret;
 	do
 	{
-		header.m_head = m_header.m_head;
-		header.m_refCnt = m_header.m_refCnt;
+		header.m_head = list.m_head;
+		header.m_refCnt = list.m_refCnt;
 		if (header.m_head == m_pEndList)
-			PANIC(L"No enough memory");
+			return nullptr;
 
 		ret = header.m_head;
 	}
-	while (!cpuInterlockedCompareExchange128(&m_header, header.m_refCnt + 1, *header.m_head, &header));
+	while (!cpuInterlockedCompareExchange128(&list, header.m_refCnt + 1, ret[link], &header));
+	return ret;
+}
+
+void RamAllocator::pushPages(volatile RegionListHeader& list, size_t link, void** first, void** last)
+{
+	RegionListHeader header;
+	do
+	{
+		header.m_head = list.m_head;
+		header.m_refCnt = list.m_refCnt;
+		last[link] = header.m_head;
+	}
+	while (!cpuInterlockedCompareExchange128(&list, header.m_refCnt + 1, first, &header));
+}
+
+void** RamAllocator::popZeroPage(unsigned int node)
+{
+	NodePool& pool = m_nodes[node];
+	void** page = popPage(pool.m_zeroHeader, PageLink);
+	if (page != nullptr)
+	{
+		pool.m_zeroPages.fetch_sub(1, std::memory_order_relaxed);
+		page[PageLink] = nullptr;
+	}
+	return page;
+}
+
+void** RamAllocator::allocGlobalPage()
+{
+	void** page = popPage(m_header, PageLink);
+	if (page != nullptr)
+		return page;
+
+	page = popPage(m_batchHeader, BatchLink);
+	if (page == nullptr)
+	{
+		if (allocBuddyPages(currentNode(), &page, 1) != 0)
+			return page;
+
+		return popZeroPage(currentNode());
+	}
+
+	// break the batch: the first page is returned, the rest goes to the single pages list
+	m_depotBatches.fetch_sub(1, std::memory_order_relaxed);
+	void** first = static_cast<void**>(page[PageLink]);
+	void** last = first;
+	for (size_t idx = 2; idx < BatchSize; ++idx)
+		last = static_cast<void**>(last[PageLink]);
+	pushPages(m_header, PageLink, first, last);
+	return page;
+}
+
+bool RamAllocator::refillCpuCache(CpuPageCache* cache)
+{
+	void** page = popPage(m_batchHeader, BatchLink);
+	if (page != nullptr)
+	{
+		m_depotBatches.fetch_sub(1, std::memory_order_relaxed);
+		for (size_t idx = 0; idx < BatchSize; ++idx)
+		{
+			cache->m_pages[cache->m_count++] = page;
+			page = static_cast<void**>(page[PageLink]);
+		}
+		return true;
+	}
+
+	cache->m_count += allocBuddyPages(currentNode(), &cache->m_pages[cache->m_count], BatchSize);
+	while (cache->m_count < BatchSize)
+	{
+		page = popPage(m_header, PageLink);
+		if (page == nullptr)
+			break;
+
+		cache->m_pages[cache->m_count++] = page;
+	}
+	return (cache->m_count > 0);
+}
+
+void RamAllocator::drainCpuCache(CpuPageCache* cache)
+{
+	cache->m_count -= BatchSize;
+	void*** pages = &cache->m_pages[cache->m_count];
+	if ((m_depotBatches.load(std::memory_order_relaxed) >= MaxDepotBatches) || (m_nodeCount > 1))
+	{
+		// the depot is full or not node aware: return pages to the buddy lists so they can coalesce again
+		freeBuddyPages(pages, BatchSize);
+		return;
+	}
+
+	for (size_t idx = 1; idx < BatchSize; ++idx)
+		pages[idx - 1][PageLink] = pages[idx];
+	pages[BatchSize - 1][PageLink] = m_pEndList;
+	pushPages(m_batchHeader, BatchLink, pages[0], pages[0]);
+	m_depotBatches.fetch_add(1, std::memory_order_relaxed);
+}
+
+RamAllocator::CpuPageCache* RamAllocator::localCpuCache() const
+{
+	if (!m_cpuCacheReady)
+		return nullptr;
+
+	return static_cast<CpuPageCache*>(cpuGetLocalPtr(LOCAL_CPU_PAGE_CACHE));
+}
+
+void RamAllocator::initCurrentCpu()
+{
+	static_assert(sizeof (CpuPageCache) <= PAGE_SIZE);
+	CpuPageCache* cache = reinterpret_cast<CpuPageCache*>(allocGlobalPage());
+	if (cache == nullptr)
+		PANIC(L"No enough memory");
+
+	cache->m_count = 0;
+	cpuSetLocalPtr(LOCAL_CPU_PAGE_CACHE, cache);
+	SystemIDT::setHandler(CPU_PAGE_CACHE_DRAIN_VECTOR, &pageCacheDrainHandler, true);
+	m_cpuCacheReady = true;
+}
+
+void* RamAllocator::allocPagesPtr(unsigned int order, bool memzero)
+{
+	return allocPagesPtrOnNode(currentNode(), order, memzero);
+}
+
+void* RamAllocator::allocPagesPtrOnNode(unsigned int node, unsigned int order, bool memzero)
+{
+	PagingManager64::probeStack();
+	if (order > MaxPageOrder)
+		return nullptr;
+
+	const PageGroup group = (order == 0) ? PageGroupScattered : PageGroupContiguous;
+	uintptr_t addr = allocBlock(node, order, group);
+	if ((addr == 0) && canReclaim() && (reclaim(size_t(1) << order) != 0))
+		addr = allocBlock(node, order, group);
+	if (addr == 0)
+		return nullptr;
+
+	checkWatermark();
+	void* ret = physToVirtualInt<void>(addr);
+	if (memzero)
+		kmemset(ret, 0, PAGE_SIZE << order);
+	return ret;
+}
+
+void RamAllocator::freePagesPtr(void* addr, unsigned int order)
+{
+	PagingManager64::probeStack();
+	const uintptr_t pfn = blockPfn(addr);
+	{
+		CpuInterruptLockSave intLock;
+		klock_guard lock(m_nodes[pfnNode(pfn)].m_spin);
+		releaseBlock(pfn, order);
+	}
+	m_freePages.fetch_add(size_t(1) << order, std::memory_order_relaxed);
+}
+
+bool RamAllocator::zeroIdlePage()
+{
+	if (m_nodes[currentNode()].m_zeroPages.load(std::memory_order_relaxed) >= ZeroPoolSize)
+		return false;
+
+	// the pool is not refilled under memory pressure
+	if (m_freePages.load(std::memory_order_relaxed) < m_highWatermark)
+		return false;
+
+	void** page = static_cast<void**>(tryAllocPagePtr(false));
+	if (page == nullptr)
+		return false;
+
+	cpuZeroMemoryNonTemporal(page, PAGE_SIZE);
+	NodePool& pool = m_nodes[pfnNode(blockPfn(page))];
+	pushPages(pool.m_zeroHeader, PageLink, page, page);
+	pool.m_zeroPages.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void* RamAllocator::allocPagePtr(bool memzero)
+{
+	void* ret = tryAllocPagePtr(memzero);
+	if (ret == nullptr)
+		PANIC(L"No enough memory");
+	return ret;
+}
+
+void* RamAllocator::tryAllocPagePtr(bool memzero)
+{
+	PagingManager64::probeStack();
+	if (memzero)
+	{
+		void** page = popZeroPage(currentNode());
+		if (page != nullptr)
+			return static_cast<void*>(page);
+	}
+
+	void** ret = nullptr;
+	for (bool reclaimed = false; ; reclaimed = true)
+	{
+		{
+			CpuInterruptLockSave intLock;
+			CpuPageCache* cache = localCpuCache();
+			if ((cache != nullptr) && ((cache->m_count > 0) || refillCpuCache(cache)))
+				ret = cache->m_pages[--cache->m_count];
+		}
+		if (ret == nullptr)
+			ret = allocGlobalPage();
+		if ((ret != nullptr) || reclaimed || !canReclaim() || (reclaim(BatchSize) == 0))
+			break;
+	}
+	if (ret == nullptr)
+		return nullptr;
+
+	checkWatermark();
 	if (memzero)
 		kmemset(ret, 0, PAGE_SIZE);
 	return static_cast<void*>(ret);
 }
 
+size_t RamAllocator::allocPagesBatch(void** pages, size_t count, bool memzero)
+{
+	PagingManager64::probeStack();
+	size_t allocated = 0;
+	if (memzero)
+	{
+		const unsigned int node = currentNode();
+		for (; allocated < count; ++allocated)
+		{
+			void** page = popZeroPage(node);
+			if (page == nullptr)
+				break;
+
+			pages[allocated] = page;
+		}
+	}
+
+	const size_t zeroed = allocated;
+	{
+		// one pass over the CPU cache for the whole batch
+		CpuInterruptLockSave intLock;
+		CpuPageCache* cache = localCpuCache();
+		if (cache != nullptr)
+		{
+			while ((allocated < count) && ((cache->m_count > 0) || refillCpuCache(cache)))
+				pages[allocated++] = cache->m_pages[--cache->m_count];
+		}
+	}
+	for (bool reclaimed = false; ; reclaimed = true)
+	{
+		for (; allocated < count; ++allocated)
+		{
+			void** page = allocGlobalPage();
+			if (page == nullptr)
+				break;
+
+			pages[allocated] = page;
+		}
+		if ((allocated == count) || reclaimed || !canReclaim() || (reclaim(count - allocated) == 0))
+			break;
+	}
+	checkWatermark();
+	if (memzero)
+	{
+		for (size_t idx = zeroed; idx < allocated; ++idx)
+			kmemset(pages[idx], 0, PAGE_SIZE);
+	}
+	return allocated;
+}
+
 void RamAllocator::freePagePtr(void* addr)
 {
-	RegionListHeader header;
-	do
+	PagingManager64::probeStack();
+	void** page = static_cast<void**>(addr);
+	if ((m_nodeCount > 1) && (pfnNode(blockPfn(page)) != currentNode()))
 	{
-		header.m_head = m_header.m_head;
-		header.m_refCnt = m_header.m_refCnt;
-		*static_cast<void**>(addr) = header.m_head;
+		// remote pages go home instead of the local cache
+		freeBuddyPages(&page, 1);
+		return;
+	}
+
+	{
+		CpuInterruptLockSave intLock;
+		CpuPageCache* cache = localCpuCache();
+		if (cache != nullptr)
+		{
+			if (cache->m_count == CpuPageCacheCapacity)
+				drainCpuCache(cache);
+			cache->m_pages[cache->m_count++] = page;
+			return;
+		}
 	}
-	while (!cpuInterlockedCompareExchange128(&m_header, header.m_refCnt + 1, addr, &header));
+	pushPages(m_header, PageLink, page, page);
+}
+
+size_t RamAllocator::shrinkCaches(size_t pages)
+{
+	// cached free pages go back to the buddy lists, the depot before the pre-zeroed pools
+	size_t released = 0;
+	void** batch[BatchSize];
+	while (released < pages)
+	{
+		size_t count = 0;
+		void** page = popPage(m_batchHeader, BatchLink);
+		if (page != nullptr)
+		{
+			m_depotBatches.fetch_sub(1, std::memory_order_relaxed);
+			for (; count < BatchSize; ++count)
+			{
+				batch[count] = page;
+				page = static_cast<void**>(page[PageLink]);
+			}
+		}
+		for (; count < BatchSize; ++count)
+		{
+			page = popPage(m_header, PageLink);
+			if (page == nullptr)
+				break;
+
+			batch[count] = page;
+		}
+		for (unsigned int node = 0; (node < m_nodeCount) && (count < BatchSize); )
+		{
+			page = popZeroPage(node);
+			if (page != nullptr)
+				batch[count++] = page;
+			else
+				++node;
+		}
+		if (count == 0)
+			break;
+
+		freeBuddyPages(batch, count);
+		released += count;
+	}
+	return released;
+}
+
+// the caches of other CPUs are only touched by their owners, so they are asked to drain and waited for;
+// called with the shrinker mutex held
+size_t RamAllocator::drainRemoteCpuCaches()
+{
+	const unsigned int numCpu = cpuLogicalCount();
+	if (!m_cpuCacheReady || (numCpu == 1))
+		return 0;
+
+	const unsigned int curCpuId = cpuCurrentId();
+	LocalApic& apic = LocalApic::system();
+	m_drainedCachePages.store(0, std::memory_order_relaxed);
+	m_pendingCacheDrains.store(numCpu - 1, std::memory_order_release);
+	for (unsigned int cpuId = 0; cpuId < numCpu; ++cpuId)
+	{
+		if (cpuId != curCpuId)
+			apic.sendIpi(LocalApic::systemCpuIdToApic(cpuId), CPU_PAGE_CACHE_DRAIN_VECTOR);
+	}
+	while (m_pendingCacheDrains.load(std::memory_order_acquire) != 0)
+		cpuPause();
+	return m_drainedCachePages.load(std::memory_order_relaxed);
+}
+
+void RamAllocator::onCacheDrainRequest()
+{
+	CpuPageCache* cache = localCpuCache();
+	if ((cache != nullptr) && (cache->m_count != 0))
+	{
+		freeBuddyPages(cache->m_pages, cache->m_count);
+		m_drainedCachePages.fetch_add(cache->m_count, std::memory_order_relaxed);
+		cache->m_count = 0;
+	}
+	m_pendingCacheDrains.fetch_sub(1, std::memory_order_release);
+}
+
+size_t RamAllocator::reclaim(size_t pages)
+{
+	size_t released = shrinkCaches(pages);
+	// a reclaim already in progress on another thread is as good as this one
+	if ((released >= pages) || !m_shrinkerMutex.try_lock())
+		return released;
+
+	for (RamShrinker* shrinker = m_shrinkers; (shrinker != nullptr) && (released < pages); shrinker = shrinker->m_next)
+		released += shrinker->shrink(pages - released);
+	if (released < pages)
+		released += drainRemoteCpuCaches();
+	m_shrinkerMutex.unlock();
+	return released;
+}
+
+void RamAllocator::registerShrinker(RamShrinker* shrinker, unsigned int priority)
+{
+	klock_guard lock(m_shrinkerMutex);
+	shrinker->m_priority = priority;
+	RamShrinker** link = &m_shrinkers;
+	while ((*link != nullptr) && ((*link)->m_priority <= priority))
+		link = &(*link)->m_next;
+	shrinker->m_next = *link;
+	*link = shrinker;
+}
+
+void RamAllocator::unregisterShrinker(RamShrinker* shrinker)
+{
+	klock_guard lock(m_shrinkerMutex);
+	for (RamShrinker** link = &m_shrinkers; *link != nullptr; link = &(*link)->m_next)
+	{
+		if (*link == shrinker)
+		{
+			*link = shrinker->m_next;
+			break;
+		}
+	}
+}
+
+bool RamAllocator::canReclaim() const
+{
+	// shrinkers may sleep: not from interrupt handlers or under spin locks
+	return (m_reclaimEvent != nullptr) && ((cpuGetFlagsRegister() & 0x200) != 0) && (cpuGetLocalData(LOCAL_CPU_MT_LOCK_COUNT) == 0);
+}
+
+void RamAllocator::checkWatermark()
+{
+	if ((m_freePages.load(std::memory_order_relaxed) < m_lowWatermark) && canReclaim())
+		m_reclaimEvent->set();
+}
+
+void RamAllocator::startReclaimThread()
+{
+	if (m_reclaimThread != nullptr)
+		return;
+
+	m_reclaimEvent = new kevent(false, false);
+	m_reclaimThread = new kthread(std::bind(&RamAllocator::reclaimThreadProc, this));
+}
+
+void RamAllocator::reclaimThreadProc()
+{
+	// allocations with interrupts disabled can't wake the thread, so it also polls
+	const TimePoint interval = AbstractTimer::system()->fromMilliseconds(ReclaimIntervalMs);
+	for ( ; ; )
+	{
+		m_reclaimEvent->wait(interval);
+		const size_t freePages = m_freePages.load(std::memory_order_relaxed);
+		if (freePages < m_lowWatermark)
+			reclaim(m_highWatermark - freePages);
+	}
+}
+
+void RamAllocator::releaseBootMemory()
+{
+	// the region list lives in loader memory that is released below
+	const auto& params = getKernelParams()->m_physicalMemory;
+	const kvector<KernelParams::PhysicalMemory::BootMemoryRegion> regions(params.m_bootRegions,
+		params.m_bootRegions + params.m_bootRegionCount);
+	const uintptr_t maxPfn = m_maxRamAddr >> PAGE_SHIFT;
+	size_t releasedPages = 0;
+	PagingManager64::probeStack();
+	for (const auto& region : regions)
+	{
+		if (region.m_type == BootMemoryType::Kernel)
+			continue;
+
+		uintptr_t pfn = region.m_start >> PAGE_SHIFT;
+		const uintptr_t endPfn = kmin(region.m_end >> PAGE_SHIFT, maxPfn);
+		while (pfn < endPfn)
+		{
+			const uintptr_t sectionEndPfn = kmin(endPfn, (pfn | ((uintptr_t(1) << SectionOrder) - 1)) + 1);
+			{
+				CpuInterruptLockSave intLock;
+				klock_guard lock(m_nodes[pfnNode(pfn)].m_spin);
+				prepareSection(pfn >> SectionOrder);
+				releaseRange(pfn, sectionEndPfn);
+			}
+			releasedPages += sectionEndPfn - pfn;
+			pfn = sectionEndPfn;
+		}
+	}
+	m_avaibleRamSize += releasedPages << PAGE_SHIFT;
+	m_freePages.fetch_add(releasedPages, std::memory_order_relaxed);
+	println(L"Reclaimed boot memory: ", (releasedPages << PAGE_SHIFT) >> 10, L" KB");
+}
+
+unsigned int RamAllocator::pageNode(uintptr_t addr) const
+{
+	if (addr >= m_maxRamAddr)
+		return 0;
+
+	return pfnNode(addr >> PAGE_SHIFT);
+}
+
+unsigned int RamAllocator::currentNode()
+{
+	return static_cast<unsigned int>(cpuGetLocalData(LOCAL_CPU_NUMA_NODE));
+}
+
+void RamAllocator::initNuma()
+{
+	const AcpiTables& acpi = AcpiTables::instance();
+	const unsigned int nodeCount = acpi.numaNodeCount();
+	if (nodeCount == 1)
+		return;
+
+	// nodes ordered by SLIT distance for fallback allocations
+	for (unsigned int node = 0; node < nodeCount; ++node)
+	{
+		uint8_t* order = m_nodeOrder[node];
+		for (unsigned int idx = 0; idx < nodeCount; ++idx)
+		{
+			unsigned int pos = idx;
+			for (; (pos > 0) && (acpi.numaDistance(node, order[pos - 1]) > acpi.numaDistance(node, idx)); --pos)
+				order[pos] = order[pos - 1];
+			order[pos] = static_cast<uint8_t>(idx);
+		}
+	}
+
+	CpuInterruptLockSave intLock;
+	NodePool& bootPool = m_nodes[0];
+	klock_guard lock(bootPool.m_spin);
+	klock_guard extentLock(m_extentSpin);
+	for (uintptr_t section = 0; section < m_sectionCount; ++section)
+	{
+		const uintptr_t start = section << (SectionOrder + PAGE_SHIFT);
+		const uintptr_t end = start + (uintptr_t(1) << (SectionOrder + PAGE_SHIFT));
+		for (const AcpiTables::NumaMemoryRange& range : acpi.numaMemoryRanges())
+		{
+			if ((range.m_start < end) && (range.m_end > start))
+			{
+				m_sectionNodes[section] = static_cast<uint8_t>(range.m_node);
+				break;
+			}
+		}
+	}
+
+	// everything released so far sits in the node 0 lists
+	auto rehome = [this](FreeBlock*& list) {
+		FreeBlock* block = list;
+		while (block != nullptr)
+		{
+			FreeBlock* next = block->m_next;
+			const uintptr_t pfn = blockPfn(block);
+			if (pfnNode(pfn) != 0)
+			{
+				if (block->m_prev != nullptr)
+					block->m_prev->m_next = next;
+				else
+					list = next;
+				if (next != nullptr)
+					next->m_prev = block->m_prev;
+				insertFreeBlock(pfn, static_cast<unsigned int>(block->m_order));
+			}
+			block = next;
+		}
+	};
+	for (auto& groupLists : bootPool.m_groupFreeLists)
+	{
+		for (FreeBlock*& list : groupLists)
+			rehome(list);
+	}
+	for (FreeBlock*& list : bootPool.m_pageBlockFreeLists)
+		rehome(list);
+
+	splitExtents();
+	m_nodeCount = nodeCount;
+	cpuSetLocalData(LOCAL_CPU_NUMA_NODE, acpi.apicNumaNode(LocalApic::getCpuId()));
+	println(L"NUMA nodes: ", nodeCount);
 }
 
 RamAllocator& RamAllocator::getInstance()
@@ -21,13 +21,61 @@
 
 #pragma once
 #include <common_types.h>
+#include <cpu.h>
 #include <vmem_utils.h>
+#include <kmutex.h>
+#include "SpinLock.h"
+
+class kevent;
+class kthread;
+
+// Gives cached memory back to the RAM allocator when free pages run low.
+// Called from thread context with the allocator unlocked.
+class RamShrinker
+{
+public:
+	// releases up to the requested number of pages, returns how many were released
+	virtual size_t shrink(size_t pages) = 0;
+
+private:
+	RamShrinker* m_next = nullptr;
+	unsigned int m_priority = 0;
+
+	friend class RamAllocator;
+};
 
 class RamAllocator
 {
+public:
+	enum : unsigned int
+	{
+		PageOrder2M = 9,
+		PageOrder1G = 18,
+		MaxPageOrder = PageOrder1G
+	};
+
 public:
 	void* allocPagePtr(bool memzero);
+	void* tryAllocPagePtr(bool memzero);
 	void freePagePtr(void* addr);
+	void* allocPagesPtr(unsigned int order, bool memzero);
+	void* allocPagesPtrOnNode(unsigned int node, unsigned int order, bool memzero);
+	size_t allocPagesBatch(void** pages, size_t count, bool memzero);
+	void freePagesPtr(void* addr, unsigned int order);
+	void initCurrentCpu();
+	void initNuma();
+	bool zeroIdlePage();
+	// shrinkers with lower priority values are asked first
+	void registerShrinker(RamShrinker* shrinker, unsigned int priority);
+	void unregisterShrinker(RamShrinker* shrinker);
+	size_t reclaim(size_t pages);
+	// called on a CPU asked to give its cached pages back
+	void onCacheDrainRequest();
+	void startReclaimThread();
+	// returns loader data, boot modules and low memory once startup is done
+	void releaseBootMemory();
+	unsigned int pageNode(uintptr_t addr) const;
+	static unsigned int currentNode();
 	static RamAllocator& getInstance();
 
 	uintptr_t allocPage(bool memzero)
@@ -35,11 +83,40 @@ public:
 		return virtualToPhysInt(allocPagePtr(memzero));
 	}
 
+	uintptr_t tryAllocPage(bool memzero)
+	{
+		void* ptr = tryAllocPagePtr(memzero);
+		return (ptr != nullptr) ? virtualToPhysInt(ptr) : 0;
+	}
+
 	void freePage(uintptr_t addr)
 	{
 		return freePagePtr(physToVirtualInt<void>(addr));
 	}
 
+	uintptr_t allocPages(unsigned int order, bool memzero)
+	{
+		void* ptr = allocPagesPtr(order, memzero);
+		return (ptr != nullptr) ? virtualToPhysInt(ptr) : 0;
+	}
+
+	// falls back to the nearest node with free memory
+	uintptr_t allocPagesOnNode(unsigned int node, unsigned int order, bool memzero)
+	{
+		void* ptr = allocPagesPtrOnNode(node, order, memzero);
+		return (ptr != nullptr) ? virtualToPhysInt(ptr) : 0;
+	}
+
+	uintptr_t allocPageOnNode(unsigned int node, bool memzero)
+	{
+		return allocPagesOnNode(node, 0, memzero);
+	}
+
+	void freePages(uintptr_t addr, unsigned int order)
+	{
+		return freePagesPtr(physToVirtualInt<void>(addr), order);
+	}
+
 	template<typename T>
 	T* allocPagePtrCast(bool memzero)
 	{
@@ -56,6 +133,17 @@ public:
 		return m_maxRamAddr;
 	}
 
+	unsigned int nodeCount() const
+	{
+		return m_nodeCount;
+	}
+
+	// pages in the buddy lists and not yet released sections
+	size_t freePageCount() const
+	{
+		return m_freePages.load(std::memory_order_relaxed);
+	}
+
 private:
 	RamAllocator();
 	RamAllocator(const RamAllocator&) = delete;
@@ -66,11 +154,108 @@ private:
 	{
 		void** m_head;
 		uintptr_t m_refCnt;
+	};
+	struct CpuPageCache;
+	struct FreeBlock;
+	struct FreeExtent;
+
+	enum : size_t
+	{
+		PageLink = 0,
+		BatchLink = 1,
+		BatchOrder = 6,
+		BatchSize = 1 << BatchOrder,
+		CpuPageCacheCapacity = BatchSize * 4,
+		MaxDepotBatches = 64,
+		ZeroPoolSize = 2048,
+		MaxExtentSplits = 64,
+		MinLowWatermark = 256,
+		ReclaimIntervalMs = 100
+	};
+
+	enum PageGroup : uint8_t
+	{
+		PageGroupScattered = 0,
+		PageGroupContiguous,
+		PageGroupCount
+	};
+
+	enum : unsigned int
+	{
+		PageBlockOrder = PageOrder2M,
+		SectionOrder = MaxPageOrder
+	};
+
+	struct NodePool
+	{
+		alignas(64) volatile RegionListHeader m_zeroHeader{ m_pEndList, 0};
+		std::atomic<size_t> m_zeroPages{0};
+		QueuedSpinLockSm m_spin;
+		FreeBlock* m_groupFreeLists[PageGroupCount][PageBlockOrder] = {};
+		FreeBlock* m_pageBlockFreeLists[MaxPageOrder - PageBlockOrder + 1] = {};
+	};
+
+	void** popPage(volatile RegionListHeader& list, size_t link);
+	void pushPages(volatile RegionListHeader& list, size_t link, void** first, void** last);
+	void** allocGlobalPage();
+	void** popZeroPage(unsigned int node);
+	bool refillCpuCache(CpuPageCache* cache);
+	void drainCpuCache(CpuPageCache* cache);
+	CpuPageCache* localCpuCache() const;
+	size_t allocBuddyPages(unsigned int node, void*** pages, size_t count);
+	void freeBuddyPages(void*** pages, size_t count);
+	FreeBlock*& freeList(uintptr_t pfn, unsigned int order);
+	bool isFreeBlock(uintptr_t pfn, unsigned int order) const;
+	void insertFreeBlock(uintptr_t pfn, unsigned int order);
+	void removeFreeBlock(uintptr_t pfn, unsigned int order);
+	void releaseBlock(uintptr_t pfn, unsigned int order);
+	void releaseRange(uintptr_t pfn, uintptr_t endPfn);
+	void prepareSection(uintptr_t section);
+	bool releasePendingSection(unsigned int node);
+	void splitExtents();
+	uintptr_t splitBlock(uintptr_t pfn, unsigned int blockOrder, unsigned int order, PageGroup group);
+	uintptr_t allocNodeBlock(NodePool& pool, unsigned int node, unsigned int order, PageGroup group);
+	uintptr_t allocBlock(unsigned int node, unsigned int order, PageGroup group);
+	size_t shrinkCaches(size_t pages);
+	size_t drainRemoteCpuCaches();
+	bool canReclaim() const;
+	void checkWatermark();
+	void reclaimThreadProc();
+
+	unsigned int pfnNode(uintptr_t pfn) const
+	{
+		return m_sectionNodes[pfn >> SectionOrder];
 	}
-	volatile m_header{ m_pEndList, 0};
+
+private:
+	alignas(64) volatile RegionListHeader m_header{ m_pEndList, 0};
+	alignas(64) volatile RegionListHeader m_batchHeader{ m_pEndList, 0};
 	static_assert((sizeof (m_header) == 2 * sizeof (uintptr_t)), "size of RegionListHeader is incorrect");
+	std::atomic<size_t> m_depotBatches{0};
 	size_t m_avaibleRamSize = 0;
 	uintptr_t m_maxRamAddr = 0;
+	bool m_cpuCacheReady = false;
+	uint64_t* m_freeBlockMap = nullptr;
+	PageGroup* m_pageBlockGroups = nullptr;
+	uint8_t* m_sectionReady = nullptr;
+	uint8_t* m_sectionNodes = nullptr;
+	uintptr_t m_sectionCount = 0;
+	QueuedSpinLockSm m_extentSpin;
+	FreeExtent* m_extents = nullptr;
+	size_t m_extentCount = 0;
+	size_t m_extentCapacity = 0;
+	NodePool m_nodes[MAX_NUMA_NODES];
+	unsigned int m_nodeCount = 1;
+	uint8_t m_nodeOrder[MAX_NUMA_NODES][MAX_NUMA_NODES] = {};
+	std::atomic<size_t> m_freePages{0};
+	size_t m_lowWatermark = MinLowWatermark;
+	size_t m_highWatermark = 2 * MinLowWatermark;
+	RamShrinker* m_shrinkers = nullptr;
+	kmutex m_shrinkerMutex;
+	std::atomic<unsigned int> m_pendingCacheDrains{0};
+	std::atomic<size_t> m_drainedCachePages{0};
+	kevent* m_reclaimEvent = nullptr;
+	kthread* m_reclaimThread = nullptr;
 
 private:
 	static void** m_pEndList;
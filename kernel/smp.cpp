@@ -32,6 +32,8 @@
 #include "idt.h"
 #include "TaskManager.h"
 #include "Task.h"
+#include "phmem.h"
+#include "SlabAllocator.h"
 #include "smp.h"
 
 static bool g_smpInit = false;
@@ -66,7 +68,7 @@ bool SystemSMP::isInit()
 void SystemSMP::initBootCpu()
 {
 	static uint8_t bootCpuLocalData[LOCAL_CPU_DATA_SIZE] alignas(16) = {};
-	static uint8_t bootCpuLocalSpinData[PAGE_SIZE] alignas(16) = {};
+	static uint8_t bootCpuLocalSpinData[PAGE_SIZE] alignas(CPU_CACHE_LINE_SIZE) = {};
 	initCpu(BOOT_CPU_ID, bootCpuLocalData, bootCpuLocalSpinData);
 }
 
@@ -80,6 +82,8 @@ void SystemSMP::initCpu(unsigned int cpuId, void* localCpuData, void* localCpuSp
 	kmemcpy(curCpuData + LOCAL_CPU_SPIN_DATA, &localCpuSpinsData, sizeof(localCpuSpinsData));
 	cpuWriteMSR(CPU_MSR_FS_BASE, reinterpret_cast<uintptr_t>(curCpuData));
 	initSpinDataOnCurrentCpu();
+	RamAllocator::getInstance().initCurrentCpu();
+	SlabAllocator::system().initCurrentCpu();
 }
 
 void SystemSMP::init()
@@ -117,12 +121,18 @@ void SystemSMP::init()
 		print(L"Initializing CPU[", cpuCnt, L", APIC_ID = ", apicId, L"]... ");
 		SystemTaskSegmentState* tss = new SystemTaskSegmentState();
 		kmemset(tss, 0, sizeof(*tss));
-		void* localCpuData = vmm.alloc(LOCAL_CPU_DATA_SIZE, VMM_READWRITE | VMM_COMMIT);
+		const uintptr_t numaNode = AcpiTables::instance().apicNumaNode(apicId);
+		void* localCpuData = vmm.alloc(LOCAL_CPU_DATA_SIZE, VMM_READWRITE | VMM_COMMIT | vmmNumaNode(numaNode));
 		kmemset(localCpuData, 0, LOCAL_CPU_DATA_SIZE);
-		void* localCpuSpinsData = vmm.alloc(PAGE_SIZE, VMM_READWRITE | VMM_COMMIT);
+		kmemcpy(static_cast<uint8_t*>(localCpuData) + LOCAL_CPU_NUMA_NODE, &numaNode, sizeof(numaNode));
+		void* localCpuSpinsData = vmm.alloc(PAGE_SIZE, VMM_READWRITE | VMM_COMMIT | vmmNumaNode(numaNode));
 		kmemset(localCpuSpinsData, 0, PAGE_SIZE);
+		SystemGDT::initExceptionStack(*tss, vmm.alloc(SYSTEM_EXCEPTION_STACK_SIZE, VMM_READWRITE | VMM_COMMIT | vmmNumaNode(numaNode)));
 		kthread th(std::bind(&cpuInitProc, cpuCnt, localCpuData, localCpuSpinsData, tss, &th, std::ref(mtrr)), false);
 		Task* task = TaskManager::extractTask(th);
+		// the AP runs on this stack before its IDT is loaded
+		for (uintptr_t page = reinterpret_cast<uintptr_t>(task->m_systemStack); page < task->m_stackTop; page += PAGE_SIZE)
+			*reinterpret_cast<volatile uint8_t*>(page) = 0;
 		const InterruptVolatileState& vstate = reinterpret_cast<InterruptFullState*>(task->m_stackTop)->m_volatile;
 		const uintptr_t rip = vstate.m_frame.m_rip;
 		kmemcpy(reinterpret_cast<void*>(SMP_BOOT_ENTRY_POINT), &rip, sizeof(rip));
@@ -41,6 +41,12 @@ enum : uint64_t
 	LOCAL_CPU_NEED_TASK_SWITCH = LOCAL_CPU_NEED_TASK_SWITCH_MACRO,
 	LOCAL_CPU_TLB_TASK = 0x58,
 	LOCAL_CPU_APIC_EOI_ADDR = LOCAL_CPU_APIC_EOI_ADDR_MACRO,
+	LOCAL_CPU_PAGE_CACHE = 0x068,
+	LOCAL_CPU_SLAB_CACHE = 0x070,
+	LOCAL_CPU_NUMA_NODE = 0x078,
+	LOCAL_CPU_TIMER_DEADLINE = 0x080,
+	LOCAL_CPU_FAULT_NEXT_PAGE = 0x088,
+	LOCAL_CPU_FAULT_AROUND_PAGES = 0x090,
 	LOCAL_CPU_DATA_SIZE = PAGE_SIZE
 };
 
@@ -26,18 +26,24 @@
 #include <cpu.h>
 #include <VirtualMemoryManager.h>
 #include <kvector.h>
+#include <kstring.h>
+#include <kmemory.h>
 #include <klist.h>
 #include <kthread.h>
 #include <kevent.h>
 #include <kmutex.h>
 #include <kcondition_variable.h>
+#include <ktimer.h>
 #include <kunordered_map.h>
 #include <ThreadPool.h>
 #include <AbstractDevice.h>
 #include <AbstractDriver.h>
 #include "phmem.h"
+#include "paging.h"
 #include "common_lib.h"
 #include "Heap.h"
+#include "Process.h"
+#include "TaskManager.h"
 #include "AbstractTimer.h"
 #include "Semaphore.h"
 
@@ -102,6 +108,179 @@ DEF_TEST(ramPagesTest)
 	}
 }
 
+DEF_TEST(ramZeroPagesTest)
+{
+	const int max = 256;
+	uint64_t* pages[max] = {};
+	RamAllocator& allocator = RamAllocator::getInstance();
+	for (int pass = 0; pass < 4; ++pass)
+	{
+		for (int i = 0; i < max; ++i)
+		{
+			pages[i] = allocator.allocPagePtrCast<uint64_t>(true);
+			for (size_t j = 0; j < (PAGE_SIZE / sizeof (uint64_t)); ++j)
+				ASSERT(pages[i][j] == 0);
+			kmemset(pages[i], 0x5A, PAGE_SIZE);
+		}
+		for (int i = 0; i < max; ++i)
+			allocator.freePagePtr(pages[i]);
+		sleepMs(20);
+	}
+}
+
+DEF_TEST(ramContiguousPagesTest)
+{
+	RamAllocator& allocator = RamAllocator::getInstance();
+	const unsigned int orders[] = {0, 1, 3, 6, RamAllocator::PageOrder2M, 4, RamAllocator::PageOrder2M + 1, 2};
+	const size_t count = sizeof (orders) / sizeof (orders[0]);
+	uintptr_t blocks[count] = {};
+	for (size_t i = 0; i < count; ++i)
+	{
+		const size_t size = PAGE_SIZE << orders[i];
+		const uintptr_t block = allocator.allocPages(orders[i], false);
+		ASSERT(block != 0);
+		ASSERT((block & (size - 1)) == 0);
+		for (size_t j = 0; j < i; ++j)
+			ASSERT((block + size <= blocks[j]) || (block >= blocks[j] + (PAGE_SIZE << orders[j])));
+		blocks[i] = block;
+		kmemset(physToVirtualInt<void>(block), 0xA5, size);
+	}
+	for (size_t i = 0; i < count; ++i)
+		allocator.freePages(blocks[i], orders[i]);
+
+	const uintptr_t block = allocator.allocPages(RamAllocator::PageOrder2M, true);
+	ASSERT(block != 0);
+	const uint64_t* ptr = physToVirtualInt<uint64_t>(block);
+	for (size_t i = 0; i < ((PAGE_SIZE << RamAllocator::PageOrder2M) / sizeof (uint64_t)); ++i)
+		ASSERT(ptr[i] == 0);
+	allocator.freePages(block, RamAllocator::PageOrder2M);
+	ASSERT(allocator.allocPages(RamAllocator::MaxPageOrder + 1, false) == 0);
+}
+
+// runs steps of 1, 2, 4... up to the CPU count groups of threads started at once and prints the rate of each step;
+// addThreads(count, threads, startEvent) makes the threads of a step, operations() counts the work done so far
+template <typename AddThreads, typename Operations>
+static void runScalingSteps(const wchar_t* groupName, const wchar_t* operationName, AddThreads addThreads, Operations operations)
+{
+	AbstractTimer* timer = AbstractTimer::system();
+	const unsigned int numCpu = cpuLogicalCount();
+	println(L"");
+	for (unsigned int count = 1; ; count = kmin(count * 2, numCpu))
+	{
+		kevent startEvent(false, true);
+		kvector<kthread> threads;
+		addThreads(count, threads, startEvent);
+		const uint64_t startOperations = operations();
+		const TimePoint startTime = timer->fastTimepoint();
+		startEvent.set();
+		for (kthread& thread : threads)
+			thread.join();
+		const TimePoint elapsedUs = kmax<TimePoint>(timer->toMicroseconds(timer->fastTimepoint() - startTime), 1);
+		const uint64_t stepOperations = operations() - startOperations;
+		println(L"  ", groupName, L": ", count, L", ", operationName, L" per ms: ", (stepOperations * 1000) / elapsedUs);
+		if (count == numCpu)
+			break;
+	}
+}
+
+DEF_TEST(ramPagesScalingTest)
+{
+	static const int pagesPerIteration = 32;
+	static const int numIterations = 4000;
+	RamAllocator& allocator = RamAllocator::getInstance();
+	std::atomic<bool> result{true};
+	std::atomic<uint64_t> operations{0};
+	uint64_t expectedOperations = 0;
+	runScalingSteps(L"threads", L"alloc/free", [&](unsigned int numThreads, kvector<kthread>& threads, kevent& startEvent) {
+		expectedOperations += 2ULL * numThreads * numIterations * pagesPerIteration;
+		for (unsigned int idx = 0; idx < numThreads; ++idx)
+		{
+			threads.emplace_back([&allocator, &startEvent, &result, &operations] {
+				uintptr_t pages[pagesPerIteration];
+				startEvent.wait();
+				for (int iteration = 0; iteration < numIterations; ++iteration)
+				{
+					for (uintptr_t& page : pages)
+						page = allocator.allocPage(false);
+					for (const uintptr_t page : pages)
+					{
+						if (page == 0)
+							result = false;
+						allocator.freePage(page);
+					}
+					operations.fetch_add(2 * pagesPerIteration, std::memory_order_relaxed);
+				}
+			});
+		}
+	}, [&operations] {
+		return operations.load(std::memory_order_relaxed);
+	});
+	ASSERT(result);
+	ASSERT(operations == expectedOperations);
+}
+
+DEF_TEST(ramShrinkerTest)
+{
+	struct CacheShrinker : RamShrinker
+	{
+		kvector<uintptr_t> m_pages;
+
+		size_t shrink(size_t pages) override
+		{
+			size_t released = 0;
+			for (; (released < pages) && !m_pages.empty(); ++released)
+			{
+				RamAllocator::getInstance().freePage(m_pages.back());
+				m_pages.pop_back();
+			}
+			return released;
+		}
+	};
+
+	RamAllocator& allocator = RamAllocator::getInstance();
+	CacheShrinker shrinker;
+	const size_t cachedPages = 4096;
+	for (size_t i = 0; i < cachedPages; ++i)
+	{
+		const uintptr_t page = allocator.tryAllocPage(false);
+		ASSERT(page != 0);
+		shrinker.m_pages.push_back(page);
+	}
+	allocator.registerShrinker(&shrinker, 0);
+	// the allocator's own caches are emptied first, the shrinker gives the rest
+	const size_t wanted = 16 * cachedPages;
+	const size_t released = allocator.reclaim(wanted);
+	ASSERT((released >= wanted) || shrinker.m_pages.empty());
+	allocator.unregisterShrinker(&shrinker);
+	for (uintptr_t page : shrinker.m_pages)
+		allocator.freePage(page);
+}
+
+DEF_TEST(ramNumaNodesTest)
+{
+	static const int pagesPerNode = 64;
+	RamAllocator& allocator = RamAllocator::getInstance();
+	const unsigned int nodeCount = allocator.nodeCount();
+	println(L"");
+	println(L"  nodes: ", nodeCount, L", current: ", RamAllocator::currentNode());
+	for (unsigned int node = 0; node < nodeCount; ++node)
+	{
+		uintptr_t pages[pagesPerNode];
+		int localPages = 0;
+		for (uintptr_t& page : pages)
+		{
+			page = allocator.allocPageOnNode(node, true);
+			ASSERT(page != 0);
+			ASSERT(*physToVirtualInt<uint64_t>(page) == 0);
+			if (allocator.pageNode(page) == node)
+				++localPages;
+		}
+		for (const uintptr_t page : pages)
+			allocator.freePage(page);
+		println(L"  node ", node, L": ", localPages, L"/", pagesPerNode, L" pages local");
+	}
+}
+
 DEF_TEST(virtualMemorySimpleTest)
 {
 	void* p = VirtualMemoryManager::system().alloc(PAGE_SIZE, VMM_READWRITE);
@@ -110,6 +289,25 @@ DEF_TEST(virtualMemorySimpleTest)
 	VirtualMemoryManager::system().free(p);
 }
 
+DEF_TEST(virtualMemoryRegionsTest)
+{
+	// region boundaries across several tree leaves survive merging in any order
+	VirtualMemoryManager& vmm = VirtualMemoryManager::system();
+	const size_t count = 64;
+	uint8_t* p[count] = {};
+	for (size_t i = 0; i < count; ++i)
+	{
+		p[i] = static_cast<uint8_t*>(vmm.alloc(PAGE_SIZE * ((i % 7) * 100 + 1), VMM_NOACCESS));
+		ASSERT(p[i] != nullptr);
+		if ((i % 7) != 0)
+			ASSERT(!vmm.free(p[i] + PAGE_SIZE));
+	}
+	for (size_t i = 0; i < count; i += 2)
+		ASSERT(vmm.free(p[i]));
+	for (size_t i = 1; i < count; i += 2)
+		ASSERT(vmm.free(p[i]));
+}
+
 DEF_TEST(virtualMemoryTest)
 {
 	VirtualMemoryManager& vmm = VirtualMemoryManager::system();
@@ -156,6 +354,236 @@ DEF_TEST(virtualMemoryTest)
 	}
 }
 
+DEF_TEST(virtualMemoryLargePagesTest)
+{
+	VirtualMemoryManager& vmm = VirtualMemoryManager::system();
+	const size_t largeSize = PAGE_SIZE << RamAllocator::PageOrder2M;
+	const size_t size = largeSize * 3;
+	const size_t count = size / sizeof (uint64_t);
+	uint64_t* p = static_cast<uint64_t*>(vmm.alloc(size, VMM_READWRITE | VMM_COMMIT));
+	ASSERT(p != nullptr);
+	ASSERT((reinterpret_cast<uintptr_t>(p) & (largeSize - 1)) == 0);
+	for (size_t i = 0; i < count; ++i)
+		p[i] = i;
+
+	ASSERT(vmm.setPagesFlags(p, largeSize + PAGE_SIZE * 3, VMM_READONLY));
+	for (size_t i = 0; i < count; ++i)
+		ASSERT(p[i] == i);
+	ASSERT(vmm.setPagesFlags(p, size, VMM_READWRITE));
+	for (size_t i = 0; i < count; ++i)
+		p[i] = count - i;
+
+	uint64_t* freePtr = p + (largeSize * 2 + PAGE_SIZE * 5) / sizeof (uint64_t);
+	const size_t freeCount = (PAGE_SIZE * 4) / sizeof (uint64_t);
+	vmm.freeRamPages(freePtr, PAGE_SIZE * 4, true);
+	for (size_t i = 0; i < freeCount; ++i)
+		freePtr[i] = ~i;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const size_t freeIdx = i - (freePtr - p);
+		ASSERT(p[i] == ((freeIdx < freeCount) ? ~freeIdx : (count - i)));
+	}
+	ASSERT(vmm.free(p));
+}
+
+DEF_TEST(virtualMemoryFaultAroundTest)
+{
+	VirtualMemoryManager& vmm = VirtualMemoryManager::system();
+	AbstractTimer* timer = AbstractTimer::system();
+	const size_t size = 8 << 20;
+	const size_t numPages = size / PAGE_SIZE;
+	uint64_t* p = static_cast<uint64_t*>(vmm.alloc(size, VMM_READWRITE));
+	ASSERT(p != nullptr);
+	const size_t pageWords = PAGE_SIZE / sizeof (uint64_t);
+	const TimePoint startTime = timer->fastTimepoint();
+	for (size_t page = 0; page < numPages; page += 2)
+		p[page * pageWords] = page;
+	const TimePoint elapsedUs = timer->toMicroseconds(timer->fastTimepoint() - startTime);
+	for (size_t page = numPages - 1; page < numPages; page -= 2)
+		p[page * pageWords] = page;
+	for (size_t page = 0; page < numPages; ++page)
+		ASSERT(p[page * pageWords] == page);
+	println(L"");
+	println(L"  first touch of ", size >> 20, L" MiB us: ", elapsedUs);
+	ASSERT(vmm.free(p));
+}
+
+static const size_t g_zeroPageTestPages = 32;
+static uint64_t g_zeroPageTestEntries[g_zeroPageTestPages];
+static size_t g_zeroPageTestEntryCount = 0;
+
+static void storeZeroPageTestEntry(uint64_t& entry)
+{
+	g_zeroPageTestEntries[g_zeroPageTestEntryCount++] = entry;
+}
+
+DEF_TEST(virtualMemoryZeroPageTest)
+{
+	VirtualMemoryManager& vmm = VirtualMemoryManager::system();
+	PagingManager64& paging = PagingManager64::system();
+	const size_t pageWords = PAGE_SIZE / sizeof (uint64_t);
+	const size_t size = g_zeroPageTestPages * PAGE_SIZE;
+	volatile uint64_t* p = static_cast<uint64_t*>(vmm.alloc(size, VMM_READWRITE));
+	ASSERT(p != nullptr);
+	uint64_t sum = 0;
+	for (size_t idx = 0; idx < (g_zeroPageTestPages * pageWords); idx += 64)
+		sum += p[idx];
+	ASSERT(sum == 0);
+
+	// every page read so far shares one read-only frame
+	g_zeroPageTestEntryCount = 0;
+	paging.processPages(reinterpret_cast<uintptr_t>(p), size, &storeZeroPageTestEntry);
+	ASSERT(g_zeroPageTestEntryCount == g_zeroPageTestPages);
+	const uint64_t zeroFrame = g_zeroPageTestEntries[0] & ~PAGE_MASK;
+	for (const uint64_t entry : g_zeroPageTestEntries)
+	{
+		ASSERT((entry & ~PAGE_MASK) == zeroFrame);
+		ASSERT((entry & (PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_COPY_ON_WRITE)) == (PAGE_FLAG_PRESENT | PAGE_FLAG_COPY_ON_WRITE));
+	}
+
+	for (size_t page = 0; page < g_zeroPageTestPages; page += 2)
+		p[page * pageWords + 1] = page + 1;
+	for (size_t page = 0; page < g_zeroPageTestPages; ++page)
+	{
+		ASSERT(p[page * pageWords] == 0);
+		ASSERT(p[page * pageWords + 1] == (((page % 2) == 0) ? (page + 1) : 0));
+	}
+	g_zeroPageTestEntryCount = 0;
+	paging.processPages(reinterpret_cast<uintptr_t>(p), size, &storeZeroPageTestEntry);
+	for (size_t page = 0; page < g_zeroPageTestPages; ++page)
+		ASSERT(((g_zeroPageTestEntries[page] & ~PAGE_MASK) == zeroFrame) == ((page % 2) != 0));
+	ASSERT(vmm.free(const_cast<uint64_t*>(p)));
+}
+
+DEF_TEST(tlbBatchTest)
+{
+	static const size_t numPages = 64;
+	VirtualMemoryManager& vmm = VirtualMemoryManager::system();
+	PagingManager64& paging = PagingManager64::system();
+	RamAllocator& allocator = RamAllocator::getInstance();
+	const size_t pageWords = PAGE_SIZE / sizeof (uint64_t);
+	uint64_t* p = static_cast<uint64_t*>(vmm.alloc(numPages * PAGE_SIZE, VMM_READWRITE | VMM_COMMIT));
+	ASSERT(p != nullptr);
+	for (size_t page = 0; page < numPages; ++page)
+		p[page * pageWords] = page + 1;
+
+	const unsigned int numThreads = cpuLogicalCount() - 1;
+	std::atomic<unsigned int> readyCnt{0};
+	std::atomic<bool> remapped{false};
+	std::atomic<bool> result{true};
+	kvector<kthread> threads;
+	for (unsigned int idx = 0; idx < numThreads; ++idx)
+	{
+		threads.emplace_back([p, pageWords, &readyCnt, &remapped, &result] {
+			const volatile uint64_t* vp = p;
+			for (size_t page = 0; page < numPages; ++page)
+			{
+				if (vp[page * pageWords] != (page + 1))
+					result = false;
+			}
+			++readyCnt;
+			while (!remapped)
+				cpuPause();
+			for (size_t page = 0; page < numPages; ++page)
+			{
+				if (vp[page * pageWords] != (((page & 1) != 0) ? 0 : (page + 1)))
+					result = false;
+			}
+		});
+	}
+	while (readyCnt != numThreads)
+		cpuPause();
+
+	// every odd page gets a new zeroed frame, all in one shootdown round
+	VirtualMemoryRange ranges[numPages / 2];
+	for (size_t idx = 0; idx < (numPages / 2); ++idx)
+		ranges[idx] = VirtualMemoryRange{p + (idx * 2 + 1) * pageWords, PAGE_SIZE};
+	{
+		TlbBatch batch(paging);
+		paging.freeRamPages(ranges, numPages / 2, false, &batch);
+		for (const VirtualMemoryRange& range : ranges)
+			paging.mapPages(reinterpret_cast<uintptr_t>(range.m_base), allocator.allocPage(true), PAGE_SIZE, PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE, &batch);
+	}
+	remapped = true;
+	for (kthread& thread : threads)
+		thread.join();
+	ASSERT(result);
+	for (size_t page = 0; page < numPages; ++page)
+		ASSERT(p[page * pageWords] == (((page & 1) != 0) ? 0 : (page + 1)));
+	ASSERT(vmm.free(p));
+}
+
+DEF_TEST(virtualMemoryMmioCacheTest)
+{
+	RamAllocator& allocator = RamAllocator::getInstance();
+	VirtualMemoryManager& vmm = VirtualMemoryManager::system();
+	const uintptr_t phys = allocator.allocPage(true);
+	physToVirtualInt<uint64_t>(phys)[8] = 0x1234;
+	uint8_t* p1 = static_cast<uint8_t*>(vmm.mapMmio(phys, 16, MemoryType::Default));
+	uint8_t* p2 = static_cast<uint8_t*>(vmm.mapMmio(phys + 64, 16, MemoryType::Default));
+	ASSERT((p1 != nullptr) && (p2 == p1 + 64));
+	ASSERT(*reinterpret_cast<volatile uint64_t*>(p2) == 0x1234);
+	ASSERT(vmm.unmapMmio(p2));
+	ASSERT(vmm.unmapMmio(p1));
+	// released mappings stay cached
+	uint8_t* p3 = static_cast<uint8_t*>(vmm.mapMmio(phys, PAGE_SIZE, MemoryType::Default));
+	ASSERT(p3 == p1);
+	ASSERT(vmm.unmapMmio(p3));
+	allocator.freePage(phys);
+
+	// adjacent requests end up in one mapping
+	const uintptr_t physPair = allocator.allocPages(1, true);
+	uint8_t* q1 = static_cast<uint8_t*>(vmm.mapMmio(physPair, PAGE_SIZE, MemoryType::Default));
+	uint8_t* q2 = static_cast<uint8_t*>(vmm.mapMmio(physPair + PAGE_SIZE, PAGE_SIZE, MemoryType::Default));
+	uint8_t* q3 = static_cast<uint8_t*>(vmm.mapMmio(physPair, 2 * PAGE_SIZE, MemoryType::Default));
+	ASSERT((q1 != nullptr) && (q2 != nullptr) && (q3 + PAGE_SIZE == q2));
+	ASSERT(vmm.unmapMmio(q1));
+	ASSERT(vmm.unmapMmio(q2));
+	ASSERT(vmm.unmapMmio(q3));
+	allocator.freePages(physPair, 1);
+}
+
+DEF_TEST(virtualMemoryArenaTest)
+{
+	static const int numIterations = 2000;
+	VirtualMemoryManager& vmm = VirtualMemoryManager::system();
+	AbstractTimer* timer = AbstractTimer::system();
+	const unsigned int numThreads = cpuLogicalCount();
+	std::atomic<bool> result{true};
+	kevent startEvent(false, true);
+	kvector<kthread> threads;
+	for (unsigned int idx = 0; idx < numThreads; ++idx)
+	{
+		threads.emplace_back([&vmm, &startEvent, &result, idx] {
+			startEvent.wait();
+			for (int iteration = 0; iteration < numIterations; ++iteration)
+			{
+				const size_t size = PAGE_SIZE * ((iteration + idx) % 16 + 1);
+				uint64_t* p = static_cast<uint64_t*>(vmm.alloc(size, VMM_READWRITE));
+				if (p == nullptr)
+				{
+					result = false;
+					return;
+				}
+				const uint64_t tag = (static_cast<uint64_t>(idx) << 32) | iteration;
+				p[0] = tag;
+				p[size / sizeof (uint64_t) - 1] = tag;
+				if ((p[0] != tag) || (p[size / sizeof (uint64_t) - 1] != tag))
+					result = false;
+				vmm.free(p);
+			}
+		});
+	}
+	const TimePoint startTime = timer->fastTimepoint();
+	startEvent.set();
+	for (kthread& thread : threads)
+		thread.join();
+	const TimePoint elapsedUs = kmax<TimePoint>(timer->toMicroseconds(timer->fastTimepoint() - startTime), 1);
+	println(L"");
+	println(L"  threads: ", numThreads, L", alloc/free per ms: ", (2ULL * numThreads * numIterations * 1000) / elapsedUs);
+	ASSERT(result);
+}
+
 DEF_TEST(heapTest)
 {
 	const size_t maxMemory = 16 << 20;
@@ -207,6 +635,168 @@ DEF_TEST(heapTest)
 	ASSERT(startVmSize == endVmSize);
 }
 
+DEF_TEST(heapDecommitTest)
+{
+	Heap& heap = Heap::system();
+	const size_t blockSize = 0x10000;
+	const size_t numBlocks = 16;
+	uint8_t* blocks[numBlocks];
+	for (size_t idx = 0; idx < numBlocks; ++idx)
+	{
+		blocks[idx] = new uint8_t[blockSize];
+		kfill(blocks[idx], blocks[idx] + blockSize, static_cast<uint8_t>(idx));
+	}
+	for (size_t idx = 0; idx < numBlocks; idx += 2)
+	{
+		delete[] blocks[idx];
+		blocks[idx] = nullptr;
+	}
+	heap.purge();
+	EXPECT(heap.pendingDecommitSize() == 0);
+	for (size_t idx = 1; idx < numBlocks; idx += 2)
+	{
+		for (size_t pos = 0; pos < blockSize; ++pos)
+			ASSERT(blocks[idx][pos] == static_cast<uint8_t>(idx));
+	}
+	for (size_t idx = 0; idx < numBlocks; idx += 2)
+	{
+		blocks[idx] = new uint8_t[blockSize];
+		kfill(blocks[idx], blocks[idx] + blockSize, static_cast<uint8_t>(idx));
+	}
+	for (uint8_t* block : blocks)
+		delete[] block;
+}
+
+DEF_TEST(heapExpandTest)
+{
+	const size_t hugeSize = 0x180000;
+	uint8_t* huge = new uint8_t[hugeSize];
+	EXPECT(kexpand(huge, hugeSize + 0x800));
+	EXPECT(!kexpand(huge, hugeSize + PAGE_SIZE));
+	delete[] huge;
+
+	const size_t blockSize = 0x1000;
+	uint8_t* block = static_cast<uint8_t*>(krealloc(nullptr, blockSize));
+	ASSERT(block != nullptr);
+	kfill(block, block + blockSize, 0x5A);
+	block = static_cast<uint8_t*>(krealloc(block, blockSize * 8));
+	ASSERT(block != nullptr);
+	for (size_t idx = 0; idx < blockSize; ++idx)
+		ASSERT(block[idx] == 0x5A);
+	krealloc(block, 0);
+
+	kvector<uint32_t> values;
+	for (uint32_t idx = 0; idx < 0x40000; ++idx)
+		values.push_back(idx);
+	for (uint32_t idx = 0; idx < values.size(); ++idx)
+		ASSERT(values[idx] == idx);
+
+	kstring str;
+	for (int idx = 0; idx < 1000; ++idx)
+		str += "0123456789";
+	EXPECT(str.size() == 10000);
+}
+
+DEF_TEST(heapAlignedTest)
+{
+	struct alignas(CPU_CACHE_LINE_SIZE) CacheLine
+	{
+		uint64_t m_value[2];
+	};
+	static const size_t aligns[] = {32, 64, 128, PAGE_SIZE};
+	static const size_t sizes[] = {8, 40, 100, 3000, 0x20000};
+	for (const size_t align : aligns)
+	{
+		for (const size_t size : sizes)
+		{
+			uint8_t* ptr = static_cast<uint8_t*>(operator new(size, std::align_val_t(align)));
+			ASSERT((reinterpret_cast<uintptr_t>(ptr) & (align - 1)) == 0);
+			kfill(ptr, ptr + size, 0xA5);
+			operator delete(ptr, std::align_val_t(align));
+		}
+	}
+	kvector<CacheLine*> lines;
+	for (int idx = 0; idx < 1000; ++idx)
+	{
+		lines.push_back(new CacheLine());
+		ASSERT((reinterpret_cast<uintptr_t>(lines.back()) & (CPU_CACHE_LINE_SIZE - 1)) == 0);
+	}
+	for (CacheLine* line : lines)
+		delete line;
+	kvector<kcache_aligned<uint64_t>> values(cpuLogicalCount());
+	EXPECT((reinterpret_cast<uintptr_t>(values.data()) & (CPU_CACHE_LINE_SIZE - 1)) == 0);
+}
+
+DEF_TEST(heapScalingTest)
+{
+	static const int objectsPerIteration = 64;
+	static const int numIterations = 4000;
+	std::atomic<bool> result{true};
+	std::atomic<uint64_t> operations{0};
+	uint64_t expectedOperations = 0;
+	runScalingSteps(L"threads", L"new/delete", [&](unsigned int numThreads, kvector<kthread>& threads, kevent& startEvent) {
+		expectedOperations += 2ULL * numThreads * numIterations * objectsPerIteration;
+		for (unsigned int idx = 0; idx < numThreads; ++idx)
+		{
+			threads.emplace_back([&startEvent, &result, &operations, idx] {
+				uint8_t* objects[objectsPerIteration];
+				startEvent.wait();
+				for (int iteration = 0; iteration < numIterations; ++iteration)
+				{
+					for (int obj = 0; obj < objectsPerIteration; ++obj)
+					{
+						const size_t size = 16 + ((obj * 37 + idx) % 500);
+						objects[obj] = new uint8_t[size];
+						objects[obj][0] = static_cast<uint8_t>(obj);
+						objects[obj][size - 1] = static_cast<uint8_t>(obj);
+					}
+					for (int obj = 0; obj < objectsPerIteration; ++obj)
+					{
+						if (objects[obj][0] != static_cast<uint8_t>(obj))
+							result = false;
+						delete[] objects[obj];
+					}
+					operations.fetch_add(2 * objectsPerIteration, std::memory_order_relaxed);
+				}
+			});
+		}
+	}, [&operations] {
+		return operations.load(std::memory_order_relaxed);
+	});
+	ASSERT(result);
+	ASSERT(operations == expectedOperations);
+}
+
+DEF_TEST(memoryAccountTest)
+{
+	static MemoryAccount account("test");
+	Heap& heap = Heap::system();
+	void* small = heap.alloc(100, account);
+	void* large = heap.alloc(0x20000, account);
+	ASSERT((small != nullptr) && (large != nullptr));
+	EXPECT(account.usage().m_heapSize >= 0x20000 + 100);
+	heap.free(small);
+	heap.free(large);
+	EXPECT(account.usage().m_heapSize == 0);
+
+	const size_t numPages = 5;
+	VirtualMemoryManager& vmm = VirtualMemoryManager::system();
+	void* committed = vmm.alloc(numPages * PAGE_SIZE, VMM_READWRITE | VMM_COMMIT, account);
+	void* lazy = vmm.alloc(numPages * PAGE_SIZE, VMM_READWRITE, account);
+	ASSERT((committed != nullptr) && (lazy != nullptr));
+	EXPECT(account.usage().m_physicalPages == numPages);
+	EXPECT(account.usage().m_virtualSize == 2 * numPages * PAGE_SIZE);
+	vmm.free(committed, account);
+	vmm.free(lazy, account);
+	EXPECT((account.usage().m_physicalPages == 0) && (account.usage().m_virtualSize == 0));
+
+	// allocations of the kernel itself show up in the process total
+	Process& process = Process::kernel();
+	EXPECT(process.memoryUsage().m_heapSize > 0);
+	println(L"");
+	process.dumpMemoryUsage();
+}
+
 DEF_TEST(klistTest)
 {
 	klist<int> lst;
@@ -289,6 +879,61 @@ DEF_TEST(threadSleepTest)
 	}
 }
 
+DEF_TEST(timedWakeupTest)
+{
+	// woken by the local timer of the CPU, not by the next periodic tick
+	const TimePoint desiredDelayMs = 2;
+	AbstractTimer* timer = AbstractTimer::system();
+	TimePoint minDelayMs = SYSTEM_FORCED_TASK_SWITCH_TIME_MS;
+	for (int i = 0; i < 10; ++i)
+	{
+		const TimePoint beginTime = timer->fastTimepoint();
+		sleepMs(desiredDelayMs);
+		const TimePoint actualDelayMs = timer->toMilliseconds(timer->fastTimepoint() - beginTime);
+		ASSERT(actualDelayMs >= desiredDelayMs);
+		minDelayMs = kmin(minDelayMs, actualDelayMs);
+	}
+	ASSERT(minDelayMs < SYSTEM_FORCED_TASK_SWITCH_TIME_MS);
+}
+
+DEF_TEST(ktimerTest)
+{
+	AbstractTimer* timer = AbstractTimer::system();
+	std::atomic<int> count{0};
+	kevent firedEvent(false, false);
+	ktimer fired([&count, &firedEvent] {
+		++count;
+		firedEvent.set();
+	});
+	ktimer cancelled([&count] {
+		count += 100;
+	});
+	cancelled.start(timer->fromMilliseconds(5));
+	fired.start(timer->fromMilliseconds(2));
+	ASSERT(cancelled.pending());
+	ASSERT(cancelled.cancel());
+	ASSERT(!cancelled.pending());
+	ASSERT(firedEvent.wait(timer->fromMilliseconds(1000)));
+	ASSERT(!fired.pending());
+	sleepMs(10);
+	ASSERT(count == 1);
+
+	// deadlines spread over several levels of the wheel
+	static const int numTimers = 256;
+	std::atomic<int> expired{0};
+	kevent expiredEvent(false, true);
+	kvector<std::unique_ptr<ktimer>> timers;
+	for (int idx = 0; idx < numTimers; ++idx)
+	{
+		timers.emplace_back(new ktimer([&expired, &expiredEvent] {
+			if (++expired == numTimers)
+				expiredEvent.set();
+		}));
+		timers.back()->start(timer->fromMicroseconds(idx * 997));
+	}
+	ASSERT(expiredEvent.wait(timer->fromMilliseconds(2000)));
+}
+
 DEF_TEST(threadMultipleTest)
 {
 	const int numThreads = 10;
@@ -308,6 +953,164 @@ DEF_TEST(threadMultipleTest)
 	ASSERT(sum == expectedResult);
 }
 
+DEF_TEST(schedulerScalingTest)
+{
+	// thread pairs hand a token back and forth, every handoff is a context switch
+	struct PingPong
+	{
+		kevent m_ping{false, false};
+		kevent m_pong{false, false};
+	};
+	static const int numRounds = 5000;
+	TaskManager* taskManager = TaskManager::system();
+	kvector<std::unique_ptr<PingPong[]>> steps;
+	std::atomic<uint64_t> rounds{0};
+	uint64_t expectedRounds = 0;
+	const uint64_t startSwitches = taskManager->contextSwitchCount();
+	runScalingSteps(L"pairs", L"context switches", [&](unsigned int numPairs, kvector<kthread>& threads, kevent& startEvent) {
+		expectedRounds += static_cast<uint64_t>(numPairs) * numRounds;
+		steps.emplace_back(new PingPong[numPairs]);
+		for (unsigned int idx = 0; idx < numPairs; ++idx)
+		{
+			PingPong& pair = steps.back()[idx];
+			threads.emplace_back([&pair, &startEvent, &rounds] {
+				startEvent.wait();
+				for (int round = 0; round < numRounds; ++round)
+				{
+					pair.m_ping.set();
+					pair.m_pong.wait();
+					rounds.fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+			threads.emplace_back([&pair] {
+				for (int round = 0; round < numRounds; ++round)
+				{
+					pair.m_ping.wait();
+					pair.m_pong.set();
+				}
+			});
+		}
+	}, [taskManager] {
+		return taskManager->contextSwitchCount();
+	});
+	ASSERT(rounds == expectedRounds);
+	ASSERT(taskManager->contextSwitchCount() > startSwitches);
+}
+
+__attribute__((noinline)) static uint64_t touchStackDeep(size_t depth)
+{
+	volatile uint8_t frame[0x400];
+	frame[0] = static_cast<uint8_t>(depth);
+	frame[sizeof (frame) - 1] = static_cast<uint8_t>(depth);
+	if (depth == 0)
+		return frame[0];
+
+	return touchStackDeep(depth - 1) + frame[sizeof (frame) - 1];
+}
+
+DEF_TEST(threadStackTest)
+{
+	// most of the 64 KiB stack is committed by the faults
+	const size_t depth = 48;
+	uint64_t result = 0;
+	kthread deep([&result] {
+		result = touchStackDeep(depth);
+	});
+	deep.join();
+	ASSERT(result == (depth * (depth + 1)) / 2);
+
+	AbstractTimer* timer = AbstractTimer::system();
+	const size_t numThreads = 256;
+	std::atomic<size_t> runs{0};
+	const TimePoint startTime = timer->fastTimepoint();
+	for (size_t i = 0; i < numThreads; ++i)
+	{
+		kthread th([&runs] {
+			++runs;
+		});
+		th.join();
+	}
+	const TimePoint elapsedUs = timer->toMicroseconds(timer->fastTimepoint() - startTime);
+	ASSERT(runs == numThreads);
+	println(L"");
+	println(L"  spawn and join of ", numThreads, L" threads us: ", elapsedUs);
+}
+
+DEF_TEST(schedulingClassTest)
+{
+	// background threads keep every CPU busy, realtime wakeups preempt them at once
+	AbstractTimer* timer = AbstractTimer::system();
+	const unsigned int numThreads = 2 * cpuLogicalCount();
+	std::atomic<bool> stop{false};
+	kvector<kthread> background;
+	for (unsigned int idx = 0; idx < numThreads; ++idx)
+	{
+		background.emplace_back([&stop] {
+			while (!stop.load(std::memory_order_relaxed))
+				cpuPause();
+		});
+		background.back().setSchedulingClass(kthread::SchedulingClass::Background);
+		ASSERT(background.back().schedulingClass() == kthread::SchedulingClass::Background);
+	}
+
+	kevent wakeEvent(false, false);
+	std::atomic<TimePoint> wakeTime{0};
+	kthread realtime([&wakeEvent, &wakeTime, timer] {
+		wakeEvent.wait();
+		wakeTime.store(timer->fastTimepoint(), std::memory_order_release);
+	});
+	realtime.setSchedulingClass(kthread::SchedulingClass::Realtime);
+	realtime.setPriority(kthread::MaxPriority + 1);
+	ASSERT(realtime.priority() == kthread::MaxPriority);
+	sleepMs(SYSTEM_FORCED_TASK_SWITCH_TIME_MS);
+
+	const TimePoint setTime = timer->fastTimepoint();
+	wakeEvent.set();
+	realtime.join();
+	const TimePoint latencyMs = timer->toMilliseconds(wakeTime.load(std::memory_order_acquire) - setTime);
+	stop = true;
+	for (kthread& thread : background)
+		thread.join();
+	ASSERT(latencyMs < SYSTEM_FORCED_TASK_SWITCH_TIME_MS);
+}
+
+DEF_TEST(threadAffinityTest)
+{
+	const unsigned int numCpu = cpuLogicalCount();
+	const unsigned int lastCpu = numCpu - 1;
+	std::atomic<bool> stayed{true};
+	kevent startEvent(false, false);
+	kthread pinned([&stayed, &startEvent, lastCpu] {
+		startEvent.wait();
+		for (int i = 0; i < 100; ++i)
+		{
+			if (cpuCurrentId() != lastCpu)
+				stayed = false;
+			sleepUs(1000);
+		}
+	});
+	ASSERT(!pinned.setAffinity(kcpu_set::single(numCpu)));
+	ASSERT(pinned.setAffinity(kcpu_set::single(lastCpu)));
+	ASSERT(pinned.affinity() == kcpu_set::single(lastCpu));
+	startEvent.set();
+	pinned.join();
+	ASSERT(stayed);
+
+	std::atomic<bool> stayedOnCurrent{true};
+	kthread self([&stayedOnCurrent] {
+		kthis_thread::pin_to_current_cpu();
+		const unsigned int cpuId = cpuCurrentId();
+		for (int i = 0; i < 100; ++i)
+		{
+			sleepUs(1000);
+			if (cpuCurrentId() != cpuId)
+				stayedOnCurrent = false;
+		}
+	});
+	self.join();
+	ASSERT(stayedOnCurrent);
+}
+
 DEF_TEST(threadFpuTest)
 {
 	const double magic = 11.22;
@@ -545,6 +1348,50 @@ DEF_TEST(smpTest)
 	ASSERT(cpuCnt == numCpu);
 }
 
+static const uint64_t g_falseSharingIterations = 1000000;
+
+template<typename Counter>
+static TimePoint measureCounters(Counter* counters, unsigned int numThreads)
+{
+	AbstractTimer* timer = AbstractTimer::system();
+	kevent startEvent(false, true);
+	kvector<kthread> threads;
+	for (unsigned int idx = 0; idx < numThreads; ++idx)
+	{
+		threads.emplace_back([&startEvent, counters, idx] {
+			startEvent.wait();
+			for (uint64_t iteration = 0; iteration < g_falseSharingIterations; ++iteration)
+				counters[idx]->fetch_add(1, std::memory_order_relaxed);
+		});
+	}
+	const TimePoint startTime = timer->fastTimepoint();
+	startEvent.set();
+	for (kthread& thread : threads)
+		thread.join();
+	return kmax<TimePoint>(timer->toMicroseconds(timer->fastTimepoint() - startTime), 1);
+}
+
+DEF_TEST(falseSharingTest)
+{
+	struct PackedCounter
+	{
+		std::atomic<uint64_t> m_value{0};
+		std::atomic<uint64_t>* operator->()
+		{
+			return &m_value;
+		}
+	};
+	const unsigned int numThreads = cpuLogicalCount();
+	kvector<PackedCounter> packed(numThreads);
+	kvector<kcache_aligned<std::atomic<uint64_t>>> aligned(numThreads);
+	const TimePoint packedUs = measureCounters(packed.data(), numThreads);
+	const TimePoint alignedUs = measureCounters(aligned.data(), numThreads);
+	for (unsigned int idx = 0; idx < numThreads; ++idx)
+		ASSERT((packed[idx]->load() == g_falseSharingIterations) && (aligned[idx]->load() == g_falseSharingIterations));
+	println(L"");
+	println(L"  threads: ", numThreads, L", packed counters us: ", packedUs, L", cache aligned counters us: ", alignedUs);
+}
+
 DEF_TEST(kunorderedMapTest)
 {
 	kunordered_map<kstring, kstring> m = { 
@@ -587,14 +1434,37 @@ void runTests()
 {
 	println(L"Start tests:");
 	ramPagesTest();
+	ramZeroPagesTest();
+	ramContiguousPagesTest();
+	ramPagesScalingTest();
+	ramShrinkerTest();
+	ramNumaNodesTest();
 	virtualMemorySimpleTest();
+	virtualMemoryRegionsTest();
 	virtualMemoryTest();
+	virtualMemoryLargePagesTest();
+	virtualMemoryFaultAroundTest();
+	virtualMemoryZeroPageTest();
+	tlbBatchTest();
+	virtualMemoryMmioCacheTest();
+	virtualMemoryArenaTest();
 	heapTest();
+	heapDecommitTest();
+	heapExpandTest();
+	heapAlignedTest();
+	heapScalingTest();
+	memoryAccountTest();
 	klistTest();
 	threadSimpleTest();
 	threadSleepTest();
+	timedWakeupTest();
+	ktimerTest();
 	threadMultipleTest();
+	schedulerScalingTest();
+	schedulingClassTest();
+	threadAffinityTest();
 	threadFpuTest();
+	threadStackTest();
 	mutexTest();
 	threadEventsWaitTest();
 	threadEventsWaitAllTest();
@@ -603,6 +1473,7 @@ void runTests()
 	threadPoolTest();
 	interruptMessageTest();
 	smpTest();
+	falseSharingTest();
 	kunorderedMapTest();
 	fastTimepointTest();
 	println(L"Tests completed ");
@@ -89,7 +89,7 @@ bool BootIo::readFile(const wchar_t* wFileName, size_t maxSize, kvector<char>* d
 	}
 	else
 	{
-		pData = KernelAllocator::getInstance().allocMemoryPageAlign(fileSize);
+		pData = KernelAllocator::getInstance().allocMemoryPageAlign(fileSize, BootMemoryType::Loader);
 		*pagesPtr = pData;
 	}
 
@@ -41,7 +41,7 @@ static void loadModules(const SystemConfig& config, KernelParams::Modules& param
 	auto& io = BootIo::getInstance();
 	auto& allocator = KernelAllocator::getInstance();
 	KernelParams::Modules::BootModule* pModules;
-	allocator.allocPageAlign(pModules, config.m_bootModules.size());
+	allocator.allocPageAlign(pModules, config.m_bootModules.size(), BootMemoryType::Module);
 	for (const kwstring& module : config.m_bootModules)
 	{
 		auto& curModule = pModules[params.m_count];
@@ -54,7 +54,7 @@ static void loadModules(const SystemConfig& config, KernelParams::Modules& param
 		kvector<char> moduleData;
 		if (io.readFile(module.c_str(), 0x1000000, &moduleData))
 		{
-			void* pData = allocator.allocMemoryPageAlign(moduleData.size());
+			void* pData = allocator.allocMemoryPageAlign(moduleData.size(), BootMemoryType::Module);
 			kmemcpy(pData, moduleData.data(), moduleData.size());
 			curModule.m_data = physToVirtual(pData);
 			curModule.m_size = moduleData.size();
@@ -27,7 +27,7 @@
 
 static const wchar_t* g_memoryAllocationErrorStr = L"Pages allocation error";
 
-void* KernelAllocator::allocMemoryPageAlign(size_t size)
+void* KernelAllocator::allocMemoryPageAlign(size_t size, BootMemoryType type)
 {
 	const auto pages = (size + PAGE_MASK) / PAGE_SIZE;
 	EFI_PHYSICAL_ADDRESS addr;
@@ -35,7 +35,7 @@ void* KernelAllocator::allocMemoryPageAlign(size_t size)
 	{
 		panic(g_memoryAllocationErrorStr);
 	}
-	m_usedRegions.push_back(PagesRegion{addr, pages});
+	m_usedRegions.push_back(PagesRegion{addr, pages, type});
 	return reinterpret_cast<void*>(addr);
 }
 
@@ -100,6 +100,14 @@ void KernelAllocator::initMemoryMap()
 
 		uintptr_t start = desc->PhysicalStart;
 		const uintptr_t end = start + desc->NumberOfPages * PAGE_SIZE;
+		if (start < CPU_EXTENDED_MEMORY_BASE)
+		{
+			// page 0 stays reserved, the rest is handed to the kernel after startup
+			const uintptr_t lowStart = (start < PAGE_SIZE) ? PAGE_SIZE : start;
+			const uintptr_t lowEnd = (end < CPU_EXTENDED_MEMORY_BASE) ? end : CPU_EXTENDED_MEMORY_BASE;
+			if (lowStart < lowEnd)
+				m_lowRegions.push_back(KernelParams::PhysicalMemory::PhysicalMemoryRegion{lowStart, lowEnd});
+		}
 		if (end < CPU_EXTENDED_MEMORY_BASE)
 			continue;
 
@@ -225,15 +233,42 @@ void KernelAllocator::storeBusyRegion(const PagesRegion& useReg, size_t& regCnt)
 	}
 }
 
+// loader allocations may land below 1 MiB, such pages are in use or released with their own type
+void KernelAllocator::excludeUsedLowRegions()
+{
+	for (const auto& usedReg : m_usedRegions)
+	{
+		const uintptr_t usedStart = usedReg.m_base;
+		const uintptr_t usedEnd = usedReg.m_base + usedReg.m_num * PAGE_SIZE;
+		for (size_t idx = 0; idx < m_lowRegions.size(); ++idx)
+		{
+			const uintptr_t lowStart = m_lowRegions[idx].m_start;
+			const uintptr_t lowEnd = m_lowRegions[idx].m_end;
+			if ((usedEnd <= lowStart) || (usedStart >= lowEnd))
+				continue;
+
+			m_lowRegions[idx].m_end = (usedStart > lowStart) ? usedStart : lowStart;
+			if (usedEnd < lowEnd)
+				m_lowRegions.push_back(KernelParams::PhysicalMemory::PhysicalMemoryRegion{usedEnd, lowEnd});
+		}
+	}
+}
+
 void KernelAllocator::storeParams(KernelParams::PhysicalMemory& params)
 {
+	// the boot region list also describes itself and the free regions array,
+	// every used region may split one low region in two
+	const size_t bootRegCntLimit = 2 * (m_usedRegions.size() + 2) + m_lowRegions.size();
+	KernelParams::PhysicalMemory::BootMemoryRegion* pBootRegs;
+	allocPageAlign(pBootRegs, bootRegCntLimit, BootMemoryType::Loader);
+
 	size_t regCnt = m_freeRegions.size();
 	size_t usedRegionIdx = 0;
 	for (; usedRegionIdx < m_usedRegions.size(); ++usedRegionIdx)
 		storeBusyRegion(m_usedRegions[usedRegionIdx], regCnt);
 
 	const size_t regCntLimit = regCnt + 1;
-	allocPageAlign(params.m_physicalMemoryRegions, regCntLimit);
+	allocPageAlign(params.m_physicalMemoryRegions, regCntLimit, BootMemoryType::Loader);
 
 	for (; usedRegionIdx < m_usedRegions.size(); ++usedRegionIdx)
 		storeBusyRegion(m_usedRegions[usedRegionIdx], regCnt);
@@ -257,6 +292,28 @@ void KernelAllocator::storeParams(KernelParams::PhysicalMemory& params)
 	}
 
 	params.m_physicalMemoryRegions = physToVirtual(params.m_physicalMemoryRegions);
+
+	excludeUsedLowRegions();
+	if (m_usedRegions.size() + m_lowRegions.size() > bootRegCntLimit)
+	{
+		panic(L"Too many boot memory regions");
+	}
+
+	params.m_bootRegionCount = 0;
+	for (const auto& usedReg : m_usedRegions)
+	{
+		pBootRegs[params.m_bootRegionCount++] = KernelParams::PhysicalMemory::BootMemoryRegion{
+			usedReg.m_base, usedReg.m_base + usedReg.m_num * PAGE_SIZE, usedReg.m_type};
+	}
+	for (const auto& lowReg : m_lowRegions)
+	{
+		if (lowReg.m_start >= lowReg.m_end)
+			continue;
+
+		pBootRegs[params.m_bootRegionCount++] = KernelParams::PhysicalMemory::BootMemoryRegion{
+			lowReg.m_start, lowReg.m_end, BootMemoryType::LowMemory};
+	}
+	params.m_bootRegions = physToVirtual(pBootRegs);
 }
 
 void KernelAllocator::setVirtualAddressMap()
@@ -30,15 +30,15 @@ class KernelAllocator
 {
 public:
 	static KernelAllocator& getInstance();
-	void* allocMemoryPageAlign(size_t size);
+	void* allocMemoryPageAlign(size_t size, BootMemoryType type = BootMemoryType::Kernel);
 	void initMemoryMap();
 	UINTN getMemoryKey();
 	uintptr_t getMaxRamAddress() const;
 	void storeParams(KernelParams::PhysicalMemory& params);
 	void setVirtualAddressMap();
-	template<typename T> void allocPageAlign(T*& ptr, size_t size)
+	template<typename T> void allocPageAlign(T*& ptr, size_t size, BootMemoryType type = BootMemoryType::Kernel)
 	{
-		ptr = static_cast<T*> (allocMemoryPageAlign(size * sizeof (*ptr)));
+		ptr = static_cast<T*> (allocMemoryPageAlign(size * sizeof (*ptr), type));
 	}
 
 private:
@@ -46,6 +46,7 @@ private:
 	{
 		uintptr_t m_base;
 		size_t m_num;
+		BootMemoryType m_type;
 	};
 
 private:
@@ -55,9 +56,11 @@ private:
 	KernelAllocator(const KernelAllocator&) = delete;
 	KernelAllocator(KernelAllocator&&) = delete;
 	void storeBusyRegion(const PagesRegion& region, size_t& regCnt);
+	void excludeUsedLowRegions();
 
 private:
 	kvector<PagesRegion> m_usedRegions;
 	kvector<EFI_MEMORY_DESCRIPTOR> m_virtualAddressMap;
 	kvector<KernelParams::PhysicalMemory::PhysicalMemoryRegion> m_freeRegions;
+	kvector<KernelParams::PhysicalMemory::PhysicalMemoryRegion> m_lowRegions;
 };
@@ -19,6 +19,7 @@
    Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#include <kmemory.h>
 #include "efi.h"
 #include "panic.h"
 
@@ -67,4 +68,10 @@ void operator delete(void *p, UINTN)
 {
 	if (p != nullptr)
 		getSystemTable()->BootServices->FreePool(p);
-}
\ No newline at end of file
+}
+
+bool kexpand(void*, size_t)
+{
+	// boot services pool blocks can't grow
+	return false;
+}